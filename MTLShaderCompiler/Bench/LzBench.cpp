@@ -0,0 +1,123 @@
+// Measures how fast the LZ codec compresses and decompresses real metallibs.
+// Not part of the Xcode project; build it from the repository root with:
+//
+//   clang++ -std=gnu++11 -O2 -ISource MTLShaderCompiler/Bench/LzBench.cpp
+//       Source/Util/Lz.cpp Source/Util/Delta.cpp
+//       Source/Util/ShaderFileReader.cpp Source/Util/BinaryReader.cpp
+//       Source/Os/MappedFile_posix.cpp
+//       -o LzBench
+//
+// and run it on some .shd files (whose permutations are each compressed on
+// their own, as --compress does) or raw .metallib files.
+
+#include <chrono>
+#include <string.h>
+#include <stdio.h>
+#include <vector>
+#include <Os/MappedFile.h>
+#include <Util/Lz.h>
+#include <Util/ShaderFileReader.h>
+
+const double MIN_SECONDS = 1.0;
+
+// Collects the metallibs in a .shd file, or the whole file if it isn't one.
+static bool AddSamples(const char* path, std::vector<std::vector<u8> >* samples)
+{
+    MappedFile file;
+    if (!file.Open(path))
+        return false;
+
+    ShaderFileReader reader;
+    if (!reader.Open(file.Data(), file.Size())) {
+        samples->push_back(
+            std::vector<u8>(file.Data(), file.Data() + file.Size()));
+        return true;
+    }
+
+    for (size_t i = 0; i < reader.GetPermutationCount(); ++i) {
+        ShaderPermutation permutation;
+        std::vector<u8> bytes;
+        if (!reader.GetPermutation(i, &permutation) ||
+            !reader.GetPermutationBytes(permutation, &bytes))
+            return false;
+        samples->push_back(bytes);
+    }
+    return true;
+}
+
+// Runs 'func' over every sample until at least MIN_SECONDS have passed, and
+// returns the throughput in MB/s of uncompressed data.
+template <typename Func>
+static double Measure(const std::vector<std::vector<u8> >& samples,
+                      size_t totalBytes, Func func)
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    double seconds = 0;
+    size_t rounds = 0;
+    do {
+        for (size_t i = 0; i < samples.size(); ++i)
+            func(i);
+        ++rounds;
+        seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (seconds < MIN_SECONDS);
+    return (double)totalBytes * rounds / seconds / 1e6;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: LzBench file.shd|file.metallib ...\n");
+        return 1;
+    }
+
+    std::vector<std::vector<u8> > samples;
+    for (int i = 1; i < argc; ++i) {
+        if (!AddSamples(argv[i], &samples)) {
+            fprintf(stderr, "error: can't read %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    size_t totalBytes = 0;
+    for (const std::vector<u8>& sample : samples)
+        totalBytes += sample.size();
+    if (totalBytes == 0) {
+        fprintf(stderr, "error: no data\n");
+        return 1;
+    }
+
+    std::vector<std::vector<u8> > compressed(samples.size());
+    double compressMBps = Measure(samples, totalBytes, [&](size_t i) {
+        LzCompress(samples[i].data(), samples[i].size(), &compressed[i]);
+    });
+
+    size_t compressedBytes = 0;
+    for (const std::vector<u8>& block : compressed)
+        compressedBytes += block.size();
+
+    std::vector<u8> output;
+    bool ok = true;
+    double decompressMBps = Measure(samples, totalBytes, [&](size_t i) {
+        output.resize(samples[i].size());
+        ok &= LzDecompress(compressed[i].data(), compressed[i].size(),
+                           output.data(), output.size());
+    });
+
+    for (size_t i = 0; i < samples.size() && ok; ++i) {
+        output.resize(samples[i].size());
+        ok = LzDecompress(compressed[i].data(), compressed[i].size(),
+                          output.data(), output.size()) &&
+             memcmp(output.data(), samples[i].data(), output.size()) == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "error: data didn't survive the round trip\n");
+        return 1;
+    }
+
+    printf("%zu blocks, %zu bytes -> %zu bytes (%.1f%%)\n", samples.size(),
+           totalBytes, compressedBytes, 100.0 * compressedBytes / totalBytes);
+    printf("compress:   %8.1f MB/s\n", compressMBps);
+    printf("decompress: %8.1f MB/s\n", decompressMBps);
+    return 0;
+}
@@ -0,0 +1,142 @@
+// Compares FindOptionIfDefs against the std::getline scanner that it
+// replaced, on large generated shaders. Not part of the Xcode project; build
+// it from the repository root with:
+//
+//   clang++ -std=gnu++11 -O2 -ISource -IMTLShaderCompiler/Source
+//       MTLShaderCompiler/Bench/OptionScannerBench.cpp
+//       MTLShaderCompiler/Source/OptionScanner.cpp
+//       Source/Os/MappedFile_posix.cpp -o OptionScannerBench
+//
+// and run it with an optional line count (default 50000).
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "OptionScanner.h"
+
+const int NUM_RUNS = 20;
+
+// The scanner from before FindOptionIfDefs used a mapped file.
+static void FindOptionIfDefsGetline(const char* path, IfdefMap* map)
+{
+    std::ifstream infile(path);
+
+    std::string line;
+    while (std::getline(infile, line)) {
+        std::string::size_type pos = line.find("#ifdef ");
+        if (pos == std::string::npos)
+            continue;
+
+        pos += 6; // StrLen("#ifdef") == 6
+        for ( ; pos < line.length() && isspace(line[pos]); ++pos)
+             ;
+
+        if (pos + 4 > line.length()) continue; // StrLen("F_##") == 4
+        if (line[pos++] != 'F') continue;
+        if (line[pos++] != '_') continue;
+        if (!isdigit(line[pos])) continue;
+        int digit1 = line[pos++] - '0';
+        if (!isdigit(line[pos])) continue;
+        int digit2 = line[pos++] - '0';
+
+        std::string::size_type endPos = pos;
+        for (; endPos < line.length() && !isspace(line[endPos]); ++endPos)
+            ;
+        std::string::size_type startPos = pos - 4; // StrLen("F_##") == 4
+        std::string ifdef = line.substr(pos - 4, endPos - startPos);
+
+        int index = digit1 * 10 + digit2;
+        (*map)[index] = ifdef;
+    }
+}
+
+// Something like generated shader code: mostly ordinary lines, with option
+// blocks, other directives and a few awkward cases mixed in.
+static std::string GenerateShader(int nLines)
+{
+    std::string text;
+    char line[128];
+    for (int i = 0; i < nLines; ++i) {
+        switch (i % 40) {
+        case 0:
+            snprintf(line, sizeof(line), "#ifdef F_%02d_OPTION_%d\n",
+                     i / 40 % 64, i / 40 % 64);
+            break;
+        case 1:
+            snprintf(line, sizeof(line), "#ifdef  F_%02d_TABBED\t// x\r\n",
+                     i / 40 % 64);
+            break;
+        case 2:
+            snprintf(line, sizeof(line), "    #define VALUE_%d %d\n", i, i);
+            break;
+        case 3:
+            snprintf(line, sizeof(line), "/* #ifdef G_%d */ #ifdef F_1\n", i);
+            break;
+        case 4:
+        case 5:
+            snprintf(line, sizeof(line), "#endif\n");
+            break;
+        default:
+            snprintf(line, sizeof(line),
+                     "    float4 v%d = a * float4(%d.0, 1.0, 0.5, 2.0) + b;\n",
+                     i, i);
+            break;
+        }
+        text += line;
+    }
+    return text;
+}
+
+template <typename Func>
+static double TimeRuns(Func func, const char* path, IfdefMap* map)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < NUM_RUNS; ++i) {
+        map->clear();
+        func(path, map);
+    }
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count() / NUM_RUNS;
+}
+
+int main(int argc, char** argv)
+{
+    int nLines = argc > 1 ? atoi(argv[1]) : 50000;
+
+    char path[] = "/tmp/OptionScannerBench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    std::string text = GenerateShader(nLines);
+    bool written = write(fd, text.data(), text.size()) == (ssize_t)text.size();
+    close(fd);
+    if (!written) {
+        perror("write");
+        unlink(path);
+        return 1;
+    }
+
+    IfdefMap getlineMap;
+    IfdefMap scannerMap;
+    double getlineMs = TimeRuns(FindOptionIfDefsGetline, path, &getlineMap);
+    double scannerMs = TimeRuns(FindOptionIfDefs, path, &scannerMap);
+    unlink(path);
+
+    printf("%d lines, %zu bytes, %zu options\n", nLines, text.size(),
+           scannerMap.size());
+    printf("getline: %8.3f ms\n", getlineMs);
+    printf("mapped:  %8.3f ms (%.1fx)\n", scannerMs, getlineMs / scannerMs);
+
+    if (scannerMap != getlineMap) {
+        fprintf(stderr, "error: the scanners found different options\n");
+        return 1;
+    }
+    return 0;
+}
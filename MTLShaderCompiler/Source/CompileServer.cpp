@@ -0,0 +1,90 @@
+#include "CompileServer.h"
+
+#include <Core/Macros.h>
+#include <Os/LocalSocket.h>
+#include "WireFormat.h"
+
+// Messages are a header and a list of strings, in the encoding of
+// WireFormat.h.
+const char* const REQUEST_MAGIC = "MSCQ";
+const char* const RESPONSE_MAGIC = "MSCA";
+const u32 PROTOCOL_VERSION = 1;
+
+// Anything bigger is a broken or foreign client.
+const u32 MAX_STRING_LENGTH = 64 * 1024 * 1024;
+const u32 MAX_STRINGS = 64 * 1024;
+
+// Connections are served one at a time, so a client that stops sending its
+// request, or reading its response, for this long is dropped rather than
+// holding up everyone else's builds. A client sends its request as soon as
+// it connects, and waits for the response with no timeout of its own.
+const unsigned CONNECTION_TIMEOUT_SECONDS = 10;
+
+static bool ReceiveRequest(LocalSocket& socket, CompileRequest* request)
+{
+    return WireReceiveHeader(socket, REQUEST_MAGIC, PROTOCOL_VERSION) &&
+           WireReceiveString(socket, MAX_STRING_LENGTH,
+                             &request->workingDir) &&
+           WireReceiveStrings(socket, MAX_STRINGS, MAX_STRING_LENGTH,
+                              &request->args);
+}
+
+bool CompileServerRun(const char* socketPath, const CompileRequestFunc& func)
+{
+    LocalSocketListener listener;
+    if (!listener.Listen(socketPath))
+        return false;
+
+    for (;;) {
+        LocalSocket socket;
+        listener.Accept(&socket);
+        socket.SetTimeout(CONNECTION_TIMEOUT_SECONDS);
+
+        CompileRequest request;
+        if (!ReceiveRequest(socket, &request))
+            continue;
+
+        CompileResponse response;
+        func(request, &response);
+
+        std::vector<u8> message;
+        WireAppendHeader(&message, RESPONSE_MAGIC, PROTOCOL_VERSION);
+        WireAppend32(&message, response.success ? 1 : 0);
+        WireAppendString(&message, response.errorOutput);
+
+        // If the client has gone, there's nobody to tell.
+        socket.SendAll(message.data(), message.size());
+    }
+}
+
+bool CompileServerSend(const char* socketPath, const CompileRequest& request,
+                       CompileResponse* response)
+{
+    ASSERT(response);
+
+    LocalSocket socket;
+    if (!socket.Connect(socketPath))
+        return false;
+
+    std::vector<u8> message;
+    WireAppendHeader(&message, REQUEST_MAGIC, PROTOCOL_VERSION);
+    WireAppendString(&message, request.workingDir);
+    WireAppendStrings(&message, request.args);
+
+    // Running the build again locally would most likely fail the way the
+    // server did, so a server that goes away fails the build instead.
+    u32 success;
+    if (!socket.SendAll(message.data(), message.size()) ||
+        !WireReceiveHeader(socket, RESPONSE_MAGIC, PROTOCOL_VERSION) ||
+        !WireReceive32(socket, &success) ||
+        !WireReceiveString(socket, MAX_STRING_LENGTH,
+                           &response->errorOutput)) {
+        response->success = false;
+        response->errorOutput = std::string("The compile server at ") +
+                                socketPath + " stopped during the build\n";
+        return true;
+    }
+
+    response->success = success != 0;
+    return true;
+}
@@ -0,0 +1,34 @@
+#ifndef COMPILESERVER_H
+#define COMPILESERVER_H
+
+#include <string>
+#include <vector>
+#include <functional>
+
+// A build to run on the server, as the client's command line.
+struct CompileRequest {
+    // The client's working directory, which relative paths are relative to.
+    std::string workingDir;
+    std::vector<std::string> args;
+};
+
+struct CompileResponse {
+    bool success;
+    // What the client should print to stderr.
+    std::string errorOutput;
+};
+
+typedef std::function<void(const CompileRequest& request,
+                           CompileResponse* response)> CompileRequestFunc;
+
+// Listens on the socket file at socketPath and calls func for each request,
+// one at a time. Only returns (false) if it can't listen there.
+bool CompileServerRun(const char* socketPath, const CompileRequestFunc& func);
+
+// Sends a request to the server and waits for its response. Returns false if
+// there is no server. If it goes away before responding, the response is a
+// failure that says so.
+bool CompileServerSend(const char* socketPath, const CompileRequest& request,
+                       CompileResponse* response);
+
+#endif // COMPILESERVER_H
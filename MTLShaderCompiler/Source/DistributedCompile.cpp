@@ -0,0 +1,576 @@
+#include "DistributedCompile.h"
+#include "WireFormat.h"
+
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#include <Core/Macros.h>
+
+// A shard request is a header and then the request's fields, in the
+// encoding of WireFormat.h. The worker answers with a header, then a result
+// for each permutation as it finishes (its id, status and output), then
+// SHARD_END. The coordinator replies to each result with a byte: 0 if the
+// rest of the shard has been done by another worker, and should be skipped.
+// Between results, the worker sends SHARD_KEEPALIVE every
+// SHARD_KEEPALIVE_SECONDS, which gets no reply.
+const char* const SHARD_REQUEST_MAGIC = "MSSQ";
+const char* const SHARD_RESULTS_MAGIC = "MSSA";
+const u32 SHARD_PROTOCOL_VERSION = 4;
+const u32 SHARD_END = 0xffffffff;
+const u32 SHARD_KEEPALIVE = 0xfffffffe;
+
+// Small enough for several shards per worker even for a modest shader, and
+// large enough that each shard's round trip is lost in its compile time.
+const size_t SHARD_SIZE = 16;
+
+// However long a permutation takes to compile, a working worker sends
+// something every SHARD_KEEPALIVE_SECONDS, so one that sends nothing for
+// SHARD_TIMEOUT_SECONDS has hung, or lost its connection without either end
+// hearing about it.
+const unsigned SHARD_KEEPALIVE_SECONDS = 10;
+const unsigned SHARD_TIMEOUT_SECONDS = 60;
+
+// Anything bigger is a broken or foreign peer.
+const u32 MAX_STRING_LENGTH = 256 * 1024 * 1024;
+const u32 MAX_STRINGS = 64 * 1024;
+
+static bool ReceiveShardRequest(TcpSocket& socket, ShardRequest* request)
+{
+    u32 sharedLibraries;
+    u32 nPermutations;
+    if (!WireReceiveHeader(socket, SHARD_REQUEST_MAGIC,
+                           SHARD_PROTOCOL_VERSION) ||
+        !WireReceiveString(socket, MAX_STRING_LENGTH, &request->workingDir) ||
+        !WireReceiveString(socket, MAX_STRING_LENGTH, &request->projectRoot) ||
+        !WireReceiveString(socket, MAX_STRING_LENGTH, &request->inputPath) ||
+        !WireReceiveStrings(socket, MAX_STRINGS, MAX_STRING_LENGTH,
+                            &request->includeDirs) ||
+        !WireReceive32(socket, &sharedLibraries) || sharedLibraries > 1 ||
+        !WireReceive32(socket, &nPermutations) || nPermutations > MAX_STRINGS)
+        return false;
+    request->sharedLibraries = sharedLibraries != 0;
+
+    request->permutations.resize(nPermutations);
+    for (ShardPermutation& permutation : request->permutations) {
+        u32 maskLow;
+        u32 maskHigh;
+        std::string digest;
+        if (!WireReceive32(socket, &permutation.id) ||
+            !WireReceive32(socket, &maskLow) ||
+            !WireReceive32(socket, &maskHigh) ||
+            !WireReceiveStrings(socket, MAX_STRINGS, MAX_STRING_LENGTH,
+                                &permutation.macros) ||
+            !WireReceiveString(socket, MAX_STRING_LENGTH, &digest) ||
+            digest.size() != Sha256Digest::SIZE)
+            return false;
+        permutation.permuteMask = ((u64)maskHigh << 32) | maskLow;
+        memcpy(permutation.inputDigest.bytes, digest.data(), digest.size());
+    }
+    return true;
+}
+
+// Answers shard requests on one connection until the coordinator closes it.
+static void ServeCoordinator(TcpSocket& socket, const ShardCompileFunc& func)
+{
+    ShardRequest request;
+    while (ReceiveShardRequest(socket, &request)) {
+        std::vector<u8> message;
+        WireAppendHeader(&message, SHARD_RESULTS_MAGIC, SHARD_PROTOCOL_VERSION);
+        std::atomic<bool> connected(
+            socket.SendAll(message.data(), message.size()));
+
+        // Keepalives are sent from a thread of their own while the shard is
+        // compiled. Only sends are shared with it; the replies to results
+        // are only read here.
+        std::mutex sendMutex;
+        std::condition_variable compiled;
+        bool finished = false;
+        std::thread keepalive([&]() {
+            std::vector<u8> keepaliveMessage;
+            WireAppend32(&keepaliveMessage, SHARD_KEEPALIVE);
+            std::unique_lock<std::mutex> lock(sendMutex);
+            while (!compiled.wait_for(
+                       lock, std::chrono::seconds(SHARD_KEEPALIVE_SECONDS),
+                       [&]() { return finished; })) {
+                if (connected && !socket.SendAll(keepaliveMessage.data(),
+                                                 keepaliveMessage.size()))
+                    connected = false;
+            }
+        });
+
+        // Waiting for each reply holds up starting the next compile by a
+        // round trip, which is nothing next to the compile itself.
+        bool wanted = true;
+        func(request, [&](const ShardResult& result) -> bool {
+            if (!connected || !wanted)
+                return false;
+            message.clear();
+            WireAppend32(&message, result.id);
+            WireAppend32(&message, (u32)result.status);
+            WireAppendString(&message, result.output);
+            bool sent;
+            {
+                std::lock_guard<std::mutex> lock(sendMutex);
+                sent = socket.SendAll(message.data(), message.size());
+            }
+            u8 reply = 0;
+            if (!sent || !socket.ReceiveAll(&reply, 1))
+                connected = false;
+            wanted = connected && reply != 0;
+            return wanted;
+        });
+
+        {
+            std::lock_guard<std::mutex> lock(sendMutex);
+            finished = true;
+        }
+        compiled.notify_one();
+        keepalive.join();
+
+        message.clear();
+        WireAppend32(&message, SHARD_END);
+        if (!connected || !socket.SendAll(message.data(), message.size()))
+            return;
+    }
+}
+
+bool ShardWorkerRun(const char* address, const ShardCompileFunc& func)
+{
+    TcpSocketListener listener;
+    if (!listener.Listen(address))
+        return false;
+
+    for (;;) {
+        TcpSocket socket;
+        listener.Accept(&socket);
+        ServeCoordinator(socket, func);
+    }
+}
+
+LoopbackShardWorkers::LoopbackShardWorkers(
+    const std::vector<ShardCompileFunc>& funcs,
+    std::vector<std::string>* addresses)
+    : m_addresses()
+    , m_threads()
+{
+    ASSERT(addresses);
+
+    for (const ShardCompileFunc& func : funcs) {
+        TcpSocketListener* listener = new TcpSocketListener;
+        if (!listener->Listen("127.0.0.1:0"))
+            FATAL("Could not listen on a loopback port");
+        m_addresses.push_back(listener->GetAddress());
+        addresses->push_back(m_addresses.back());
+
+        m_threads.push_back(std::thread([listener, func]() {
+            std::unique_ptr<TcpSocketListener> owned(listener);
+            TcpSocket socket;
+            owned->Accept(&socket);
+            ServeCoordinator(socket, func);
+        }));
+    }
+}
+
+LoopbackShardWorkers::~LoopbackShardWorkers()
+{
+    // A worker that the coordinator never connected to is still waiting for
+    // a connection; one that closes straight away lets it finish.
+    for (const std::string& address : m_addresses) {
+        TcpSocket socket;
+        socket.Connect(address.c_str());
+    }
+    for (std::thread& thread : m_threads)
+        thread.join();
+}
+
+// Hands out shards to the coordinator's worker threads, and collects their
+// results for the calling thread.
+class ShardScheduler {
+public:
+    ShardScheduler(const std::vector<u32>& shaderIndices, size_t nWorkers);
+
+    // For the worker threads. A worker's socket is registered so that Stop()
+    // can break its connection.
+    bool AddWorker(size_t worker, TcpSocket* socket);
+    bool Take(size_t worker, std::vector<u32>* shard);
+    // Returns false once the worker has nothing left to do in its shard.
+    bool Post(size_t worker, ShardResult& result);
+    // 'completed' is false if the connection failed partway.
+    void EndShard(size_t worker, bool completed);
+    void RemoveWorker(size_t worker);
+
+    // For the calling thread. Returns false once there will be no more
+    // results.
+    bool WaitForResults(std::vector<ShardResult>* results);
+    void Stop();
+    std::vector<u32> GetLeftovers() const;
+
+private:
+    ShardScheduler(const ShardScheduler&);
+    ShardScheduler& operator=(const ShardScheduler&);
+
+    struct Worker {
+        TcpSocket* socket;
+        bool busy;
+        std::vector<u32> shard;
+        // Set if another worker has taken over what's left of the shard.
+        bool stolen;
+    };
+
+    bool IsFinished() const;
+    bool IsHeldByOtherWorker(size_t worker, u32 i) const;
+
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+
+    std::deque<std::vector<u32> > m_queue;
+    std::vector<Worker> m_workers;
+    size_t m_nLiveWorkers;
+    // Permutations get done by a result, or by being left to compile
+    // locally.
+    std::vector<bool> m_done;
+    size_t m_nUndone;
+    std::vector<ShardResult> m_results;
+    std::vector<u32> m_leftovers;
+    bool m_failed;
+    bool m_stopping;
+};
+
+ShardScheduler::ShardScheduler(const std::vector<u32>& shaderIndices,
+                               size_t nWorkers)
+    : m_mutex()
+    , m_changed()
+    , m_queue()
+    , m_workers(nWorkers)
+    , m_nLiveWorkers(nWorkers)
+    , m_done(shaderIndices.size(), false)
+    , m_nUndone(shaderIndices.size())
+    , m_results()
+    , m_leftovers()
+    , m_failed(false)
+    , m_stopping(false)
+{
+    // Each shard has permutations of one shader only.
+    for (u32 i = 0; i < shaderIndices.size(); ++i) {
+        if (i == 0 || shaderIndices[i] != shaderIndices[i - 1] ||
+            m_queue.back().size() == SHARD_SIZE)
+            m_queue.push_back(std::vector<u32>());
+        m_queue.back().push_back(i);
+    }
+
+    for (Worker& worker : m_workers) {
+        worker.socket = NULL;
+        worker.busy = false;
+        worker.stolen = false;
+    }
+}
+
+bool ShardScheduler::AddWorker(size_t worker, TcpSocket* socket)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_stopping)
+        return false;
+    m_workers[worker].socket = socket;
+    return true;
+}
+
+bool ShardScheduler::Take(size_t worker, std::vector<u32>* shard)
+{
+    ASSERT(shard);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        if (m_stopping || m_failed || m_nUndone == 0)
+            return false;
+
+        while (!m_queue.empty()) {
+            shard->clear();
+            for (u32 i : m_queue.front()) {
+                if (!m_done[i])
+                    shard->push_back(i);
+            }
+            m_queue.pop_front();
+            if (!shard->empty()) {
+                m_workers[worker].busy = true;
+                m_workers[worker].shard = *shard;
+                m_workers[worker].stolen = false;
+                return true;
+            }
+        }
+
+        // Steal from the busy worker with the most left to do, starting
+        // from the other end of its shard, so that the two meet in the
+        // middle. Each shard is only stolen once.
+        size_t victim = m_workers.size();
+        size_t mostUndone = 0;
+        bool anyBusy = false;
+        for (size_t other = 0; other < m_workers.size(); ++other) {
+            const Worker& candidate = m_workers[other];
+            anyBusy = anyBusy || candidate.busy;
+            if (!candidate.busy || candidate.stolen)
+                continue;
+            size_t undone = 0;
+            for (u32 i : candidate.shard)
+                undone += m_done[i] ? 0 : 1;
+            if (undone > mostUndone) {
+                victim = other;
+                mostUndone = undone;
+            }
+        }
+        if (victim != m_workers.size()) {
+            const std::vector<u32>& victimShard = m_workers[victim].shard;
+            shard->clear();
+            for (auto i = victimShard.rbegin(); i != victimShard.rend(); ++i) {
+                if (!m_done[*i])
+                    shard->push_back(*i);
+            }
+            m_workers[victim].stolen = true;
+            m_workers[worker].busy = true;
+            m_workers[worker].shard = *shard;
+            m_workers[worker].stolen = true;
+            return true;
+        }
+
+        // A busy worker's connection may yet fail, and put its shard back.
+        if (!anyBusy)
+            return false;
+        m_changed.wait(lock);
+    }
+}
+
+bool ShardScheduler::Post(size_t worker, ShardResult& result)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_done[result.id]) {
+        m_done[result.id] = true;
+        --m_nUndone;
+        if (result.status == SHARD_RESULT_UNAVAILABLE) {
+            m_leftovers.push_back(result.id);
+        } else {
+            if (result.status == SHARD_RESULT_FAILED)
+                m_failed = true;
+            m_results.push_back(ShardResult());
+            std::swap(m_results.back(), result);
+        }
+        m_changed.notify_all();
+    }
+
+    if (m_stopping || m_failed)
+        return false;
+    for (u32 i : m_workers[worker].shard) {
+        if (!m_done[i])
+            return true;
+    }
+    return false;
+}
+
+void ShardScheduler::EndShard(size_t worker, bool completed)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Worker& ended = m_workers[worker];
+    ended.busy = false;
+
+    // What a failed connection didn't finish goes back in the queue for
+    // another worker. What a worker finished without a result for, it
+    // couldn't compile, unless another worker is still on it.
+    std::vector<u32> undone;
+    for (u32 i : ended.shard) {
+        if (m_done[i] || IsHeldByOtherWorker(worker, i))
+            continue;
+        if (completed) {
+            m_done[i] = true;
+            --m_nUndone;
+            m_leftovers.push_back(i);
+        } else {
+            undone.push_back(i);
+        }
+    }
+    if (!undone.empty())
+        m_queue.push_front(undone);
+    ended.shard.clear();
+    m_changed.notify_all();
+}
+
+bool ShardScheduler::IsHeldByOtherWorker(size_t worker, u32 i) const
+{
+    for (size_t other = 0; other < m_workers.size(); ++other) {
+        const std::vector<u32>& shard = m_workers[other].shard;
+        if (other != worker && m_workers[other].busy &&
+            std::find(shard.begin(), shard.end(), i) != shard.end())
+            return true;
+    }
+    return false;
+}
+
+void ShardScheduler::RemoveWorker(size_t worker)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_workers[worker].socket = NULL;
+    --m_nLiveWorkers;
+    m_changed.notify_all();
+}
+
+bool ShardScheduler::IsFinished() const
+{
+    return m_nUndone == 0 || m_nLiveWorkers == 0 || m_failed;
+}
+
+bool ShardScheduler::WaitForResults(std::vector<ShardResult>* results)
+{
+    ASSERT(results);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_changed.wait(lock, [this]() {
+        return !m_results.empty() || IsFinished();
+    });
+    results->clear();
+    results->swap(m_results);
+    return !results->empty() || !IsFinished();
+}
+
+void ShardScheduler::Stop()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stopping = true;
+    for (Worker& worker : m_workers) {
+        if (worker.socket)
+            worker.socket->Shutdown();
+    }
+    m_changed.notify_all();
+}
+
+std::vector<u32> ShardScheduler::GetLeftovers() const
+{
+    // After a failure, nothing more gets compiled.
+    std::vector<u32> leftovers;
+    if (m_failed)
+        return leftovers;
+
+    leftovers = m_leftovers;
+    for (u32 i = 0; i < m_done.size(); ++i) {
+        if (!m_done[i])
+            leftovers.push_back(i);
+    }
+    std::sort(leftovers.begin(), leftovers.end());
+    return leftovers;
+}
+
+static bool SendShard(TcpSocket& socket, const ShardRequest& shader,
+                      const std::vector<ShardPermutation>& permutations,
+                      const std::vector<u32>& shard)
+{
+    std::vector<u8> message;
+    WireAppendHeader(&message, SHARD_REQUEST_MAGIC, SHARD_PROTOCOL_VERSION);
+    WireAppendString(&message, shader.workingDir);
+    WireAppendString(&message, shader.projectRoot);
+    WireAppendString(&message, shader.inputPath);
+    WireAppendStrings(&message, shader.includeDirs);
+    WireAppend32(&message, shader.sharedLibraries ? 1 : 0);
+    WireAppend32(&message, (u32)shard.size());
+    for (u32 i : shard) {
+        const ShardPermutation& permutation = permutations[i];
+        WireAppend32(&message, i);
+        WireAppend32(&message, (u32)permutation.permuteMask);
+        WireAppend32(&message, (u32)(permutation.permuteMask >> 32));
+        WireAppendStrings(&message, permutation.macros);
+        WireAppendString(&message, std::string(
+            (const char*)permutation.inputDigest.bytes, Sha256Digest::SIZE));
+    }
+    return socket.SendAll(message.data(), message.size());
+}
+
+// Returns false if the connection failed, or the worker sent a result for a
+// permutation it wasn't given.
+static bool ReceiveResults(TcpSocket& socket, size_t worker,
+                           const std::vector<u32>& shard,
+                           ShardScheduler* scheduler)
+{
+    if (!WireReceiveHeader(socket, SHARD_RESULTS_MAGIC,
+                           SHARD_PROTOCOL_VERSION))
+        return false;
+
+    for (;;) {
+        ShardResult result;
+        u32 status;
+        if (!WireReceive32(socket, &result.id))
+            return false;
+        if (result.id == SHARD_END)
+            return true;
+        if (result.id == SHARD_KEEPALIVE)
+            continue;
+        if (!WireReceive32(socket, &status) ||
+            status > SHARD_RESULT_UNAVAILABLE ||
+            !WireReceiveString(socket, MAX_STRING_LENGTH, &result.output) ||
+            std::find(shard.begin(), shard.end(), result.id) == shard.end())
+            return false;
+
+        result.status = (ShardResultStatus)status;
+        u8 reply = scheduler->Post(worker, result) ? 1 : 0;
+        if (!socket.SendAll(&reply, 1))
+            return false;
+    }
+}
+
+static void RunWorkerConnection(
+    ShardScheduler* scheduler, size_t worker, const std::string& address,
+    const std::vector<ShardRequest>& shaders,
+    const std::vector<u32>& shaderIndices,
+    const std::vector<ShardPermutation>& permutations)
+{
+    TcpSocket socket;
+    if (socket.Connect(address.c_str()) &&
+        scheduler->AddWorker(worker, &socket)) {
+        // A timeout fails the connection, which hands its shard back to the
+        // scheduler for another worker.
+        socket.SetTimeout(SHARD_TIMEOUT_SECONDS);
+        std::vector<u32> shard;
+        while (scheduler->Take(worker, &shard)) {
+            const ShardRequest& shader = shaders[shaderIndices[shard[0]]];
+            bool completed = SendShard(socket, shader, permutations, shard) &&
+                             ReceiveResults(socket, worker, shard,
+                                            scheduler);
+            scheduler->EndShard(worker, completed);
+            if (!completed)
+                break;
+        }
+    }
+    scheduler->RemoveWorker(worker);
+}
+
+std::vector<u32> ShardCoordinatorRun(
+    const std::vector<std::string>& workers,
+    const std::vector<ShardRequest>& shaders,
+    const std::vector<u32>& shaderIndices,
+    const std::vector<ShardPermutation>& permutations,
+    const std::function<void(u32 i, ShardResult& result)>& func)
+{
+    ASSERT(shaderIndices.size() == permutations.size());
+
+    ShardScheduler scheduler(shaderIndices, workers.size());
+    std::vector<std::thread> threads;
+    for (size_t worker = 0; worker < workers.size(); ++worker) {
+        threads.push_back(std::thread(
+            RunWorkerConnection, &scheduler, worker, std::cref(workers[worker]),
+            std::cref(shaders), std::cref(shaderIndices),
+            std::cref(permutations)));
+    }
+
+    std::vector<ShardResult> results;
+    while (scheduler.WaitForResults(&results)) {
+        for (ShardResult& result : results)
+            func(result.id, result);
+    }
+
+    // Workers still compiling stolen copies of finished permutations are
+    // cut off.
+    scheduler.Stop();
+    for (std::thread& thread : threads)
+        thread.join();
+
+    return scheduler.GetLeftovers();
+}
@@ -0,0 +1,118 @@
+#ifndef DISTRIBUTEDCOMPILE_H
+#define DISTRIBUTEDCOMPILE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <functional>
+#include <Core/Types.h>
+#include <Os/TcpSocket.h>
+#include <Util/Sha256.h>
+
+// Compiling a shader's permutations on other machines. A coordinator splits
+// the permutations into shards and sends them to workers, which compile them
+// and stream back each result as soon as it's ready.
+//
+// Workers compile the same files as the coordinator, at the same paths
+// (from a shared checkout, say): a shard names the files rather than
+// carrying them. Each permutation comes with its input digest, which the
+// worker checks against its own files and toolchain before compiling.
+//
+// Workers don't authenticate coordinators. Anyone who can connect to a
+// worker can have it compile any file it can read, and get the compiler's
+// output back, errors quoting the source included. A worker should only
+// listen on a loopback address, or on a network where everyone is trusted.
+
+struct ShardPermutation {
+    // Identifies the permutation to the coordinator.
+    u32 id;
+    u64 permuteMask;
+    std::vector<std::string> macros;
+    Sha256Digest inputDigest;
+};
+
+// Some permutations of one shader to compile.
+struct ShardRequest {
+    // The coordinator's working directory, which relative paths are
+    // relative to.
+    std::string workingDir;
+    // The absolute path that the permutations' digests take paths relative
+    // to.
+    std::string projectRoot;
+    std::string inputPath;
+    std::vector<std::string> includeDirs;
+    // Whether the coordinator links the permutations into shared libraries
+    // itself, in which case they are only compiled to AIR.
+    bool sharedLibraries;
+    std::vector<ShardPermutation> permutations;
+};
+
+enum ShardResultStatus {
+    SHARD_RESULT_SUCCEEDED,
+    SHARD_RESULT_FAILED,
+    // The worker can't compile the permutation, because its files or
+    // toolchain don't match the coordinator's.
+    SHARD_RESULT_UNAVAILABLE
+};
+
+struct ShardResult {
+    u32 id;
+    ShardResultStatus status;
+    // The metallib (or the AIR, for shared libraries) if the compile
+    // succeeded, or the compiler's errors.
+    std::string output;
+};
+
+// Sends one result back to the coordinator. Returns false if the coordinator
+// has gone, or doesn't want the rest of the shard.
+typedef std::function<bool(const ShardResult& result)> ShardResultFunc;
+// Compiles a shard on a worker, giving a result for each permutation.
+typedef std::function<void(const ShardRequest& request,
+                           const ShardResultFunc& sendResult)> ShardCompileFunc;
+
+// Serves the coordinators that connect to 'address', one at a time. Only
+// returns (false) if it can't listen there. See above before listening on
+// anything but a loopback address.
+bool ShardWorkerRun(const char* address, const ShardCompileFunc& func);
+
+// Workers on threads of this process, each serving one coordinator
+// connection on a loopback port, so that a distributed build can run on one
+// machine.
+class LoopbackShardWorkers {
+public:
+    // Starts a worker for each function, and adds their addresses to
+    // 'addresses'.
+    LoopbackShardWorkers(const std::vector<ShardCompileFunc>& funcs,
+                         std::vector<std::string>* addresses);
+    // Waits for the workers, whose connections must have been closed.
+    ~LoopbackShardWorkers();
+
+private:
+    LoopbackShardWorkers(const LoopbackShardWorkers&);
+    LoopbackShardWorkers& operator=(const LoopbackShardWorkers&);
+
+    std::vector<std::string> m_addresses;
+    std::vector<std::thread> m_threads;
+};
+
+// Compiles permutations[i] (of the shader in shaders[shaderIndices[i]]) on
+// the workers at 'workers', calling 'func' with each result, on the calling
+// thread. Stops after a failure. Returns, in ascending order, the
+// permutations that no worker could compile (because none could be reached,
+// say), to compile locally. Workers send keepalives while they compile, so
+// however long a shard takes, one that sends nothing for too long is hung or
+// unreachable. It's treated as failed, and its shard is given to another.
+//
+// A worker that runs out of shards steals the unfinished part of the
+// slowest shard still being compiled, working from its other end. The first
+// result for each permutation is the one used, and a worker skips the rest
+// of its shard once the other has done it.
+std::vector<u32> ShardCoordinatorRun(
+    const std::vector<std::string>& workers,
+    const std::vector<ShardRequest>& shaders,
+    const std::vector<u32>& shaderIndices,
+    const std::vector<ShardPermutation>& permutations,
+    const std::function<void(u32 i, ShardResult& result)>& func);
+
+#endif // DISTRIBUTEDCOMPILE_H
@@ -0,0 +1,234 @@
+#include "Http.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sstream>
+
+#include <Core/Macros.h>
+
+// Anything longer is a broken or foreign peer.
+const size_t MAX_LINE_LENGTH = 8 * 1024;
+const size_t MAX_HEADERS = 100;
+
+const size_t RECEIVE_CHUNK_SIZE = 64 * 1024;
+
+static const char* GetReason(int status)
+{
+    switch (status) {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Payload Too Large";
+        default:  return "Unknown";
+    }
+}
+
+// Compares a header name case-insensitively.
+static bool IsHeader(const std::string& line, size_t colon, const char* name)
+{
+    size_t len = strlen(name);
+    if (colon != len)
+        return false;
+    for (size_t i = 0; i < len; ++i) {
+        if (tolower((unsigned char)line[i]) != name[i])
+            return false;
+    }
+    return true;
+}
+
+static std::string TrimHeaderValue(const std::string& line, size_t colon)
+{
+    size_t begin = colon + 1;
+    size_t end = line.size();
+    while (begin < end && (line[begin] == ' ' || line[begin] == '\t'))
+        ++begin;
+    while (end > begin && (line[end - 1] == ' ' || line[end - 1] == '\t'))
+        --end;
+    return line.substr(begin, end - begin);
+}
+
+HttpConnection::HttpConnection(TcpSocket* socket, size_t maxBodySize)
+    : m_socket(socket)
+    , m_maxBodySize(maxBodySize)
+    , m_output()
+    , m_input()
+    , m_inputPos(0)
+{
+    ASSERT(socket);
+}
+
+void HttpConnection::QueueRequest(const char* method, const std::string& path,
+                                  const std::string& host, const u8* body,
+                                  size_t bodySize)
+{
+    std::ostringstream head;
+    head << method << " " << path << " HTTP/1.1\r\n"
+         << "Host: " << host << "\r\n"
+         << "Content-Length: " << bodySize << "\r\n\r\n";
+    m_output += head.str();
+    m_output.append((const char*)body, bodySize);
+}
+
+void HttpConnection::QueueResponse(int status, const u8* body,
+                                   size_t bodySize)
+{
+    std::ostringstream head;
+    head << "HTTP/1.1 " << status << " " << GetReason(status) << "\r\n"
+         << "Content-Length: " << bodySize << "\r\n\r\n";
+    m_output += head.str();
+    m_output.append((const char*)body, bodySize);
+}
+
+bool HttpConnection::Flush()
+{
+    bool sent = m_socket->SendAll(m_output.data(), m_output.size());
+    m_output.clear();
+    return sent;
+}
+
+bool HttpConnection::ReceiveRequest(std::string* method, std::string* path,
+                                    std::vector<u8>* body)
+{
+    ASSERT(method);
+    ASSERT(path);
+    ASSERT(body);
+
+    std::string requestLine;
+    bool hasLength;
+    size_t length;
+    if (!ReceiveHead(&requestLine, &hasLength, &length))
+        return false;
+
+    // "METHOD path HTTP/1.x"
+    size_t space1 = requestLine.find(' ');
+    size_t space2 = requestLine.rfind(' ');
+    if (space1 == std::string::npos || space2 == space1 ||
+        requestLine.compare(space2 + 1, 7, "HTTP/1.") != 0)
+        return false;
+    *method = requestLine.substr(0, space1);
+    *path = requestLine.substr(space1 + 1, space2 - space1 - 1);
+
+    // Requests without a Content-Length have no body.
+    return ReceiveBytes(hasLength ? length : 0, body);
+}
+
+bool HttpConnection::ReceiveResponse(int* status, std::vector<u8>* body)
+{
+    ASSERT(status);
+    ASSERT(body);
+
+    // Skip informational responses such as "100 Continue".
+    std::string statusLine;
+    bool hasLength;
+    size_t length;
+    do {
+        if (!ReceiveHead(&statusLine, &hasLength, &length))
+            return false;
+
+        // "HTTP/1.x status reason"
+        if (statusLine.compare(0, 7, "HTTP/1.") != 0 ||
+            statusLine.size() < 12 || statusLine[8] != ' ')
+            return false;
+        *status = atoi(statusLine.c_str() + 9);
+    } while (*status >= 100 && *status < 200);
+
+    // Only these responses may have no Content-Length; for anything else,
+    // the body would run to the end of the connection.
+    if (!hasLength) {
+        if (*status != 204 && *status != 304)
+            return false;
+        length = 0;
+    }
+    return ReceiveBytes(length, body);
+}
+
+bool HttpConnection::ReceiveHead(std::string* startLine, bool* hasLength,
+                                 size_t* length)
+{
+    if (!ReceiveLine(startLine))
+        return false;
+
+    *hasLength = false;
+    *length = 0;
+    std::string line;
+    for (size_t nHeaders = 0; ; ++nHeaders) {
+        if (nHeaders > MAX_HEADERS || !ReceiveLine(&line))
+            return false;
+        if (line.empty())
+            return true;
+
+        size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            return false;
+
+        if (IsHeader(line, colon, "content-length")) {
+            std::string value = TrimHeaderValue(line, colon);
+            char* end;
+            unsigned long long n = strtoull(value.c_str(), &end, 10);
+            if (value.empty() || *end != '\0' || !isdigit(value[0]) ||
+                n > m_maxBodySize)
+                return false;
+            *hasLength = true;
+            *length = (size_t)n;
+        } else if (IsHeader(line, colon, "transfer-encoding")) {
+            return false;
+        }
+    }
+}
+
+bool HttpConnection::ReceiveLine(std::string* line)
+{
+    line->clear();
+    for (;;) {
+        if (m_inputPos == m_input.size() && !FillBuffer())
+            return false;
+
+        const u8* begin = m_input.data() + m_inputPos;
+        const u8* end = m_input.data() + m_input.size();
+        const u8* newline = (const u8*)memchr(begin, '\n', end - begin);
+        const u8* stop = newline ? newline : end;
+        line->append((const char*)begin, stop - begin);
+        m_inputPos = stop - m_input.data();
+        if (line->size() > MAX_LINE_LENGTH)
+            return false;
+
+        if (newline) {
+            ++m_inputPos;
+            if (!line->empty() && (*line)[line->size() - 1] == '\r')
+                line->resize(line->size() - 1);
+            return true;
+        }
+    }
+}
+
+bool HttpConnection::ReceiveBytes(size_t len, std::vector<u8>* bytes)
+{
+    size_t buffered = m_input.size() - m_inputPos;
+    size_t fromBuffer = len < buffered ? len : buffered;
+    bytes->assign(m_input.begin() + m_inputPos,
+                  m_input.begin() + m_inputPos + fromBuffer);
+    m_inputPos += fromBuffer;
+
+    // Large bodies go straight into place.
+    if (fromBuffer == len)
+        return true;
+    bytes->resize(len);
+    return m_socket->ReceiveAll(bytes->data() + fromBuffer, len - fromBuffer);
+}
+
+bool HttpConnection::FillBuffer()
+{
+    m_input.resize(RECEIVE_CHUNK_SIZE);
+    m_inputPos = 0;
+
+    size_t received;
+    if (!m_socket->ReceiveSome(m_input.data(), m_input.size(), &received)) {
+        m_input.clear();
+        return false;
+    }
+    m_input.resize(received);
+    return true;
+}
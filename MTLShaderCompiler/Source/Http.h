@@ -0,0 +1,51 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <Core/Types.h>
+#include <Os/TcpSocket.h>
+
+// Just enough HTTP/1.1 for the remote permutation cache: requests and
+// responses with Content-Length bodies, any number of them over one
+// keep-alive connection. There's no chunked encoding and no TLS.
+//
+// Messages are queued until Flush(), so that a client can pipeline a batch of
+// requests and then read all of their responses.
+class HttpConnection {
+public:
+    // 'socket' must outlive the connection. Bodies longer than maxBodySize
+    // are rejected.
+    HttpConnection(TcpSocket* socket, size_t maxBodySize);
+
+    void QueueRequest(const char* method, const std::string& path,
+                      const std::string& host, const u8* body,
+                      size_t bodySize);
+    void QueueResponse(int status, const u8* body, size_t bodySize);
+    bool Flush();
+
+    // These return false if the connection closed or broke, or the other end
+    // sent something that this doesn't understand.
+    bool ReceiveRequest(std::string* method, std::string* path,
+                        std::vector<u8>* body);
+    bool ReceiveResponse(int* status, std::vector<u8>* body);
+
+private:
+    HttpConnection(const HttpConnection&);
+    HttpConnection& operator=(const HttpConnection&);
+
+    // Reads the start line, and the headers that matter here.
+    bool ReceiveHead(std::string* startLine, bool* hasLength, size_t* length);
+    bool ReceiveLine(std::string* line);
+    bool ReceiveBytes(size_t len, std::vector<u8>* bytes);
+    bool FillBuffer();
+
+    TcpSocket* m_socket;
+    size_t m_maxBodySize;
+    std::string m_output;
+    std::vector<u8> m_input;
+    size_t m_inputPos;
+};
+
+#endif // HTTP_H
@@ -0,0 +1,123 @@
+#include "MaskEnumerator.h"
+
+#include <algorithm>
+
+#include <Core/Macros.h>
+
+static u32 Popcount(u64 n)
+{
+    return (u32)__builtin_popcountll(n);
+}
+
+MaskEnumerator::MaskEnumerator(u64 bits,
+                               const PermutationConstraints& constraints)
+    : m_bits(bits)
+    , m_constraints(constraints)
+    , m_nPositions(0)
+    , m_popcount(0)
+    , m_mask(0)
+    , m_depth(0)
+    , m_started(false)
+    , m_done(false)
+{
+    for (u32 bit = 64; bit-- > 0;) {
+        if (bits & (u64(1) << bit))
+            m_positions[m_nPositions++] = u64(1) << bit;
+    }
+    BeginPopcount(m_nPositions);
+}
+
+void MaskEnumerator::BeginPopcount(u32 popcount)
+{
+    m_popcount = popcount;
+    m_mask = 0;
+    m_depth = 0;
+}
+
+bool MaskEnumerator::Next(u64* mask)
+{
+    ASSERT(mask);
+
+    if (m_done)
+        return false;
+
+    bool backtrack = m_started;
+    m_started = true;
+    for (;;) {
+        if (backtrack && !Backtrack()) {
+            if (m_popcount == 0) {
+                m_done = true;
+                return false;
+            }
+            BeginPopcount(m_popcount - 1);
+        }
+
+        // Deciding each bit clear before set gives the masks in ascending
+        // order.
+        while (m_depth < m_nPositions) {
+            u64 bit = m_positions[m_depth++];
+            if (IsFeasible())
+                continue;
+            m_mask |= bit;
+            if (!IsFeasible())
+                break;
+        }
+        if (m_depth == m_nPositions && IsFeasible()) {
+            *mask = m_mask;
+            return true;
+        }
+        backtrack = true;
+    }
+}
+
+bool MaskEnumerator::Backtrack()
+{
+    // The deepest decided bit that is clear, and can be set instead, is where
+    // the search picks up. Bits already set have had both of their turns.
+    while (m_depth > 0) {
+        u64 bit = m_positions[m_depth - 1];
+        if (!(m_mask & bit)) {
+            m_mask |= bit;
+            if (IsFeasible())
+                return true;
+        }
+        m_mask &= ~bit;
+        --m_depth;
+    }
+    return false;
+}
+
+bool MaskEnumerator::IsFeasible() const
+{
+    const u64 undecided = m_depth == 0
+        ? m_bits
+        : m_bits & (m_positions[m_depth - 1] - 1);
+    const u32 count = Popcount(m_mask);
+    if (count > m_popcount)
+        return false;
+
+    // The undecided bits can add at most what each group has room for, and
+    // all of those outside the groups.
+    u32 room = 0;
+    u64 ungrouped = undecided;
+    for (const PermutationConstraints::Limit& limit : m_constraints.limits) {
+        u32 used = Popcount(m_mask & limit.group);
+        if (used > limit.limit)
+            return false;
+        room += std::min(limit.limit - used, Popcount(undecided & limit.group));
+        ungrouped &= ~limit.group;
+    }
+    room = std::min(room + Popcount(ungrouped), Popcount(undecided));
+    if (count + room < m_popcount)
+        return false;
+
+    // A required bit that has been decided, or isn't one of m_bits, is clear
+    // for good.
+    for (const PermutationConstraints::Requirement& requirement :
+         m_constraints.requirements) {
+        if ((m_mask & requirement.option) &&
+            (requirement.required & ~m_mask & ~undecided) != 0)
+            return false;
+    }
+    return true;
+}
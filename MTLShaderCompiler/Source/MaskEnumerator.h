@@ -0,0 +1,49 @@
+#ifndef MASKENUMERATOR_H
+#define MASKENUMERATOR_H
+
+#include <Core/Types.h>
+#include "OptionScanner.h"
+
+// Produces the combinations of the bits in 'bits' that the constraints allow,
+// one at a time, those with the most bits set first. Within a popcount the
+// masks come in ascending order.
+//
+// Bits are decided from the top down, and a partial mask that can't be made
+// into an allowed one is abandoned as soon as it breaks a constraint, so the
+// combinations that are ruled out are mostly never visited. Only the current
+// mask is stored, however many there are.
+class MaskEnumerator {
+public:
+    MaskEnumerator(u64 bits, const PermutationConstraints& constraints);
+
+    // Returns false once every mask has been produced.
+    bool Next(u64* mask);
+
+private:
+    MaskEnumerator(const MaskEnumerator&);
+    MaskEnumerator& operator=(const MaskEnumerator&);
+
+    // Starts on the masks with 'popcount' bits set.
+    void BeginPopcount(u32 popcount);
+    // Moves to the next partial mask that the search hasn't abandoned yet,
+    // or returns false if there isn't one with this popcount.
+    bool Backtrack();
+    // Whether the bits decided so far can still end up as an allowed mask
+    // with m_popcount bits set.
+    bool IsFeasible() const;
+
+    u64 m_bits;
+    const PermutationConstraints& m_constraints;
+    // The bits of m_bits, highest first.
+    u64 m_positions[64];
+    u32 m_nPositions;
+
+    u32 m_popcount;
+    u64 m_mask;
+    // How many of m_positions have been decided.
+    u32 m_depth;
+    bool m_started;
+    bool m_done;
+};
+
+#endif // MASKENUMERATOR_H
@@ -0,0 +1,195 @@
+#include "OptionScanner.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Core/Macros.h>
+#include <Os/MappedFile.h>
+
+const char IFDEF[] = "#ifdef ";
+const size_t IFDEF_LEN = sizeof(IFDEF) - 1;
+const size_t OPTION_PREFIX_LEN = 4; // StrLen("F_##") == 4
+
+static bool IsSpace(u8 c)
+{
+    return isspace(c) != 0;
+}
+
+void FindOptionIfDefs(const char* path, IfdefMap* map)
+{
+    ASSERT(path);
+    ASSERT(map);
+
+    MappedFile file;
+    if (file.Open(path))
+        FindOptionIfDefsInText(file.Data(), file.Size(), map);
+}
+
+// Jumps between '#' characters with memchr rather than looking at every byte,
+// and never copies a line. Only the first "#ifdef " on a line counts.
+void FindOptionIfDefsInText(const u8* text, size_t size, IfdefMap* map)
+{
+    ASSERT(text || size == 0);
+    ASSERT(map);
+
+    const u8* p = text;
+    const u8* end = text + size;
+    while (p < end) {
+        const u8* hash = (const u8*)memchr(p, '#', (size_t)(end - p));
+        if (!hash)
+            break;
+        if ((size_t)(end - hash) < IFDEF_LEN ||
+            memcmp(hash, IFDEF, IFDEF_LEN) != 0) {
+            p = hash + 1;
+            continue;
+        }
+
+        const u8* lineEnd = (const u8*)memchr(hash, '\n', (size_t)(end - hash));
+        if (!lineEnd)
+            lineEnd = end;
+        p = lineEnd; // whatever happens, the rest of this line is done with
+
+        // The space after "#ifdef" is part of the whitespace skipped here.
+        const u8* name = hash + IFDEF_LEN - 1;
+        for (; name < lineEnd && IsSpace(*name); ++name)
+            ;
+
+        if ((size_t)(lineEnd - name) < OPTION_PREFIX_LEN)
+            continue;
+        if (name[0] != 'F' || name[1] != '_' ||
+            !isdigit(name[2]) || !isdigit(name[3]))
+            continue;
+
+        const u8* nameEnd = name + OPTION_PREFIX_LEN;
+        for (; nameEnd < lineEnd && !IsSpace(*nameEnd); ++nameEnd)
+            ;
+
+        int index = (name[2] - '0') * 10 + (name[3] - '0');
+        (*map)[index].assign((const char*)name, (size_t)(nameEnd - name));
+    }
+}
+
+bool PermutationConstraints::Allows(u64 permuteMask) const
+{
+    for (const Requirement& requirement : requirements) {
+        if ((permuteMask & requirement.option) &&
+            (permuteMask & requirement.required) != requirement.required)
+            return false;
+    }
+    for (const Limit& limit : limits) {
+        if ((u32)__builtin_popcountll(permuteMask & limit.group) > limit.limit)
+            return false;
+    }
+    return true;
+}
+
+// Splits the rest of a line into whitespace-separated words, up to any
+// comment.
+static void SplitWords(const u8* p, const u8* lineEnd,
+                       std::vector<std::string>* words)
+{
+    words->clear();
+    for (;;) {
+        for (; p < lineEnd && IsSpace(*p); ++p)
+            ;
+        if (p == lineEnd || (lineEnd - p >= 2 && p[0] == '/' &&
+                             (p[1] == '/' || p[1] == '*')))
+            return;
+        const u8* wordStart = p;
+        for (; p < lineEnd && !IsSpace(*p); ++p)
+            ;
+        words->push_back(std::string((const char*)wordStart,
+                                     (size_t)(p - wordStart)));
+    }
+}
+
+// Parses the words after '#pragma permutation'. Returns false with a message
+// (without the file and line) if they don't make sense.
+static bool ParseConstraint(const std::vector<std::string>& words,
+                            const IfdefMap& ifdefs,
+                            PermutationConstraints* constraints,
+                            std::string* message)
+{
+    if (words.empty()) {
+        *message = "expected exclusive, at_most or requires";
+        return false;
+    }
+    const std::string& kind = words[0];
+
+    size_t firstOption = 1;
+    u32 limit = 1;
+    if (kind == "at_most") {
+        char* end = NULL;
+        unsigned long n = words.size() > 1 ?
+            strtoul(words[1].c_str(), &end, 10) : 0;
+        if (words.size() < 2 || words[1].empty() || *end != '\0' ||
+            !isdigit((u8)words[1][0]) || n > 64) {
+            *message = "expected a count after at_most";
+            return false;
+        }
+        limit = (u32)n;
+        firstOption = 2;
+    } else if (kind != "exclusive" && kind != "requires") {
+        *message = "unknown constraint '" + kind + "'";
+        return false;
+    }
+
+    if (words.size() - firstOption < 2) {
+        *message = kind + " needs at least two options";
+        return false;
+    }
+
+    std::vector<u64> bits;
+    for (size_t i = firstOption; i < words.size(); ++i) {
+        auto iter = ifdefs.begin();
+        for (; iter != ifdefs.end() && iter->second != words[i]; ++iter)
+            ;
+        if (iter == ifdefs.end()) {
+            *message = "'" + words[i] + "' is not an option of this shader";
+            return false;
+        }
+        if (iter->first >= 64) {
+            *message = "'" + words[i] + "' is out of range (the last is F_63)";
+            return false;
+        }
+        bits.push_back(u64(1) << iter->first);
+    }
+
+    if (kind == "requires") {
+        PermutationConstraints::Requirement requirement = { bits[0], 0 };
+        for (size_t i = 1; i < bits.size(); ++i)
+            requirement.required |= bits[i];
+        constraints->requirements.push_back(requirement);
+    } else {
+        PermutationConstraints::Limit group = { 0, limit };
+        for (u64 bit : bits)
+            group.group |= bit;
+        constraints->limits.push_back(group);
+    }
+    return true;
+}
+
+bool FindPermutationConstraints(const std::vector<PermutationPragma>& pragmas,
+                                const IfdefMap& ifdefs,
+                                PermutationConstraints* constraints,
+                                std::string* errorOutput)
+{
+    ASSERT(constraints);
+    ASSERT(errorOutput);
+
+    constraints->requirements.clear();
+    constraints->limits.clear();
+
+    std::vector<std::string> words;
+    for (const PermutationPragma& pragma : pragmas) {
+        const u8* text = (const u8*)pragma.text.data();
+        SplitWords(text, text + pragma.text.size(), &words);
+        std::string message;
+        if (!ParseConstraint(words, ifdefs, constraints, &message)) {
+            *errorOutput = pragma.path + ":" + std::to_string(pragma.line) +
+                           ": " + message + "\n";
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,55 @@
+#ifndef OPTIONSCANNER_H
+#define OPTIONSCANNER_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <Core/Types.h>
+#include "ShaderPreprocessor.h"
+
+// Finds the shader's options: every line containing '#ifdef F_##...' adds the
+// macro name (up to the next whitespace) as option ##. A later line for the
+// same ## wins. A file that can't be read has no options.
+void FindOptionIfDefs(const char* path, IfdefMap* map);
+
+// The same, over text in memory.
+void FindOptionIfDefsInText(const u8* text, size_t size, IfdefMap* map);
+
+// Rules that rule out some combinations of a shader's options, so that those
+// permutations aren't built. They are declared in the shader source with:
+//
+//   #pragma permutation exclusive F_01_A F_02_B ...    at most one of these
+//   #pragma permutation at_most 2 F_01_A F_02_B ...    at most 2 of these
+//   #pragma permutation requires F_05_A F_04_B ...     F_05_A needs the rest
+//
+// Only lines outside comments and conditional blocks count, so a constraint
+// can be disabled by commenting it out or wrapping it in #if 0.
+//
+// Masks are permuteMasks, i.e. bit ## is set if option F_## is defined.
+struct PermutationConstraints {
+    // A permutation with 'option' set must have every bit of 'required'.
+    struct Requirement {
+        u64 option;
+        u64 required;
+    };
+    // A permutation can have at most 'limit' of the bits in 'group'.
+    struct Limit {
+        u64 group;
+        u32 limit;
+    };
+
+    std::vector<Requirement> requirements;
+    std::vector<Limit> limits;
+
+    bool Allows(u64 permuteMask) const;
+};
+
+// Parses a shader's '#pragma permutation' lines, as found by
+// ShaderPreprocessor, which can only name options in 'ifdefs'. Returns false
+// and describes the problem if one is malformed.
+bool FindPermutationConstraints(const std::vector<PermutationPragma>& pragmas,
+                                const IfdefMap& ifdefs,
+                                PermutationConstraints* constraints,
+                                std::string* errorOutput);
+
+#endif // OPTIONSCANNER_H
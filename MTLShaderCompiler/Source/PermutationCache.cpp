@@ -0,0 +1,180 @@
+#include "PermutationCache.h"
+
+#include <time.h>
+#include <algorithm>
+
+#include <Core/Macros.h>
+#include <Os/File.h>
+#include <Os/Dir.h>
+#include <Os/FileLock.h>
+
+const char* const LOCK_FILE = "lock";
+const char* const TEMP_FILE_MARKER = ".tmp.";
+
+// Temporary files this old were left behind by a process that died.
+const i64 STALE_TEMP_FILE_SECONDS = 60 * 60;
+
+// Trimming goes a little below the limit, so that the next few runs don't
+// each have to trim again.
+const u64 TRIM_TARGET_PERCENT = 90;
+
+struct CacheEntry {
+    std::string path;
+    FileInfo info;
+};
+
+PermutationCache::PermutationCache(const char* dir, u64 maxBytes)
+    : m_dir(dir)
+    , m_maxBytes(maxBytes)
+    , m_usable(DirTryCreate(dir))
+    , m_storedAny(false)
+{}
+
+static std::string EntryDir(const std::string& cacheDir, const std::string& hex)
+{
+    return cacheDir + "/" + hex.substr(0, 2);
+}
+
+bool PermutationCache::Lookup(const Sha256Digest& key, std::vector<u8>* bytes)
+{
+    ASSERT(bytes);
+
+    if (!m_usable)
+        return false;
+
+    std::string hex = key.ToHex();
+    std::string path = EntryDir(m_dir, hex) + "/" + hex;
+    if (!FileTryReadAllBytes(path.c_str(), bytes))
+        return false;
+
+    // If the time can't be bumped, the entry is just evicted sooner.
+    FileTryTouch(path.c_str());
+    return true;
+}
+
+void PermutationCache::Store(const Sha256Digest& key,
+                             const std::vector<u8>& bytes)
+{
+    if (!m_usable)
+        return;
+
+    std::string hex = key.ToHex();
+    std::string dir = EntryDir(m_dir, hex);
+    if (!DirTryCreate(dir.c_str()))
+        return;
+
+    std::string path = dir + "/" + hex;
+    if (FileTryWriteAllBytesAtomic(path.c_str(), bytes.data(), bytes.size()))
+        m_storedAny = true;
+}
+
+void PermutationCache::Trim()
+{
+    if (!m_storedAny || m_maxBytes == 0)
+        return;
+
+    FileLock lock;
+    if (!lock.TryLock((m_dir + "/" + LOCK_FILE).c_str()))
+        return;
+
+    // Cleared before the scan rather than after it, so that an entry stored
+    // while it runs gets the next call to trim again.
+    m_storedAny = false;
+
+    i64 now = (i64)time(NULL);
+
+    std::vector<CacheEntry> entries;
+    u64 totalBytes = 0;
+
+    std::vector<std::string> subdirs;
+    std::vector<std::string> names;
+    DirList(m_dir.c_str(), &subdirs);
+    for (const std::string& subdir : subdirs) {
+        if (subdir.length() != 2)
+            continue;
+
+        std::string subdirPath = m_dir + "/" + subdir;
+        DirList(subdirPath.c_str(), &names);
+        for (const std::string& name : names) {
+            CacheEntry entry;
+            entry.path = subdirPath + "/" + name;
+            if (!FileGetInfo(entry.path.c_str(), &entry.info))
+                continue; // deleted by another process in the meantime
+
+            if (name.find(TEMP_FILE_MARKER) != std::string::npos) {
+                if (now - entry.info.modifiedTime > STALE_TEMP_FILE_SECONDS)
+                    FileTryDelete(entry.path.c_str());
+                continue;
+            }
+
+            totalBytes += entry.info.size;
+            entries.push_back(entry);
+        }
+    }
+
+    if (totalBytes <= m_maxBytes)
+        return;
+
+    std::sort(entries.begin(), entries.end(),
+              [](const CacheEntry& a, const CacheEntry& b) -> bool {
+        return a.info.modifiedTime < b.info.modifiedTime;
+    });
+
+    u64 targetBytes = m_maxBytes / 100 * TRIM_TARGET_PERCENT;
+    for (size_t i = 0; i < entries.size() && totalBytes > targetBytes; ++i) {
+        // Another process may be reading the entry right now. That's fine:
+        // on POSIX, an open file stays readable after it has been deleted.
+        if (FileTryDelete(entries[i].path.c_str()))
+            totalBytes -= entries[i].info.size;
+    }
+}
+
+PermutationMemoryCache::PermutationMemoryCache(u64 maxBytes)
+    : m_mutex()
+    , m_entries()
+    , m_index()
+    , m_maxBytes(maxBytes)
+    , m_totalBytes(0)
+{}
+
+bool PermutationMemoryCache::Lookup(const Sha256Digest& key,
+                                    std::vector<u8>* bytes)
+{
+    ASSERT(bytes);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto iter = m_index.find(key);
+    if (iter == m_index.end())
+        return false;
+
+    m_entries.splice(m_entries.begin(), m_entries, iter->second);
+    *bytes = iter->second->bytes;
+    return true;
+}
+
+void PermutationMemoryCache::Store(const Sha256Digest& key,
+                                   const std::vector<u8>& bytes)
+{
+    if (bytes.size() > m_maxBytes)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_index.count(key) != 0)
+        return;
+
+    Entry entry;
+    entry.key = key;
+    entry.bytes = bytes;
+    m_entries.push_front(entry);
+    m_index[key] = m_entries.begin();
+    m_totalBytes += bytes.size();
+
+    while (m_totalBytes > m_maxBytes) {
+        const Entry& oldest = m_entries.back();
+        m_totalBytes -= oldest.bytes.size();
+        m_index.erase(oldest.key);
+        m_entries.pop_back();
+    }
+}
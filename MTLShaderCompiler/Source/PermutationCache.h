@@ -0,0 +1,77 @@
+#ifndef PERMUTATIONCACHE_H
+#define PERMUTATIONCACHE_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <Core/Types.h>
+#include <Util/Sha256.h>
+
+// An on-disk cache of compiled permutations, addressed by a hash of
+// everything that went into compiling them. It persists between runs and can
+// be shared by any number of compiler processes at once.
+//
+// Entries live at <dir>/<first two hex digits>/<hex digest>. They are written
+// to a temporary file and renamed into place, so a reader never sees a
+// partial entry. Using an entry bumps its modification time, which Trim()
+// uses to evict the least recently used entries.
+//
+// The cache only ever speeds a build up. If its directory can't be created
+// or written to, lookups miss and stores are dropped.
+class PermutationCache {
+public:
+    PermutationCache(const char* dir, u64 maxBytes);
+
+    // Safe to call from several threads at once.
+    bool Lookup(const Sha256Digest& key, std::vector<u8>* bytes);
+    void Store(const Sha256Digest& key, const std::vector<u8>& bytes);
+
+    // If anything was stored since the last trim and the cache is over its
+    // size limit, evicts least recently used entries. Does nothing if
+    // another process is already trimming the cache.
+    void Trim();
+
+private:
+    PermutationCache(const PermutationCache&);
+    PermutationCache& operator=(const PermutationCache&);
+
+    std::string m_dir;
+    u64 m_maxBytes;
+    // False if the cache directory couldn't be created.
+    bool m_usable;
+    std::atomic<bool> m_storedAny;
+};
+
+// An in-memory cache of compiled permutations, with the same keys as
+// PermutationCache. The compile server keeps one between requests. When it
+// goes over its size limit, the least recently used entries are evicted.
+class PermutationMemoryCache {
+public:
+    explicit PermutationMemoryCache(u64 maxBytes);
+
+    // Safe to call from several threads at once.
+    bool Lookup(const Sha256Digest& key, std::vector<u8>* bytes);
+    void Store(const Sha256Digest& key, const std::vector<u8>& bytes);
+
+private:
+    PermutationMemoryCache(const PermutationMemoryCache&);
+    PermutationMemoryCache& operator=(const PermutationMemoryCache&);
+
+    struct Entry {
+        Sha256Digest key;
+        std::vector<u8> bytes;
+    };
+    typedef std::list<Entry> EntryList;
+
+    std::mutex m_mutex;
+    // Most recently used first.
+    EntryList m_entries;
+    std::map<Sha256Digest, EntryList::iterator> m_index;
+    u64 m_maxBytes;
+    u64 m_totalBytes;
+};
+
+#endif // PERMUTATIONCACHE_H
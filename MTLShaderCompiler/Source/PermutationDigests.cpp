@@ -0,0 +1,61 @@
+#include "PermutationDigests.h"
+
+#include <string.h>
+#include <vector>
+#include <Core/Macros.h>
+#include <Os/File.h>
+#include <Util/BinaryReader.h>
+#include <Util/BinaryWriter.h>
+
+// Layout: "TSGD" u32 version u32 nDigests, then for each permutation
+// u64 permuteMask followed by the 32 digest bytes.
+const char DIGESTS_FILE_MAGIC[] = "TSGD";
+const u32 DIGESTS_FORMAT_VERSION = 1;
+
+bool PermutationDigestsRead(const char* path, PermutationDigestMap* digests)
+{
+    ASSERT(digests);
+
+    digests->clear();
+
+    std::vector<u8> bytes;
+    if (!FileTryReadAllBytes(path, &bytes))
+        return false;
+
+    BinaryReader reader(bytes.data(), bytes.size());
+    const void* magic = reader.ReadRawData(4);
+    if (!magic || memcmp(magic, DIGESTS_FILE_MAGIC, 4) != 0)
+        return false;
+    if (reader.Read32() != DIGESTS_FORMAT_VERSION)
+        return false;
+
+    u32 nDigests = reader.Read32();
+    for (u32 i = 0; i < nDigests && !reader.Failed(); ++i) {
+        u64 permuteMask = reader.Read64();
+        const void* digest = reader.ReadRawData(Sha256Digest::SIZE);
+        if (digest)
+            memcpy((*digests)[permuteMask].bytes, digest, Sha256Digest::SIZE);
+    }
+
+    if (reader.Failed()) {
+        digests->clear();
+        return false;
+    }
+    return true;
+}
+
+bool PermutationDigestsWrite(const char* path,
+                             const PermutationDigestMap& digests)
+{
+    BinaryWriter writer;
+    writer.WriteRawData(DIGESTS_FILE_MAGIC, 4);
+    writer.Write32(DIGESTS_FORMAT_VERSION);
+    writer.Write32((u32)digests.size());
+    for (const auto& pair : digests) {
+        writer.Write64(pair.first);
+        writer.WriteRawData(pair.second.bytes, Sha256Digest::SIZE);
+    }
+
+    return FileTryWriteAllBytesAtomic(path, writer.GetData(),
+                                      writer.GetSize());
+}
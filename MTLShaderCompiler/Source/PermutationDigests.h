@@ -0,0 +1,19 @@
+#ifndef PERMUTATIONDIGESTS_H
+#define PERMUTATIONDIGESTS_H
+
+#include <map>
+#include <Core/Types.h>
+#include <Util/Sha256.h>
+
+// The digest of each permutation's compile inputs, keyed by permuteMask.
+// Incremental builds save these next to the output file, so that the next
+// build can tell which permutations in the output are still up to date.
+typedef std::map<u64, Sha256Digest> PermutationDigestMap;
+
+// Returns false if the file is missing or not a valid digests file.
+bool PermutationDigestsRead(const char* path, PermutationDigestMap* digests);
+// Replaces the file atomically. Returns false if it can't be written.
+bool PermutationDigestsWrite(const char* path,
+                             const PermutationDigestMap& digests);
+
+#endif // PERMUTATIONDIGESTS_H
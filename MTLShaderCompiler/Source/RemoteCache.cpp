@@ -0,0 +1,224 @@
+#include "RemoteCache.h"
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+
+#include <Core/Macros.h>
+
+// The most requests sent ahead of their responses. Lookup requests are
+// small, so this many never fill the socket's buffers and stall the server.
+const size_t REMOTE_CACHE_PIPELINE_DEPTH = 64;
+
+// Anything bigger isn't a metallib.
+const size_t MAX_ENTRY_SIZE = 256 * 1024 * 1024;
+
+// A server that doesn't answer for this long is treated as gone, and so is
+// a client that doesn't send anything for this long.
+const unsigned REMOTE_CACHE_TIMEOUT_SECONDS = 30;
+
+// Each connection can have a MAX_ENTRY_SIZE request body in memory, so the
+// server only serves this many at once; the rest wait to be accepted.
+const size_t REMOTE_CACHE_MAX_CONNECTIONS = 16;
+
+// Trimming scans the whole cache, so the server only does it once this much
+// has been stored since the last time.
+const u64 REMOTE_CACHE_TRIM_INTERVAL_BYTES = 256 * 1024 * 1024;
+
+static std::string GetEntryPath(const Sha256Digest& key)
+{
+    return "/" + key.ToHex();
+}
+
+RemotePermutationCache::RemotePermutationCache(const char* address)
+    : m_address(address)
+    , m_socket()
+    , m_connection()
+    , m_disabled(false)
+{}
+
+void RemotePermutationCache::LookupBatch(const std::vector<Sha256Digest>& keys,
+                                         std::vector<std::vector<u8> >* bytes,
+                                         std::vector<bool>* found)
+{
+    ASSERT(bytes);
+    ASSERT(found);
+
+    bytes->assign(keys.size(), std::vector<u8>());
+    found->assign(keys.size(), false);
+    RunBatch("GET", keys, NULL,
+        [&](size_t i, int status, std::vector<u8>* body) {
+        if (status == 200) {
+            (*bytes)[i].swap(*body);
+            (*found)[i] = true;
+        }
+    });
+}
+
+void RemotePermutationCache::StoreBatch(
+    const std::vector<Sha256Digest>& keys,
+    const std::vector<const std::vector<u8>*>& bytes)
+{
+    ASSERT(keys.size() == bytes.size());
+
+    // Whether the server kept the entries makes no difference to the build.
+    RunBatch("PUT", keys, &bytes, [](size_t, int, std::vector<u8>*) {});
+}
+
+void RemotePermutationCache::RunBatch(
+    const char* method, const std::vector<Sha256Digest>& keys,
+    const std::vector<const std::vector<u8>*>* bodies,
+    const ResponseFunc& func)
+{
+    // A kept-alive connection may have been closed by the server since the
+    // last batch, so a failure gets one retry on a new connection.
+    size_t next = 0;
+    for (int attempt = 0; next < keys.size() && !m_disabled; ++attempt) {
+        if (attempt == 2 || (!m_connection && !Connect())) {
+            Disconnect();
+            m_disabled = true;
+            return;
+        }
+        if (!Exchange(method, keys, bodies, func, &next))
+            Disconnect();
+    }
+}
+
+bool RemotePermutationCache::Exchange(
+    const char* method, const std::vector<Sha256Digest>& keys,
+    const std::vector<const std::vector<u8>*>* bodies,
+    const ResponseFunc& func, size_t* next)
+{
+    size_t sent = *next;
+    std::vector<u8> body;
+    while (*next < keys.size()) {
+        for (; sent < keys.size() &&
+               sent - *next < REMOTE_CACHE_PIPELINE_DEPTH; ++sent) {
+            const std::vector<u8>* requestBody = bodies ? (*bodies)[sent]
+                                                        : NULL;
+            m_connection->QueueRequest(
+                method, GetEntryPath(keys[sent]), m_address,
+                requestBody ? requestBody->data() : NULL,
+                requestBody ? requestBody->size() : 0);
+        }
+        if (!m_connection->Flush())
+            return false;
+
+        int status;
+        if (!m_connection->ReceiveResponse(&status, &body))
+            return false;
+        func(*next, status, &body);
+        ++*next;
+    }
+    return true;
+}
+
+bool RemotePermutationCache::Connect()
+{
+    m_socket.reset(new TcpSocket);
+    if (!m_socket->Connect(m_address.c_str()))
+        return false;
+
+    m_socket->SetTimeout(REMOTE_CACHE_TIMEOUT_SECONDS);
+    m_connection.reset(new HttpConnection(m_socket.get(), MAX_ENTRY_SIZE));
+    return true;
+}
+
+void RemotePermutationCache::Disconnect()
+{
+    m_connection.reset();
+    m_socket.reset();
+}
+
+namespace {
+
+struct ServerState {
+    std::mutex mutex;
+    std::condition_variable connectionClosed;
+    size_t numConnections;
+    std::atomic<u64> bytesSinceTrim;
+    std::mutex trimMutex;
+};
+
+} // namespace
+
+// Answers requests on one connection until the client closes it.
+static void ServeConnection(TcpSocket* socket, PermutationCache* cache,
+                            ServerState* state)
+{
+    HttpConnection connection(socket, MAX_ENTRY_SIZE);
+    std::string method;
+    std::string path;
+    std::vector<u8> body;
+    while (connection.ReceiveRequest(&method, &path, &body)) {
+        Sha256Digest key;
+        int status;
+        std::vector<u8> responseBody;
+        if (path.empty() || path[0] != '/' || !key.FromHex(path.substr(1))) {
+            status = 404;
+        } else if (method == "GET") {
+            status = cache->Lookup(key, &responseBody) ? 200 : 404;
+        } else if (method == "PUT") {
+            cache->Store(key, body);
+            state->bytesSinceTrim += body.size();
+            status = 201;
+        } else {
+            status = 405;
+        }
+
+        connection.QueueResponse(status, responseBody.data(),
+                                 responseBody.size());
+        if (!connection.Flush())
+            break;
+    }
+}
+
+// Trims the cache if enough has been stored since it was last trimmed, and
+// no other connection's thread is trimming it already.
+static void MaybeTrim(PermutationCache* cache, ServerState* state)
+{
+    if (state->bytesSinceTrim < REMOTE_CACHE_TRIM_INTERVAL_BYTES)
+        return;
+
+    std::unique_lock<std::mutex> lock(state->trimMutex, std::try_to_lock);
+    if (!lock.owns_lock())
+        return;
+    state->bytesSinceTrim = 0;
+    cache->Trim();
+}
+
+bool RemoteCacheServerRun(const char* address, PermutationCache* cache)
+{
+    ASSERT(cache);
+
+    TcpSocketListener listener;
+    if (!listener.Listen(address))
+        return false;
+
+    ServerState state;
+    state.numConnections = 0;
+    state.bytesSinceTrim = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(state.mutex);
+            state.connectionClosed.wait(lock, [&]() {
+                return state.numConnections < REMOTE_CACHE_MAX_CONNECTIONS;
+            });
+            ++state.numConnections;
+        }
+
+        TcpSocket* socket = new TcpSocket;
+        listener.Accept(socket);
+        socket->SetTimeout(REMOTE_CACHE_TIMEOUT_SECONDS);
+        std::thread([socket, cache, &state]() {
+            ServeConnection(socket, cache, &state);
+            delete socket;
+            MaybeTrim(cache, &state);
+
+            std::lock_guard<std::mutex> lock(state.mutex);
+            --state.numConnections;
+            state.connectionClosed.notify_one();
+        }).detach();
+    }
+}
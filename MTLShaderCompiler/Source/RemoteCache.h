@@ -0,0 +1,74 @@
+#ifndef REMOTECACHE_H
+#define REMOTECACHE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <Core/Types.h>
+#include <Os/TcpSocket.h>
+#include <Util/Sha256.h>
+#include "Http.h"
+#include "PermutationCache.h"
+
+// A cache of compiled permutations on an HTTP server, shared by every machine
+// that builds the same shaders. Entries have the same keys as
+// PermutationCache's: GET /<hex digest> returns an entry's bytes, or 404 if
+// there's no such entry, and PUT /<hex digest> stores one.
+//
+// A batch of requests is pipelined over one keep-alive connection, with up
+// to REMOTE_CACHE_PIPELINE_DEPTH of them in flight, so a shader's lookups
+// cost about one round trip rather than one each. If the server can't be
+// reached or misbehaves, lookups miss and stores are dropped for the rest of
+// the run; the build carries on without it.
+//
+// The server doesn't authenticate clients, and clients don't check what it
+// sends back: an entry's key is a digest of the inputs, not of the entry,
+// and its bytes go into the output as they are. Anyone who can store an
+// entry can replace the permutations that every client builds. A server
+// should only listen on a loopback address, or on a network where everyone
+// is trusted.
+class RemotePermutationCache {
+public:
+    // 'address' is "host:port".
+    explicit RemotePermutationCache(const char* address);
+
+    // found[i] is set, and bytes[i] filled in, for each key that the server
+    // has.
+    void LookupBatch(const std::vector<Sha256Digest>& keys,
+                     std::vector<std::vector<u8> >* bytes,
+                     std::vector<bool>* found);
+    void StoreBatch(const std::vector<Sha256Digest>& keys,
+                    const std::vector<const std::vector<u8>*>& bytes);
+
+private:
+    RemotePermutationCache(const RemotePermutationCache&);
+    RemotePermutationCache& operator=(const RemotePermutationCache&);
+
+    typedef std::function<void(size_t i, int status,
+                               std::vector<u8>* body)> ResponseFunc;
+
+    void RunBatch(const char* method, const std::vector<Sha256Digest>& keys,
+                  const std::vector<const std::vector<u8>*>* bodies,
+                  const ResponseFunc& func);
+    // Sends requests from *next on, advancing it past each response. Returns
+    // false if the connection failed.
+    bool Exchange(const char* method, const std::vector<Sha256Digest>& keys,
+                  const std::vector<const std::vector<u8>*>* bodies,
+                  const ResponseFunc& func, size_t* next);
+    bool Connect();
+    void Disconnect();
+
+    std::string m_address;
+    std::unique_ptr<TcpSocket> m_socket;
+    std::unique_ptr<HttpConnection> m_connection;
+    bool m_disabled;
+};
+
+// Serves a remote cache at 'address', keeping its entries in 'cache', with a
+// thread for each connection. A reference server for trying out the
+// protocol; it only returns (false) if it can't listen there. See above
+// before listening on anything but a loopback address.
+bool RemoteCacheServerRun(const char* address, PermutationCache* cache);
+
+#endif // REMOTECACHE_H
@@ -0,0 +1,145 @@
+#include "ShaderPackWriter.h"
+
+#include <string.h>
+
+#include <Core/Macros.h>
+#include <Util/BinaryReader.h>
+#include <Util/ShaderFormat.h>
+#include <Util/ShaderPackFormat.h>
+
+ShaderPackWriter::ShaderPackWriter()
+    : m_shaders()
+    , m_blobs()
+    , m_blobsByHash()
+{}
+
+void ShaderPackWriter::AddShader(const std::string& name, const u8* data,
+                                 size_t size)
+{
+    ASSERT(data);
+
+    BinaryReader reader(data, size);
+    const void* magic = reader.ReadRawData(4);
+    u32 version = reader.Read32();
+    reader.ReadRawData(4); // API magic
+    u32 nPermutations = reader.Read32();
+    reader.Read32(); // nBlobs
+    u32 flags = reader.Read32();
+    reader.Read64(); // optionBits
+    u32 nRequirements = reader.Read32();
+    u32 nLimits = reader.Read32();
+    ASSERT(magic && memcmp(magic, SHADER_FILE_MAGIC, 4) == 0);
+    ASSERT(version == SHADER_FORMAT_VERSION);
+
+    Shader& shader = m_shaders[name];
+    shader.recordSize = ShaderFileRecordSize(flags);
+    shader.recordsPos = SHADER_FILE_HEADER_SIZE +
+        (size_t)nPermutations * SHADER_FILE_INDEX_ENTRY_SIZE +
+        (size_t)nRequirements * SHADER_FILE_REQUIREMENT_SIZE +
+        (size_t)nLimits * SHADER_FILE_LIMIT_SIZE;
+    size_t tablesSize = shader.recordsPos +
+        (size_t)nPermutations * shader.recordSize;
+    ASSERT(tablesSize <= size);
+    shader.tables.assign(data, data + tablesSize);
+
+    // Records that share a library share its offset, so each blob is only
+    // hashed once.
+    std::map<u32, u32> blobsByOffset;
+    shader.recordBlobs.resize(nPermutations);
+    for (u32 i = 0; i < nPermutations; ++i) {
+        reader.Seek(shader.recordsPos + i * shader.recordSize);
+        reader.Read64(); // permuteMask
+        u32 blobOffset = reader.Read32();
+        u32 blobLength = reader.Read32();
+        auto found = blobsByOffset.find(blobOffset);
+        if (found != blobsByOffset.end()) {
+            shader.recordBlobs[i] = found->second;
+            continue;
+        }
+        reader.Seek(blobOffset);
+        const u8* blob = (const u8*)reader.ReadRawData(blobLength);
+        ASSERT(!reader.Failed());
+
+        Sha256 hash;
+        hash.Update(blob, blobLength);
+        Sha256Digest digest;
+        hash.Final(&digest);
+
+        auto inserted = m_blobsByHash.insert(
+            std::make_pair(digest, (u32)m_blobs.size()));
+        if (inserted.second)
+            m_blobs.push_back(std::vector<u8>(blob, blob + blobLength));
+        shader.recordBlobs[i] = inserted.first->second;
+        blobsByOffset[blobOffset] = inserted.first->second;
+    }
+}
+
+bool ShaderPackWriter::Write(BinaryWriter& writer) const
+{
+    writer.WriteRawData(SHADER_PACK_MAGIC, 4);
+    writer.Write32(SHADER_PACK_VERSION);
+    writer.Write32((u32)m_shaders.size());
+    writer.Write32((u32)m_blobs.size());
+
+    std::vector<long> pos_shaderOffsets;
+    size_t namesSize = 0;
+    const long namesPos = SHADER_PACK_HEADER_SIZE +
+        (long)m_shaders.size() * SHADER_PACK_DIRECTORY_ENTRY_SIZE;
+    for (const auto& shader : m_shaders) {
+        writer.Write32((u32)(namesPos + namesSize));
+        writer.Write32((u32)shader.first.size());
+        pos_shaderOffsets.push_back(writer.WriteTemp32());
+        writer.Write32((u32)shader.second.tables.size());
+        namesSize += shader.first.size() + 1;
+    }
+
+    std::string names;
+    names.reserve(namesSize);
+    for (const auto& shader : m_shaders)
+        names.append(shader.first.c_str(), shader.first.size() + 1);
+    ASSERT(writer.AlignAndTell() == namesPos);
+    writer.WriteRawData(names.data(), names.size());
+
+    // Each shader starts on a page of its own.
+    const std::vector<u8> zeros(SHADER_PACK_PAGE_SIZE);
+    std::vector<long> shaderOffsets;
+    size_t i = 0;
+    for (const auto& shader : m_shaders) {
+        long pos = writer.AlignAndTell();
+        long padding = (SHADER_PACK_PAGE_SIZE - pos % SHADER_PACK_PAGE_SIZE) %
+                       SHADER_PACK_PAGE_SIZE;
+        writer.WriteRawData(zeros.data(), (size_t)padding);
+        shaderOffsets.push_back(writer.AlignAndTell());
+        writer.OverwriteTemp32(pos_shaderOffsets[i++],
+                               (u32)shaderOffsets.back());
+        writer.WriteRawData(shader.second.tables.data(),
+                            shader.second.tables.size());
+    }
+
+    std::vector<long> blobOffsets(m_blobs.size());
+    for (size_t blob = 0; blob < m_blobs.size(); ++blob) {
+        blobOffsets[blob] = writer.AlignAndTell();
+        writer.WriteRawData(m_blobs[blob].data(), m_blobs[blob].size());
+    }
+
+    // Every offset is less than the size, so if the size fits in 32 bits,
+    // so do they. If it doesn't, some have been truncated already, but the
+    // pack is thrown away.
+    if ((u64)writer.GetSize() > SHADER_PACK_MAX_SIZE)
+        return false;
+
+    // Point the records at the shared blobs, relative to their shaders.
+    i = 0;
+    for (const auto& shader : m_shaders) {
+        long shaderOffset = shaderOffsets[i++];
+        long recordsPos = shaderOffset + (long)shader.second.recordsPos;
+        const std::vector<u32>& recordBlobs = shader.second.recordBlobs;
+        for (size_t k = 0; k < recordBlobs.size(); ++k) {
+            long pos_blobOffset = recordsPos +
+                                  (long)(k * shader.second.recordSize) + 8;
+            writer.OverwriteTemp32(pos_blobOffset,
+                (u32)(blobOffsets[recordBlobs[k]] - shaderOffset));
+        }
+    }
+    return true;
+}
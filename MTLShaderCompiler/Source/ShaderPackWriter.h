@@ -0,0 +1,45 @@
+#ifndef SHADERPACKWRITER_H
+#define SHADERPACKWRITER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <Core/Types.h>
+#include <Util/BinaryWriter.h>
+#include <Util/Sha256.h>
+
+// Collects shaders' .shd files and writes them out as one pack (see
+// Util/ShaderPackFormat.h). Blobs with the same bytes are stored once,
+// whichever shaders they come from.
+class ShaderPackWriter {
+public:
+    ShaderPackWriter();
+
+    // Adds a version 5 .shd file, named 'name' in the pack's directory. A
+    // shader added again under the same name replaces the earlier one.
+    void AddShader(const std::string& name, const u8* data, size_t size);
+
+    // Returns false if the pack would be too large for its 32-bit offsets,
+    // in which case what's in 'writer' is of no use.
+    bool Write(BinaryWriter& writer) const;
+
+private:
+    ShaderPackWriter(const ShaderPackWriter&);
+    ShaderPackWriter& operator=(const ShaderPackWriter&);
+
+    struct Shader {
+        // The header, index, constraints and records, copied from the
+        // .shd file.
+        std::vector<u8> tables;
+        size_t recordsPos;
+        u32 recordSize;
+        // The blob of each record, as an index into m_blobs.
+        std::vector<u32> recordBlobs;
+    };
+
+    std::map<std::string, Shader> m_shaders;
+    std::vector<std::vector<u8> > m_blobs;
+    std::map<Sha256Digest, u32> m_blobsByHash;
+};
+
+#endif // SHADERPACKWRITER_H
@@ -0,0 +1,504 @@
+#include "ShaderPreprocessor.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <set>
+#include <algorithm>
+#include <Core/Macros.h>
+#include <Os/File.h>
+
+// Both bits set: no permutation can see the lines. Used for the option
+// directives themselves.
+const u64 NEVER_VISIBLE = ~u64(0);
+
+// Deeper than this, assume an include cycle.
+const int MAX_INCLUDE_DEPTH = 64;
+
+namespace {
+
+struct Frame {
+    bool isOption;
+    int bitIndex;
+    // True for #ifdef (or the #else of an #ifndef).
+    bool defined;
+};
+
+struct Directive {
+    std::string name;
+    std::string argument;
+    // The file name of an #include "file" or #include <file> directive,
+    // otherwise empty.
+    std::string includePath;
+    bool angled;
+    // Whatever follows the argument, up to the end of the line.
+    const char* rest;
+};
+
+} // namespace
+
+struct ShaderPreprocessor::ParseState {
+    std::map<std::string, int> optionBits;
+    std::vector<Frame> frames;
+    u64 required;
+    u64 excluded;
+    // Files with #pragma once that have already been expanded for every
+    // permutation.
+    std::set<std::string> onceFiles;
+    bool ok;
+};
+
+static bool IsIdentifierChar(char c)
+{
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+// Parses '#name argument' at the start of a line. Returns false if the line
+// isn't a preprocessor directive.
+static bool ParseDirective(const char* line, const char* end,
+                           Directive* directive)
+{
+    const char* p = line;
+    for (; p < end && (*p == ' ' || *p == '\t'); ++p)
+        ;
+    if (p == end || *p != '#')
+        return false;
+    for (++p; p < end && (*p == ' ' || *p == '\t'); ++p)
+        ;
+
+    const char* nameStart = p;
+    for (; p < end && IsIdentifierChar(*p); ++p)
+        ;
+    directive->name.assign(nameStart, p);
+
+    for (; p < end && isspace((unsigned char)*p); ++p)
+        ;
+    directive->includePath.clear();
+    directive->angled = p < end && *p == '<';
+    if (p < end && (*p == '"' || *p == '<')) {
+        char close = *p == '<' ? '>' : '"';
+        const char* pathStart = ++p;
+        for (; p < end && *p != close && *p != '\n'; ++p)
+            ;
+        if (p < end && *p == close)
+            directive->includePath.assign(pathStart, p);
+    }
+
+    const char* argStart = p;
+    for (; p < end && IsIdentifierChar(*p); ++p)
+        ;
+    directive->argument.assign(argStart, p);
+    directive->rest = p;
+    return true;
+}
+
+// Updates whether we're inside a /* */ comment at the end of the line.
+static void ScanComments(const char* line, const char* end, bool* inComment)
+{
+    for (const char* p = line; p + 1 < end; ++p) {
+        if (*inComment) {
+            if (p[0] == '*' && p[1] == '/') {
+                *inComment = false;
+                ++p;
+            }
+        } else if (p[0] == '/' && p[1] == '/') {
+            return;
+        } else if (p[0] == '/' && p[1] == '*') {
+            *inComment = true;
+            ++p;
+        }
+    }
+}
+
+static void GetCondition(const std::vector<Frame>& frames,
+                         u64* required, u64* excluded)
+{
+    *required = 0;
+    *excluded = 0;
+    for (const Frame& frame : frames) {
+        if (!frame.isOption)
+            continue;
+        if (frame.defined)
+            *required |= u64(1) << frame.bitIndex;
+        else
+            *excluded |= u64(1) << frame.bitIndex;
+    }
+}
+
+static std::string DirName(const std::string& path)
+{
+    std::string::size_type slash = path.rfind('/');
+    if (slash == std::string::npos)
+        return ".";
+    return path.substr(0, slash);
+}
+
+ShaderPreprocessor::ShaderPreprocessor()
+    : m_source()
+    , m_segments()
+    , m_ifdefs()
+    , m_includeDirs()
+    , m_files()
+    , m_permutationPragmas()
+    , m_preserveLines(false)
+{}
+
+bool ShaderPreprocessor::Parse(const char* path, const u8* text, size_t size,
+                               const IfdefMap& ifdefs,
+                               const std::vector<std::string>& includeDirs)
+{
+    ASSERT(text || size == 0);
+
+    m_source.clear();
+    m_segments.clear();
+    m_ifdefs = ifdefs;
+    m_includeDirs = includeDirs;
+    m_files.assign(1, path);
+    m_permutationPragmas.clear();
+
+    ParseState state;
+    state.required = 0;
+    state.excluded = 0;
+    state.ok = true;
+    for (const auto& pair : ifdefs) {
+        if (pair.first >= 64) {
+            state.ok = false;
+            continue;
+        }
+        state.optionBits[pair.second] = pair.first;
+    }
+
+    ParseFile(path, text, size, 0, &state);
+
+    if (!state.frames.empty())
+        state.ok = false;
+
+    m_preserveLines = m_source.find("__LINE__") != std::string::npos;
+
+    if (!state.ok) {
+        // Every permutation sees the whole expanded source, including the
+        // option directives.
+        Segment all = { 0, m_source.length(), 0, 0, 0, 0 };
+        for (const Segment& segment : m_segments) {
+            all.references |= segment.references;
+            all.nLines += segment.nLines;
+        }
+        m_segments.assign(1, all);
+        return false;
+    }
+    return true;
+}
+
+void ShaderPreprocessor::ParseFile(const std::string& path, const u8* bytes,
+                                   size_t len, int depth, ParseState* state)
+{
+    const char* text = (const char*)bytes;
+
+    bool inComment = false;
+    Directive directive;
+
+    size_t pos = 0;
+    u32 nextLineNumber = 1;
+    // Keep going after a failure, so that m_source ends up with everything.
+    while (pos < len) {
+        // Find the end of the line, following backslash continuations.
+        size_t lineEnd = pos;
+        for (;;) {
+            const void* newline = memchr(text + lineEnd, '\n', len - lineEnd);
+            if (!newline) {
+                lineEnd = len;
+                break;
+            }
+            size_t newlinePos = (const char*)newline - text;
+            lineEnd = newlinePos + 1;
+            if (newlinePos == 0 || text[newlinePos - 1] != '\\')
+                break;
+        }
+
+        const char* line = text + pos;
+        const size_t lineLen = lineEnd - pos;
+        pos = lineEnd;
+        const u32 lineNumber = nextLineNumber;
+        nextLineNumber += (u32)std::count(line, line + lineLen, '\n');
+
+        bool isDirective = !inComment &&
+            ParseDirective(line, line + lineLen, &directive);
+        ScanComments(line, line + lineLen, &inComment);
+
+        if (!isDirective) {
+            AddLines(line, lineLen, state->required, state->excluded, *state);
+            continue;
+        }
+
+        auto option = state->optionBits.find(directive.argument);
+        bool isOption = option != state->optionBits.end();
+        bool hideLine = false;
+
+        if (directive.name == "ifdef" || directive.name == "ifndef") {
+            Frame frame;
+            frame.isOption = isOption;
+            frame.bitIndex = isOption ? option->second : -1;
+            frame.defined = directive.name == "ifdef";
+            state->frames.push_back(frame);
+            hideLine = isOption;
+        } else if (directive.name == "if") {
+            Frame frame = { false, -1, false };
+            state->frames.push_back(frame);
+        } else if (directive.name == "else" || directive.name == "elif") {
+            if (state->frames.empty()) {
+                state->ok = false;
+            } else if (state->frames.back().isOption) {
+                state->frames.back().defined = !state->frames.back().defined;
+                hideLine = true;
+                if (directive.name == "elif")
+                    state->ok = false;
+            }
+        } else if (directive.name == "endif") {
+            if (state->frames.empty()) {
+                state->ok = false;
+            } else {
+                hideLine = state->frames.back().isOption;
+                state->frames.pop_back();
+            }
+        } else if (directive.name == "define" || directive.name == "undef") {
+            if (isOption)
+                state->ok = false;
+        } else if (directive.name == "pragma" && directive.argument == "once") {
+            if (state->required == 0 && state->excluded == 0)
+                state->onceFiles.insert(path);
+        } else if (directive.name == "pragma" &&
+                   directive.argument == "permutation") {
+            if (depth == 0 && state->frames.empty()) {
+                PermutationPragma pragma;
+                pragma.path = path;
+                pragma.line = lineNumber;
+                pragma.text.assign(directive.rest, line + lineLen);
+                m_permutationPragmas.push_back(pragma);
+            }
+        } else if (directive.name == "include" && !directive.includePath.empty()) {
+            std::string includePath;
+            std::vector<u8> includeText;
+            if (depth + 1 < MAX_INCLUDE_DEPTH &&
+                FindInclude(path, directive.includePath, directive.angled,
+                            &includePath, &includeText)) {
+                // The directive is replaced by the file's contents, which are
+                // seen wherever the directive is.
+                if (state->onceFiles.count(includePath) == 0)
+                    ParseFile(includePath, includeText.data(),
+                              includeText.size(), depth + 1, state);
+                continue;
+            }
+            // Leave anything we can't find for the compiler to report.
+        }
+
+        if (hideLine) {
+            AddLines(line, lineLen, NEVER_VISIBLE, NEVER_VISIBLE, *state);
+            GetCondition(state->frames, &state->required, &state->excluded);
+        } else {
+            // Other conditionals don't affect which permutations see a line,
+            // so the directive goes wherever its enclosing option blocks do.
+            AddLines(line, lineLen, state->required, state->excluded, *state);
+        }
+    }
+}
+
+// Searches for an included file the way the compiler does: "file" is looked
+// for next to the including file and then in the include directories, and
+// <file> only in the include directories. Every path tried is added to
+// m_files, since creating any of them could change the result.
+bool ShaderPreprocessor::FindInclude(const std::string& fromPath,
+                                     const std::string& name, bool angled,
+                                     std::string* includePath,
+                                     std::vector<u8>* text)
+{
+    std::vector<std::string> dirs;
+    if (!angled)
+        dirs.push_back(DirName(fromPath));
+    dirs.insert(dirs.end(), m_includeDirs.begin(), m_includeDirs.end());
+
+    for (const std::string& dir : dirs) {
+        std::string path = dir + "/" + name;
+        if (std::find(m_files.begin(), m_files.end(), path) == m_files.end())
+            m_files.push_back(path);
+        if (FileTryReadAllBytes(path.c_str(), text)) {
+            *includePath = path;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ShaderPreprocessor::AddLines(const char* text, size_t len,
+                                  u64 required, u64 excluded,
+                                  const ParseState& state)
+{
+    u32 nLines = 0;
+    u64 references = 0;
+    for (size_t i = 0; i < len; ) {
+        if (text[i] == '\n')
+            ++nLines;
+
+        if (!IsIdentifierChar(text[i])) {
+            ++i;
+            continue;
+        }
+
+        size_t start = i;
+        for (; i < len && IsIdentifierChar(text[i]); ++i)
+            ;
+        if (i - start < 4 || text[start] != 'F' || text[start + 1] != '_')
+            continue;
+
+        auto option = state.optionBits.find(std::string(text + start, i - start));
+        if (option != state.optionBits.end())
+            references |= u64(1) << option->second;
+    }
+
+    size_t begin = m_source.length();
+    m_source.append(text, len);
+
+    if (!m_segments.empty()) {
+        Segment& last = m_segments.back();
+        if (last.required == required && last.excluded == excluded) {
+            last.end = m_source.length();
+            last.references |= references;
+            last.nLines += nLines;
+            return;
+        }
+    }
+
+    Segment segment = { begin, m_source.length(), required, excluded,
+                        references, nLines };
+    m_segments.push_back(segment);
+}
+
+bool ShaderPreprocessor::IsVisible(const Segment& segment,
+                                   u64 permuteMask) const
+{
+    return (permuteMask & segment.required) == segment.required &&
+           (permuteMask & segment.excluded) == 0;
+}
+
+template <typename Func>
+void ShaderPreprocessor::VisitPermutationText(u64 permuteMask, Func func) const
+{
+    static const char NEWLINES[] = "\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n";
+    const u32 MAX_NEWLINES = sizeof NEWLINES - 1;
+
+    for (const Segment& segment : m_segments) {
+        if (IsVisible(segment, permuteMask)) {
+            func(m_source.data() + segment.begin, segment.end - segment.begin);
+        } else if (m_preserveLines) {
+            for (u32 n = segment.nLines; n > 0; ) {
+                u32 count = n < MAX_NEWLINES ? n : MAX_NEWLINES;
+                func(NEWLINES, count);
+                n -= count;
+            }
+        }
+    }
+}
+
+void ShaderPreprocessor::GetPermutationText(u64 permuteMask,
+                                            std::string* text) const
+{
+    ASSERT(text);
+
+    text->clear();
+    VisitPermutationText(permuteMask, [text](const char* data, size_t len) {
+        text->append(data, len);
+    });
+}
+
+void ShaderPreprocessor::HashPermutation(u64 permuteMask, Sha256* hash) const
+{
+    ASSERT(hash);
+
+    u64 references = 0;
+    for (const Segment& segment : m_segments) {
+        if (IsVisible(segment, permuteMask))
+            references |= segment.references;
+    }
+
+    // An option macro that the text never mentions can't affect the output,
+    // so only the ones that it does mention are hashed.
+    u64 definedReferences = references & permuteMask;
+    for (const auto& pair : m_ifdefs) {
+        if (pair.first < 64 && (definedReferences & (u64(1) << pair.first)))
+            hash->UpdateStr(pair.second.c_str());
+    }
+    hash->UpdateStr("");
+
+    VisitPermutationText(permuteMask, [hash](const char* data, size_t len) {
+        hash->Update(data, len);
+    });
+}
+
+// The name of an entry point is the last identifier before the first '('
+// after its qualifier: 'vertex VertexOut vs_main(...)'. Comments, string
+// literals and preprocessor lines (the option directives among them) are
+// skipped.
+void ShaderPreprocessor::FindEntryPoints(std::vector<std::string>* names) const
+{
+    ASSERT(names);
+
+    names->clear();
+    std::set<std::string> found;
+    const char* p = m_source.data();
+    const char* end = p + m_source.length();
+    bool lineStart = true;
+    bool afterQualifier = false;
+    std::string identifier;
+    while (p < end) {
+        if (lineStart) {
+            const char* q = p;
+            for (; q < end && (*q == ' ' || *q == '\t'); ++q)
+                ;
+            if (q < end && *q == '#') {
+                for (p = q; p < end && *p != '\n'; ++p) {
+                    if (*p == '\\' && p + 1 < end)
+                        ++p;
+                }
+                continue;
+            }
+            lineStart = false;
+        }
+
+        char c = *p;
+        if (c == '\n') {
+            lineStart = true;
+            ++p;
+        } else if (c == '/' && p + 1 < end && p[1] == '/') {
+            for (; p < end && *p != '\n'; ++p)
+                ;
+        } else if (c == '/' && p + 1 < end && p[1] == '*') {
+            const char* close = strstr(p + 2, "*/");
+            p = close ? close + 2 : end;
+        } else if (c == '"' || c == '\'') {
+            for (++p; p < end && *p != c && *p != '\n'; ++p) {
+                if (*p == '\\' && p + 1 < end)
+                    ++p;
+            }
+            if (p < end && *p == c)
+                ++p;
+        } else if (IsIdentifierChar(c)) {
+            const char* start = p;
+            for (; p < end && IsIdentifierChar(*p); ++p)
+                ;
+            identifier.assign(start, p);
+            if (identifier == "vertex" || identifier == "fragment" ||
+                identifier == "kernel") {
+                afterQualifier = true;
+                identifier.clear();
+            }
+        } else {
+            if (c == '(' && afterQualifier && !identifier.empty() &&
+                !isdigit((unsigned char)identifier[0]) &&
+                found.insert(identifier).second)
+                names->push_back(identifier);
+            if (c == '(' || c == ';' || c == '{' || c == '}')
+                afterQualifier = false;
+            if (!isspace((unsigned char)c))
+                identifier.clear();
+            ++p;
+        }
+    }
+}
@@ -0,0 +1,115 @@
+#ifndef SHADERPREPROCESSOR_H
+#define SHADERPREPROCESSOR_H
+
+#include <stddef.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <Core/Types.h>
+#include <Util/Sha256.h>
+
+// Maps the index ## of each F_## option to its macro name.
+// N.B. The iteration behavior of std::map (in ascending order of the keys)
+// is important to the algorithm. Do not change this to an unordered_map!
+typedef std::map<int, std::string> IfdefMap;
+
+// A '#pragma permutation' directive, which declares PermutationConstraints.
+struct PermutationPragma {
+    std::string path;
+    u32 line;
+    // The rest of the line after '#pragma permutation'.
+    std::string text;
+};
+
+// Works out the effective source that each permutation of a shader sees.
+// #include directives for files that can be found are expanded in place, and
+// the #ifdef/#ifndef/#else/#endif blocks that test the F_## option macros are
+// resolved. Everything else (other conditionals, macros, code) is left alone
+// for the real compiler to deal with.
+//
+// Masks are permuteMasks, i.e. bit ## is set if option F_## is defined.
+class ShaderPreprocessor {
+public:
+    ShaderPreprocessor();
+
+    // Parses the text of the shader at 'path'. includeDirs are searched for
+    // included files, like the compiler's -I directories.
+    //
+    // Returns false if the option blocks can't be resolved safely, e.g.
+    // because an option macro is #defined in the source or an option block
+    // has an #elif. In that case every permutation sees the whole source.
+    bool Parse(const char* path, const u8* text, size_t size,
+               const IfdefMap& ifdefs,
+               const std::vector<std::string>& includeDirs);
+
+    // The source with includes expanded and the lines that the permutation
+    // can't see removed.
+    void GetPermutationText(u64 permuteMask, std::string* text) const;
+
+    // Hashes everything that the permutation's compiled output can depend on
+    // (apart from the toolchain and compiler options): its text, and which of
+    // the option macros it mentions are defined. Permutations with the same
+    // hash compile to the same thing.
+    void HashPermutation(u64 permuteMask, Sha256* hash) const;
+
+    // The files that the last Parse() read or tried to read: the shader
+    // itself, then any includes. An include that doesn't exist is listed too,
+    // since creating it would change the source.
+    const std::vector<std::string>& GetFiles() const { return m_files; }
+
+    // The '#pragma permutation' directives in the shader itself (not its
+    // includes) that every permutation sees: ones inside a comment or any
+    // conditional block, #if 0 included, don't count.
+    const std::vector<PermutationPragma>& GetPermutationPragmas() const
+    {
+        return m_permutationPragmas;
+    }
+
+    // The names of the functions declared 'vertex', 'fragment' or 'kernel'
+    // anywhere in the expanded source, whichever permutations see them, in
+    // the order they first appear.
+    void FindEntryPoints(std::vector<std::string>* names) const;
+
+private:
+    ShaderPreprocessor(const ShaderPreprocessor&);
+    ShaderPreprocessor& operator=(const ShaderPreprocessor&);
+
+    // A run of lines controlled by the same option blocks. The run is seen
+    // by masks that have all the required bits and none of the excluded ones.
+    struct Segment {
+        size_t begin;
+        size_t end;
+        u64 required;
+        u64 excluded;
+        // The options whose macro names appear in the run.
+        u64 references;
+        u32 nLines;
+    };
+
+    struct ParseState;
+
+    void ParseFile(const std::string& path, const u8* text, size_t size,
+                   int depth, ParseState* state);
+    bool FindInclude(const std::string& fromPath, const std::string& name,
+                     bool angled, std::string* includePath,
+                     std::vector<u8>* text);
+    void AddLines(const char* text, size_t len, u64 required, u64 excluded,
+                  const ParseState& state);
+    bool IsVisible(const Segment& segment, u64 permuteMask) const;
+
+    template <typename Func>
+    void VisitPermutationText(u64 permuteMask, Func func) const;
+
+    // The expanded source. Segments index into this.
+    std::string m_source;
+    std::vector<Segment> m_segments;
+    IfdefMap m_ifdefs;
+    std::vector<std::string> m_includeDirs;
+    std::vector<std::string> m_files;
+    std::vector<PermutationPragma> m_permutationPragmas;
+    // Hidden lines are replaced by blank ones rather than removed, so that
+    // __LINE__ still expands to the same values.
+    bool m_preserveLines;
+};
+
+#endif // SHADERPREPROCESSOR_H
@@ -0,0 +1,157 @@
+#include "StagePipeline.h"
+
+#include <deque>
+#include <algorithm>
+#include <Core/Macros.h>
+
+namespace {
+
+struct RunningJob {
+    size_t job;
+    unsigned stage;
+    unsigned slot;
+};
+
+struct StageQueue {
+    // Jobs ready for the stage, and their slots.
+    std::deque<RunningJob> waiting;
+    size_t maxQueued;
+    double totalQueued;
+};
+
+} // namespace
+
+static void StartStage(const RunningJob& running, StagePipelineJobs* jobs,
+                       ProcessGroup* group, std::vector<RunningJob>* inFlight)
+{
+    std::vector<std::string> args;
+    jobs->GetCommand(running.job, running.stage, running.slot, &args);
+    ASSERT(!args.empty());
+
+    std::vector<const char*> argv;
+    for (const std::string& arg : args)
+        argv.push_back(arg.c_str());
+    argv.push_back(NULL);
+
+    size_t tag = inFlight->size();
+    for (size_t i = 0; i < inFlight->size(); ++i) {
+        if ((*inFlight)[i].stage == ~0u) {
+            tag = i;
+            break;
+        }
+    }
+    if (tag == inFlight->size())
+        inFlight->push_back(running);
+    else
+        (*inFlight)[tag] = running;
+
+    if (group->Start(argv[0], argv, tag) != PROCESS_SUCCESS)
+        FATAL("Could not run '%s'", argv[0]);
+}
+
+void StagePipelineRun(size_t nJobs, unsigned nStages, unsigned maxProcesses,
+                      StagePipelineJobs* jobs,
+                      std::vector<StageStats>* stats)
+{
+    ASSERT(nStages > 0);
+    ASSERT(maxProcesses > 0);
+    ASSERT(jobs);
+
+    ProcessGroup group;
+    std::vector<StageQueue> queues(nStages);
+    for (StageQueue& queue : queues) {
+        queue.maxQueued = 0;
+        queue.totalQueued = 0.0;
+    }
+
+    // Indexed by process tag. Free entries have stage ~0u.
+    std::vector<RunningJob> inFlight;
+    std::vector<unsigned> freeSlots;
+    unsigned nSlots = 0;
+    size_t nextJob = 0;
+    bool stopped = false;
+    size_t nSamples = 0;
+
+    std::vector<size_t> nRun(nStages, 0);
+
+    for (;;) {
+        // Start whatever can be started, later stages first. The first stage
+        // takes new jobs straight from the input.
+        while (group.GetRunningCount() < maxProcesses) {
+            RunningJob running;
+            bool found = false;
+            for (unsigned stage = nStages; stage-- > 1; ) {
+                if (!queues[stage].waiting.empty()) {
+                    running = queues[stage].waiting.front();
+                    queues[stage].waiting.pop_front();
+                    found = true;
+                    break;
+                }
+            }
+
+            while (!found && !stopped && nextJob < nJobs) {
+                running.job = nextJob++;
+                running.stage = 0;
+                if (freeSlots.empty()) {
+                    running.slot = nSlots++;
+                } else {
+                    running.slot = freeSlots.back();
+                    freeSlots.pop_back();
+                }
+
+                if (jobs->BeginJob(running.job, running.slot)) {
+                    found = true;
+                } else {
+                    freeSlots.push_back(running.slot);
+                    jobs->EndJob(running.job);
+                }
+            }
+
+            if (!found)
+                break;
+
+            StartStage(running, jobs, &group, &inFlight);
+            ++nRun[running.stage];
+        }
+
+        // Sample the queue depths. The first stage's queue is the jobs that
+        // haven't entered yet.
+        ++nSamples;
+        for (unsigned stage = 0; stage < nStages; ++stage) {
+            size_t queued = stage == 0 ? (stopped ? 0 : nJobs - nextJob)
+                                       : queues[stage].waiting.size();
+            queues[stage].maxQueued = std::max(queues[stage].maxQueued, queued);
+            queues[stage].totalQueued += (double)queued;
+        }
+
+        ProcessExit processExit;
+        if (!group.Wait(&processExit))
+            break;
+
+        RunningJob running = inFlight[processExit.tag];
+        inFlight[processExit.tag].stage = ~0u;
+
+        bool succeeded = jobs->EndStage(running.job, running.stage,
+                                        &processExit);
+        if (succeeded && running.stage + 1 < nStages) {
+            ++running.stage;
+            queues[running.stage].waiting.push_back(running);
+            continue;
+        }
+
+        if (!succeeded)
+            stopped = true;
+        freeSlots.push_back(running.slot);
+        jobs->EndJob(running.job);
+    }
+
+    if (stats) {
+        stats->resize(nStages);
+        for (unsigned stage = 0; stage < nStages; ++stage) {
+            StageStats& stageStats = (*stats)[stage];
+            stageStats.nRun = nRun[stage];
+            stageStats.maxQueued = queues[stage].maxQueued;
+            stageStats.meanQueued = queues[stage].totalQueued / (double)nSamples;
+        }
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef STAGEPIPELINE_H
+#define STAGEPIPELINE_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <Os/Process.h>
+
+// How busy one stage of a pipeline was.
+struct StageStats {
+    size_t nRun;
+    // The number of jobs waiting for the stage, at its highest and on
+    // average. Sampled whenever a process starts or exits.
+    size_t maxQueued;
+    double meanQueued;
+};
+
+// The jobs that a pipeline runs, and what each stage of a job does.
+class StagePipelineJobs {
+public:
+    virtual ~StagePipelineJobs() {}
+
+    // Called as a job enters the pipeline, with the slot that it has to
+    // itself until it leaves (for naming intermediate files, say). Returns
+    // false if the job turns out to need no stages at all.
+    virtual bool BeginJob(size_t job, unsigned slot) = 0;
+
+    // Fills in the command line for a stage of a job. args[0] is the path of
+    // the program to run.
+    virtual void GetCommand(size_t job, unsigned stage, unsigned slot,
+                            std::vector<std::string>* args) = 0;
+
+    // Called when a stage's process exits. Returning false fails the job,
+    // which then leaves the pipeline.
+    virtual bool EndStage(size_t job, unsigned stage,
+                          ProcessExit* processExit) = 0;
+
+    // Called when a job leaves the pipeline, whether it succeeded or not.
+    virtual void EndJob(size_t job) = 0;
+};
+
+// Runs jobs 0 to (nJobs - 1) through nStages stages, where each stage of a
+// job is one child process. Every stage has its own queue, so while one job
+// is in the first stage, others can be in the later ones. At most
+// maxProcesses processes run at once; the later stages get first pick, so
+// that jobs leave the pipeline as soon as they can.
+//
+// Jobs enter in ascending order. After a job fails, no new jobs enter, but
+// the ones already in the pipeline still go through every stage. Everything
+// runs on the calling thread; returns once every job that entered has left.
+void StagePipelineRun(size_t nJobs, unsigned nStages, unsigned maxProcesses,
+                      StagePipelineJobs* jobs,
+                      std::vector<StageStats>* stats);
+
+#endif // STAGEPIPELINE_H
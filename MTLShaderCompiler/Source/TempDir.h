@@ -5,4 +5,7 @@
 
 std::string TempDirMake();
 
+// Deletes the directory and everything in it.
+void TempDirDelete(const char* path);
+
 #endif // TEMPDIR_H
@@ -27,3 +27,13 @@ std::string TempDirMake()
 
     return result;
 }
+
+void TempDirDelete(const char* path)
+{
+    NSFileManager* fileManager = [NSFileManager defaultManager];
+    NSString* dir = [fileManager stringWithFileSystemRepresentation:path
+                                                             length:StrLen(path)];
+    NSError* error = nil;
+    if (![fileManager removeItemAtPath:dir error:&error])
+        NSLog(@"Failed to delete temporary directory %@: %@", dir, error);
+}
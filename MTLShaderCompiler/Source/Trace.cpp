@@ -0,0 +1,150 @@
+#include "Trace.h"
+
+#include <stdio.h>
+#include <Core/Macros.h>
+#include <Os/File.h>
+#include <Os/Time.h>
+
+// All the events are in one process.
+const int TRACE_PID = 1;
+
+static void AppendJsonString(std::string* json, const std::string& value)
+{
+    json->push_back('"');
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            json->push_back('\\');
+            json->push_back(c);
+        } else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof escaped, "\\u%04x", (unsigned char)c);
+            json->append(escaped);
+        } else {
+            json->push_back(c);
+        }
+    }
+    json->push_back('"');
+}
+
+void TraceArgs::AddName(const char* name)
+{
+    if (!m_json.empty())
+        m_json.push_back(',');
+    AppendJsonString(&m_json, name);
+    m_json.push_back(':');
+}
+
+void TraceArgs::Add(const char* name, u64 value)
+{
+    AddName(name);
+    m_json.append(std::to_string(value));
+}
+
+void TraceArgs::Add(const char* name, const std::string& value)
+{
+    AddName(name);
+    AppendJsonString(&m_json, value);
+}
+
+TraceLog::TraceLog()
+    : m_startTime(TimeGetMicroseconds())
+    , m_mutex()
+    , m_events()
+{}
+
+u64 TraceLog::Now() const
+{
+    return TimeGetMicroseconds() - m_startTime;
+}
+
+void TraceLog::SetTrackName(u32 track, const std::string& name)
+{
+    TraceArgs args;
+    args.Add("name", name);
+    Event event = { "thread_name", 'M', track, 0, 0, 0, args.GetJson() };
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_events.push_back(event);
+}
+
+void TraceLog::AddSpan(const char* name, u32 track, u64 start, u64 end,
+                       const TraceArgs& args)
+{
+    ASSERT(start <= end);
+    Event event = { name, 'X', track, 0, start, end - start, args.GetJson() };
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_events.push_back(event);
+}
+
+void TraceLog::AddAsyncSpan(const char* name, u64 id, u64 start, u64 end,
+                            const TraceArgs& args)
+{
+    ASSERT(start <= end);
+    Event begin = { name, 'b', 0, id, start, 0, args.GetJson() };
+    Event finish = { name, 'e', 0, id, end, 0, std::string() };
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_events.push_back(begin);
+    m_events.push_back(finish);
+}
+
+bool TraceLog::Write(const char* path) const
+{
+    ASSERT(path);
+
+    std::string json = "{\"traceEvents\":[\n";
+    for (size_t i = 0; i < m_events.size(); ++i) {
+        const Event& event = m_events[i];
+        char fields[160];
+        snprintf(fields, sizeof fields,
+                 "\"ph\":\"%c\",\"pid\":%d,\"tid\":%u,\"ts\":%llu",
+                 event.phase, TRACE_PID, event.track,
+                 (unsigned long long)event.time);
+
+        json.append("{\"name\":");
+        AppendJsonString(&json, event.name);
+        json.append(",\"cat\":\"build\",");
+        json.append(fields);
+        if (event.phase == 'X')
+            json.append(",\"dur\":" + std::to_string(event.duration));
+        if (event.phase == 'b' || event.phase == 'e')
+            json.append(",\"id\":" + std::to_string(event.id));
+        json.append(",\"args\":{" + event.args + "}}");
+        json.append(i + 1 < m_events.size() ? ",\n" : "\n");
+    }
+    json.append("],\"displayTimeUnit\":\"ms\"}\n");
+
+    return FileTryWriteAllBytesAtomic(path, json.data(), json.size());
+}
+
+TraceScope::TraceScope(TraceLog* log, const char* name)
+    : m_log(log)
+    , m_track(0)
+    , m_name(name)
+    , m_start(log ? log->Now() : 0)
+    , m_args()
+{}
+
+TraceScope::TraceScope(TraceLog* log, u32 track, const char* name)
+    : m_log(log)
+    , m_track(track)
+    , m_name(name)
+    , m_start(log ? log->Now() : 0)
+    , m_args()
+{}
+
+TraceScope::~TraceScope()
+{
+    if (m_log)
+        m_log->AddSpan(m_name, m_track, m_start, m_log->Now(), m_args);
+}
+
+void TraceScope::Arg(const char* name, u64 value)
+{
+    if (m_log)
+        m_args.Add(name, value);
+}
+
+void TraceScope::Arg(const char* name, const std::string& value)
+{
+    if (m_log)
+        m_args.Add(name, value);
+}
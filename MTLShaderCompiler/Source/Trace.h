@@ -0,0 +1,91 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <Core/Types.h>
+
+// Arguments attached to a trace event, e.g. the permutation's mask.
+class TraceArgs {
+public:
+    void Add(const char* name, u64 value);
+    void Add(const char* name, const std::string& value);
+
+    // The arguments as the members of a JSON object.
+    const std::string& GetJson() const { return m_json; }
+
+private:
+    void AddName(const char* name);
+
+    std::string m_json;
+};
+
+// Collects timed events during a build, and writes them as Chrome trace-event
+// JSON for chrome://tracing or Perfetto. Events can be added from any thread.
+//
+// Events belong to a track: track 0 is the main thread, and the pipeline's
+// slots and other threads get a track each.
+class TraceLog {
+public:
+    TraceLog();
+
+    // Microseconds since the log was made.
+    u64 Now() const;
+
+    void SetTrackName(u32 track, const std::string& name);
+
+    // An interval on a track. Intervals on the same track must nest.
+    void AddSpan(const char* name, u32 track, u64 start, u64 end,
+                 const TraceArgs& args);
+    // An interval that can overlap others, like a shader's whole build.
+    // Spans with the same name and id are shown in a row of their own.
+    void AddAsyncSpan(const char* name, u64 id, u64 start, u64 end,
+                      const TraceArgs& args);
+
+    // Returns false if the file can't be written.
+    bool Write(const char* path) const;
+
+private:
+    TraceLog(const TraceLog&);
+    TraceLog& operator=(const TraceLog&);
+
+    struct Event {
+        const char* name;
+        char phase;
+        u32 track;
+        u64 id;
+        u64 time;
+        u64 duration;
+        std::string args;
+    };
+
+    u64 m_startTime;
+    std::mutex m_mutex;
+    std::vector<Event> m_events;
+};
+
+// Adds a span covering its own lifetime. Does nothing if the log is NULL, so
+// builds without a trace only pay for the check.
+class TraceScope {
+public:
+    // On track 0, or on the given track.
+    TraceScope(TraceLog* log, const char* name);
+    TraceScope(TraceLog* log, u32 track, const char* name);
+    ~TraceScope();
+
+    void Arg(const char* name, u64 value);
+    void Arg(const char* name, const std::string& value);
+
+private:
+    TraceScope(const TraceScope&);
+    TraceScope& operator=(const TraceScope&);
+
+    TraceLog* m_log;
+    u32 m_track;
+    const char* m_name;
+    u64 m_start;
+    TraceArgs m_args;
+};
+
+#endif // TRACE_H
@@ -0,0 +1,29 @@
+#include "WireFormat.h"
+
+void WireAppendHeader(std::vector<u8>* message, const char* magic,
+                      u32 version)
+{
+    message->insert(message->end(), magic, magic + 4);
+    WireAppend32(message, version);
+}
+
+void WireAppend32(std::vector<u8>* message, u32 n)
+{
+    n = EndianSwapLE32(n);
+    const u8* bytes = (const u8*)&n;
+    message->insert(message->end(), bytes, bytes + 4);
+}
+
+void WireAppendString(std::vector<u8>* message, const std::string& str)
+{
+    WireAppend32(message, (u32)str.length());
+    message->insert(message->end(), str.begin(), str.end());
+}
+
+void WireAppendStrings(std::vector<u8>* message,
+                       const std::vector<std::string>& strs)
+{
+    WireAppend32(message, (u32)strs.size());
+    for (const std::string& str : strs)
+        WireAppendString(message, str);
+}
@@ -0,0 +1,71 @@
+#ifndef WIREFORMAT_H
+#define WIREFORMAT_H
+
+#include <string.h>
+#include <string>
+#include <vector>
+#include <Core/Types.h>
+#include <Core/Endian.h>
+
+// The encoding shared by the compile server's and the distributed compile's
+// protocols. A message starts with a four-character magic number and a
+// version, and the rest is little-endian u32s and strings. A string is its
+// length followed by its bytes, and a list of strings is its count followed
+// by the strings.
+//
+// The Receive functions read from any socket with a
+// 'bool ReceiveAll(void* data, size_t len)', and return false if it fails or
+// the message is malformed. Limits on lengths and counts reject broken or
+// foreign peers before anything is allocated for them.
+
+void WireAppendHeader(std::vector<u8>* message, const char* magic,
+                      u32 version);
+void WireAppend32(std::vector<u8>* message, u32 n);
+void WireAppendString(std::vector<u8>* message, const std::string& str);
+void WireAppendStrings(std::vector<u8>* message,
+                       const std::vector<std::string>& strs);
+
+template <typename Socket>
+bool WireReceive32(Socket& socket, u32* n)
+{
+    if (!socket.ReceiveAll(n, 4))
+        return false;
+    *n = EndianSwapLE32(*n);
+    return true;
+}
+
+template <typename Socket>
+bool WireReceiveHeader(Socket& socket, const char* magic, u32 version)
+{
+    char header[4];
+    u32 received;
+    return socket.ReceiveAll(header, 4) && memcmp(header, magic, 4) == 0 &&
+           WireReceive32(socket, &received) && received == version;
+}
+
+template <typename Socket>
+bool WireReceiveString(Socket& socket, u32 maxLength, std::string* str)
+{
+    u32 len;
+    if (!WireReceive32(socket, &len) || len > maxLength)
+        return false;
+    str->resize(len);
+    return len == 0 || socket.ReceiveAll(&(*str)[0], len);
+}
+
+template <typename Socket>
+bool WireReceiveStrings(Socket& socket, u32 maxCount, u32 maxLength,
+                        std::vector<std::string>* strs)
+{
+    u32 count;
+    if (!WireReceive32(socket, &count) || count > maxCount)
+        return false;
+    strs->resize(count);
+    for (std::string& str : *strs) {
+        if (!WireReceiveString(socket, maxLength, &str))
+            return false;
+    }
+    return true;
+}
+
+#endif // WIREFORMAT_H
@@ -1,203 +1,1926 @@
 #include <vector>
 #include <map>
+#include <set>
+#include <memory>
 #include <algorithm>
 #include <fstream>
 #include <sstream>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <stdio.h>
-#include <ctype.h> // for isspace
+#include <errno.h>
+#include <time.h>
+#include <ctype.h>
 #include <assert.h>
 #include <Core/Macros.h>
+#include <Core/Str.h>
 #include <Os/Process.h>
 #include <Os/File.h>
+#include <Os/Dir.h>
+#include <Os/MappedFile.h>
+#include <Os/TcpSocket.h>
 #include <Util/BinaryWriter.h>
+#include <Util/Delta.h>
+#include <Util/Lz.h>
+#include <Util/Sha256.h>
+#include <Util/ShaderFormat.h>
+#include <Util/ShaderFileReader.h>
 #include "TempDir.h"
+#include "StagePipeline.h"
+#include "PermutationCache.h"
+#include "PermutationDigests.h"
+#include "ShaderPreprocessor.h"
+#include "ShaderPackWriter.h"
+#include "OptionScanner.h"
+#include "MaskEnumerator.h"
+#include "CompileServer.h"
+#include "RemoteCache.h"
+#include "DistributedCompile.h"
+#include "Trace.h"
+
+struct TempDirDeletionAssurance {
+    ~TempDirDeletionAssurance()
+    {
+        for (const std::string& path : paths)
+            TempDirDelete(path.c_str());
+    }
+
+    std::vector<std::string> paths;
+};
+
+// Bump this to invalidate all existing permutation cache entries.
+const int CACHE_KEY_VERSION = 5;
+const u64 DEFAULT_CACHE_SIZE_MB = 1024;
+const u64 SERVER_MEMORY_CACHE_SIZE_MB = 256;
+// A remote cache server holds the permutations of every machine's builds.
+const u64 REMOTE_CACHE_SERVER_SIZE_MB = 16 * 1024;
+// Where a worker listens if it's only given a port. Workers don't
+// authenticate coordinators, so other hosts take --allow-remote.
+const char* const WORKER_DEFAULT_HOST = "127.0.0.1";
+// Every permutation has its own compile and its own record in the output, so
+// a shader with more than this many is almost certainly a mistake.
+const size_t MAX_PERMUTATIONS = 1 << 20;
+
+const char* const TOOL_METAL =
+"/Applications/Xcode.app/Contents/Developer/Platforms/MacOSX.platform/usr/bin/metal";
+
+const char* const TOOL_METALLIB =
+"/Applications/Xcode.app/Contents/Developer/Platforms/MacOSX.platform/usr/bin/metallib";
+
+const char* const SYSROOT =
+"/Applications/Xcode.app/Contents/Developer/Platforms/MacOSX.platform/Developer/SDKs/MacOSX.sdk";
+
+// Intermediates are named after the pipeline slot of the permutation that
+// made them. They are overwritten by the slot's next permutation rather than
+// deleted.
+const char* const AIR_FILE_SUFFIX = ".air";
 
-struct FILEWrapper {
-    FILEWrapper(FILE* fp) : fp(fp) {}
-    ~FILEWrapper() { fclose(fp); }
+// The compiler keeps the modules that it builds for the system headers
+// (metal_stdlib and the rest) here, inside the cache directory if there is
+// one, otherwise in the session's temporary directory.
+const char* const MODULE_CACHE_DIR = "modules";
 
-    operator FILE*() { return fp; }
+enum CompileStage {
+    STAGE_METAL,
+    STAGE_METALLIB,
+    NUM_COMPILE_STAGES
+};
 
-    FILE* fp;
+const char* const COMPILE_STAGE_NAMES[NUM_COMPILE_STAGES] = {
+    "metal", "metallib"
 };
 
-struct FileDeletionAssurance {
-    explicit FileDeletionAssurance(const std::string& path) : path(path) {}
+// Incremental builds keep the permutation digests in output_path + this.
+const char* const DIGESTS_FILE_SUFFIX = ".digests";
+
+// With -MD, the Make-style list of the files that the output depends on goes
+// in output_path + this.
+const char* const DEPFILE_SUFFIX = ".d";
+
+struct CompileOptions {
+    CompileOptions()
+        : numJobs(1)
+        , cacheDir(NULL)
+        , cacheSizeMB(DEFAULT_CACHE_SIZE_MB)
+        , incremental(false)
+        , printStats(false)
+        , compress(false)
+        , delta(false)
+        , linkBatch(0)
+        , packPath(NULL)
+        , remoteCache(NULL)
+        , tracePath(NULL)
+        , workers()
+        , loopbackWorkers(0)
+        , writeDepfile(false)
+        , includeDirs()
+        , projectRoot()
+        , useProfile(false)
+        , profileNeighbours(false)
+        , profilePath(NULL)
+        , profileMasks()
+    {}
+
+    unsigned numJobs;
+    const char* cacheDir;
+    u64 cacheSizeMB;
+    bool incremental;
+    bool printStats;
+    // Store each permutation's metallib LZ-compressed.
+    bool compress;
+    // Store permutations as deltas against similar ones where that's smaller.
+    bool delta;
+    // Link this many permutations into each metallib, with their entry
+    // points renamed, or 0 to link each permutation on its own.
+    unsigned linkBatch;
+    // Where to write every shader into one pack instead of separate files,
+    // or NULL.
+    const char* packPath;
+    // The "host:port" of a remote cache server to share permutations
+    // through, or NULL.
+    const char* remoteCache;
+    // Where to write a Chrome trace of the build, or NULL.
+    const char* tracePath;
+    // The "host:port"s of workers to compile permutations on.
+    std::vector<std::string> workers;
+    // The number of workers to run in this process, over loopback
+    // connections.
+    unsigned loopbackWorkers;
+    bool writeDepfile;
+    // Passed to 'metal' as -I options, and searched for #included files.
+    std::vector<std::string> includeDirs;
+    // The absolute path of the directory that permutation digests take paths
+    // relative to, so that checkouts in different places share them.
+    std::string projectRoot;
+    // With a usage profile, only the permutations in profileMasks are built
+    // (and, with profileNeighbours, those one option away from them). The
+    // rest are deferred: left out of the output, to be built when needed.
+    bool useProfile;
+    bool profileNeighbours;
+    const char* profilePath;
+    // Each mask maps to the line of the profile that it was first read from.
+    std::map<u64, int> profileMasks;
+};
 
-    ~FileDeletionAssurance() { if (!path.empty()) FileDelete(path.c_str()); }
+// State shared by all the permutations of one shader.
+struct ShaderCompileContext {
+    const char* inputPath;
+    const std::vector<std::string>* includeDirs;
+    // NULL if caching is disabled.
+    PermutationCache* cache;
+    // NULL unless running as a server.
+    PermutationMemoryCache* memoryCache;
+    // Where 'metal' keeps the modules it builds.
+    const char* moduleCachePath;
+    // NULL unless tracing.
+    TraceLog* trace;
+    // NULL unless writing a pack.
+    ShaderPackWriter* pack;
+    // NULL unless there's a remote cache.
+    RemotePermutationCache* remoteCache;
+    // Where shared libraries are linked.
+    const char* tempDir;
+};
 
-    void Stop() { path.clear(); }
+struct Permutation {
+    u64 permuteMask;
+    std::vector<std::string> macros;
+    // Hash of everything that the compiled permutation depends on.
+    // Permutations with equal digests compile to the same bytes.
+    Sha256Digest inputDigest;
+};
 
+struct SourceFile {
     std::string path;
+    bool exists;
+    FileInfo info;
 };
 
-const int SHADER_FORMAT_VERSION = 1;
+// What a shader's source files say about its permutations. The server keeps
+// these between requests, and reuses one for as long as its files are
+// unchanged. Its paths are absolute, so that builds from any directory can
+// share it.
+struct ShaderSource {
+    ShaderSource() : readTime(0), compileInputsKey(), digests() {}
 
-const char* const TOOL_METAL =
-"/Applications/Xcode.app/Contents/Developer/Platforms/MacOSX.platform/usr/bin/metal";
+    IfdefMap ifdefs;
+    PermutationConstraints constraints;
+    // Set if the shader can't be read or its constraints are malformed, in
+    // which case it can't be built.
+    std::string error;
+    ShaderPreprocessor preprocessor;
+    // The functions declared vertex, fragment or kernel, which are renamed
+    // in each permutation of a shared library.
+    std::vector<std::string> entryPoints;
+    // Every file that the preprocessor read, as it was when read.
+    std::vector<SourceFile> files;
+    // When the files were read (seconds since the Unix epoch).
+    i64 readTime;
+
+    // The permutations' inputDigests, which are only valid while the
+    // toolchain and compiler options hash to compileInputsKey.
+    Sha256Digest compileInputsKey;
+    std::map<u64, Sha256Digest> digests;
+};
 
-const char* const TOOL_METAL_AR =
-"/Applications/Xcode.app/Contents/Developer/Platforms/MacOSX.platform/usr/bin/metal-ar";
+// State that outlives a single build. A one-off build gets a fresh session;
+// the server keeps one for as long as it runs.
+struct CompileSession {
+    CompileSession() : memoryCache(NULL) {}
+
+    // NULL unless running as a server.
+    PermutationMemoryCache* memoryCache;
+    // Keyed by the absolute paths of the input and include directories.
+    std::map<std::string, std::unique_ptr<ShaderSource> > sources;
+    // Holds the intermediate files. Made by the first build.
+    TempDirDeletionAssurance tempDirs;
+};
 
-const char* const TOOL_METALLIB =
-"/Applications/Xcode.app/Contents/Developer/Platforms/MacOSX.platform/usr/bin/metallib";
+enum PermutationStatus {
+    PERMUTATION_NOT_RUN,
+    PERMUTATION_SUCCEEDED,
+    PERMUTATION_FAILED
+};
 
-const char* const SYSROOT =
-"/Applications/Xcode.app/Contents/Developer/Platforms/MacOSX.platform/Developer/SDKs/MacOSX.sdk";
+static std::string JoinPaths(const char* first, const char* second);
+static std::string GetAbsolutePath(const char* path);
+static ShaderSource* LoadShaderSource(
+    CompileSession* session, const char* inputPath,
+    const std::vector<std::string>& includeDirs);
+static void HashPermutationInputs(const std::string& projectRoot,
+                                  const char* inputPath,
+                                  const std::vector<std::string>& includeDirs,
+                                  bool sharedLibraries, ShaderSource* source,
+                                  std::vector<Permutation>* permutations);
+static u64 GetFunctionId(const Sha256Digest& inputDigest);
+static void ReusePreviousBuild(const char* outputPath, const char* digestsPath,
+                               const std::vector<Permutation>& permutations,
+                               std::vector<std::vector<u8> >* shaderBytes,
+                               std::vector<PermutationStatus>* status);
+static void GetMetalCommand(const ShaderCompileContext& context,
+                            const char* outputPath,
+                            const std::vector<std::string>& macros,
+                            std::vector<std::string>* args);
+static void GetMetalLibCommand(const std::vector<std::string>& inputPaths,
+                               std::vector<std::string>* args);
+static std::string GetSlotAirPath(const char* tempDir, unsigned slot);
+static unsigned GetCompileStageCount(bool sharedLibraries);
+static bool LookupCompiledPermutation(const ShaderCompileContext& context,
+                                      const Permutation& permutation,
+                                      std::vector<u8>* outputBytes);
+static void StoreCompiledPermutation(const ShaderCompileContext& context,
+                                     const Permutation& permutation,
+                                     const std::vector<u8>& bytes);
+static void FindDistinctBlobs(const std::vector<std::vector<u8> >& shaderBytes,
+                              std::vector<const std::vector<u8>*>* blobs,
+                              std::vector<u32>* blobIndices);
+static bool WriteShaderFile(BinaryWriter& writer,
+                            const std::vector<Permutation>& permutations,
+                            u64 optionBits,
+                            const PermutationConstraints& constraints,
+                            const std::vector<const std::vector<u8>*>& blobs,
+                            const std::vector<u32>& blobIndices,
+                            const std::vector<u64>* functionIds,
+                            bool compress, bool delta);
+
+// One input/output pair to build.
+struct ShaderPaths {
+    std::string inputPath;
+    std::string outputPath;
+};
 
-const char* const AIR_FILE = "out.air";
-const char* const DIAG_FILE = "diag.dia";
-const char* const METAL_AR_FILE = "out.metal-ar";
-const char* const METAL_LIBRARY_FILE = "library.metallib";
+// The state of one shader file's build.
+struct ShaderBuild {
+    std::string inputPath;
+    std::string outputPath;
+    ShaderCompileContext context;
+
+    std::vector<Permutation> permutations;
+    // Every option in the shader, and the combinations of them that it
+    // allows. Those that aren't among the permutations are skipped if the
+    // constraints rule them out, and deferred otherwise.
+    u64 optionBits;
+    PermutationConstraints constraints;
+    std::vector<std::vector<u8> > shaderBytes;
+    std::vector<std::string> errors;
+    std::vector<PermutationStatus> status;
+
+    // The files that the output depends on: the input and what it includes.
+    std::vector<std::string> dependencies;
+
+    // representatives[k] is the permutation whose bytes k gets a copy of.
+    std::vector<u32> representatives;
+    // The permutations that need compiling.
+    std::vector<u32> pending;
+    // The permutations that have been compiled, to store in the remote
+    // cache.
+    std::vector<u32> compiled;
+    // The number of pending permutations that haven't finished yet.
+    size_t remaining;
+
+    // Set if the build failed.
+    std::string errorOutput;
 
-const char* const TEMP_SHADER_FILE = "result.shd";
+    // For the trace: when the build started and finished, and the size of
+    // the output file.
+    u64 traceStart;
+    u64 traceEnd;
+    size_t outputSize;
+};
 
-// N.B. The iteration behavior of std::map (in ascending order of the keys)
-// is important to the algorithm. Do not change this to an unordered_map!
-typedef std::map<int, std::string> IfdefMap;
+// A permutation to compile: pending[k] of builds[build].
+struct PermutationJob {
+    u32 build;
+    u32 k;
+};
 
-static void FindOptionIfDefs(const char* path, IfdefMap* map);
-static u32 NumberOfSetBits(u32 i);
-static std::string JoinPaths(const char* first, const char* second);
-static bool InternalCompileShader(const char* inputPath, const char* tempDir,
-                                  const std::vector<std::string>& macros,
-                                  std::vector<u8>* outputBytes,
-                                  std::string* errorOutput);
+class ShaderBuildFinisher;
+
+static bool Compile(CompileSession* session,
+                    const std::vector<ShaderPaths>& shaders,
+                    const CompileOptions& options, std::string* errorOutput);
+static bool BuildShaders(CompileSession* session,
+                         const std::vector<ShaderPaths>& shaders,
+                         const CompileOptions& options, TraceLog* trace,
+                         std::vector<std::unique_ptr<ShaderBuild> >& builds,
+                         std::string* errorOutput);
+static bool PrepareShaderBuild(CompileSession* session,
+                               const CompileOptions& options,
+                               ShaderBuild* build, std::string* errorOutput);
+static void RunDistributed(const CompileOptions& options,
+                           ShaderBuildFinisher* finisher,
+                           std::vector<std::unique_ptr<ShaderBuild> >& builds,
+                           std::vector<PermutationJob>* jobs);
+static void CompileShard(CompileSession* session, unsigned numJobs,
+                         const ShardRequest& request,
+                         const ShardResultFunc& sendResult);
+static bool FinishShaderBuild(const CompileOptions& options,
+                              ShaderBuild* build);
+static bool LinkSharedLibraries(const ShaderBuild& build, unsigned batchSize,
+                                std::vector<std::vector<u8> >* libraries,
+                                std::vector<u32>* libraryIndices,
+                                std::vector<u64>* functionIds,
+                                std::string* errorOutput);
+static void FetchRemotePermutations(ShaderBuild* build);
+static void StoreRemotePermutations(const ShaderBuild& build);
+static bool WriteShaderPack(
+    const CompileOptions& options, const ShaderPackWriter& pack,
+    const std::vector<std::unique_ptr<ShaderBuild> >& builds, TraceLog* trace,
+    std::string* errorOutput);
+static bool FindFirstFailure(const ShaderBuild& build,
+                             std::string* errorOutput);
+static bool WriteDepfile(const std::string& outputPath,
+                         const std::vector<std::string>& dependencies,
+                         std::string* errorOutput);
+static bool ReadManifest(const char* path, std::vector<ShaderPaths>* shaders,
+                         std::string* errorOutput);
+static bool ReadProfile(const char* path, std::map<u64, int>* masks,
+                        std::string* errorOutput);
+static bool CheckProfileMasks(
+    const CompileOptions& options,
+    const std::vector<std::unique_ptr<ShaderBuild> >& builds,
+    std::string* errorOutput);
+static void GetProfileMasks(const CompileOptions& options, u64 optionBits,
+                            const PermutationConstraints& constraints,
+                            std::vector<u64>* masks);
+
+// The trace's tracks: the main thread's, the finisher's and then one for each
+// of the pipeline's slots.
+const u32 MAIN_TRACK = 0;
+const u32 FINISH_TRACK = 1;
+const u32 FIRST_SLOT_TRACK = 2;
+
+// Runs FinishShaderBuild() on a thread of its own, in the order that the
+// builds are added, so that hashing, compressing and writing the outputs
+// doesn't hold up the thread that starts processes and drains their pipes.
+// Once a build is added, only the finisher touches it until Finish() returns.
+class ShaderBuildFinisher {
+public:
+    explicit ShaderBuildFinisher(const CompileOptions& options)
+        : m_options(options)
+        , m_mutex()
+        , m_added()
+        , m_queue()
+        , m_stopping(false)
+        , m_thread()
+    {
+        m_thread = std::thread([this]() { Run(); });
+    }
+
+    ~ShaderBuildFinisher() { Finish(); }
+
+    void Add(ShaderBuild* build)
+    {
+        ASSERT(build);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(build);
+        m_added.notify_one();
+    }
+
+    // Waits for every build that was added to be finished.
+    void Finish()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+            m_added.notify_one();
+        }
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+
+private:
+    ShaderBuildFinisher(const ShaderBuildFinisher&);
+    ShaderBuildFinisher& operator=(const ShaderBuildFinisher&);
+
+    void Run()
+    {
+        for (;;) {
+            ShaderBuild* build;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_added.wait(lock, [this]() {
+                    return m_stopping || !m_queue.empty();
+                });
+                if (m_queue.empty())
+                    return;
+                build = m_queue.front();
+                m_queue.pop_front();
+            }
+            FinishShaderBuild(m_options, build);
+        }
+    }
+
+    const CompileOptions& m_options;
+    std::mutex m_mutex;
+    std::condition_variable m_added;
+    std::deque<ShaderBuild*> m_queue;
+    bool m_stopping;
+    std::thread m_thread;
+};
+
+// Feeds the permutations to compile through the metal and metallib stages of
+// a StagePipeline, or only the metal stage for shared libraries.
+class PermutationPipelineJobs : public StagePipelineJobs {
+public:
+    PermutationPipelineJobs(ShaderBuildFinisher* finisher, const char* tempDir,
+                            unsigned nStages,
+                            std::vector<std::unique_ptr<ShaderBuild> >& builds,
+                            const std::vector<PermutationJob>& jobs,
+                            TraceLog* trace)
+        : m_finisher(finisher)
+        , m_tempDir(tempDir)
+        , m_nStages(nStages)
+        , m_builds(builds)
+        , m_jobs(jobs)
+        , m_slots(jobs.size())
+        , m_trace(trace)
+        , m_stageStarts()
+        , m_nNamedSlots(0)
+    {
+        if (trace)
+            m_stageStarts.resize(jobs.size());
+    }
+
+    virtual bool BeginJob(size_t job, unsigned slot)
+    {
+        ShaderBuild* build = m_builds[m_jobs[job].build].get();
+        u32 k = m_jobs[job].k;
+        m_slots[job] = slot;
+        if (m_trace) {
+            for (; m_nNamedSlots <= slot; ++m_nNamedSlots) {
+                m_trace->SetTrackName(FIRST_SLOT_TRACK + m_nNamedSlots,
+                                      "slot " + std::to_string(m_nNamedSlots));
+            }
+        }
+
+        TraceScope scope(m_trace, "LookupCompiledPermutation");
+        scope.Arg("mask", build->permutations[k].permuteMask);
+        if (!LookupCompiledPermutation(build->context, build->permutations[k],
+                                       &build->shaderBytes[k])) {
+            scope.Arg("hit", 0);
+            return true;
+        }
+
+        scope.Arg("hit", 1);
+        scope.Arg("bytes", build->shaderBytes[k].size());
+        build->status[k] = PERMUTATION_SUCCEEDED;
+        return false;
+    }
+
+    virtual void GetCommand(size_t job, unsigned stage, unsigned slot,
+                            std::vector<std::string>* args)
+    {
+        ShaderBuild* build = m_builds[m_jobs[job].build].get();
+        u32 k = m_jobs[job].k;
+        std::string airFile = GetSlotAirPath(m_tempDir, slot);
+
+        if (m_trace)
+            m_stageStarts[job] = m_trace->Now();
+
+        switch (stage) {
+            case STAGE_METAL:
+                GetMetalCommand(build->context, airFile.c_str(),
+                                build->permutations[k].macros, args);
+                break;
+            case STAGE_METALLIB:
+                GetMetalLibCommand(std::vector<std::string>(1, airFile), args);
+                break;
+        }
+    }
+
+    virtual bool EndStage(size_t job, unsigned stage, ProcessExit* processExit)
+    {
+        ShaderBuild* build = m_builds[m_jobs[job].build].get();
+        u32 k = m_jobs[job].k;
+
+        // The process's time from being started to being reaped, on its
+        // slot's track.
+        if (m_trace) {
+            TraceArgs args;
+            args.Add("input", build->inputPath);
+            args.Add("mask", build->permutations[k].permuteMask);
+            args.Add("slot", m_slots[job]);
+            args.Add("status", (u64)(u32)processExit->status);
+            args.Add("stdoutBytes", processExit->stdoutStr.size());
+            args.Add("stderrBytes", processExit->stderrStr.size());
+            m_trace->AddSpan(COMPILE_STAGE_NAMES[stage],
+                             FIRST_SLOT_TRACK + m_slots[job],
+                             m_stageStarts[job], m_trace->Now(), args);
+        }
 
-static bool Compile(const char* inputPath, const char* outputPath,
-                    std::string* errorOutput)
+        if (processExit->status != 0) {
+            build->errors[k].swap(processExit->stderrStr);
+            build->status[k] = PERMUTATION_FAILED;
+            return false;
+        }
+
+        if (stage + 1 != m_nStages)
+            return true;
+
+        // A shared library's permutations are linked by the finisher, so
+        // they're kept as AIR.
+        if (stage == STAGE_METALLIB) {
+            const std::string& bytes = processExit->stdoutStr;
+            build->shaderBytes[k].assign(bytes.begin(), bytes.end());
+        } else {
+            std::string airFile = GetSlotAirPath(m_tempDir, m_slots[job]);
+            if (!FileTryReadAllBytes(airFile.c_str(),
+                                     &build->shaderBytes[k])) {
+                build->errors[k] = airFile + ": could not read\n";
+                build->status[k] = PERMUTATION_FAILED;
+                return false;
+            }
+        }
+        build->status[k] = PERMUTATION_SUCCEEDED;
+        StoreCompiledPermutation(build->context, build->permutations[k],
+                                 build->shaderBytes[k]);
+        build->compiled.push_back(k);
+        return true;
+    }
+
+    // The last permutation of each shader to finish has its output written.
+    virtual void EndJob(size_t job)
+    {
+        ShaderBuild* build = m_builds[m_jobs[job].build].get();
+        if (--build->remaining == 0)
+            m_finisher->Add(build);
+    }
+
+private:
+    PermutationPipelineJobs(const PermutationPipelineJobs&);
+    PermutationPipelineJobs& operator=(const PermutationPipelineJobs&);
+
+    ShaderBuildFinisher* m_finisher;
+    const char* m_tempDir;
+    unsigned m_nStages;
+    std::vector<std::unique_ptr<ShaderBuild> >& m_builds;
+    const std::vector<PermutationJob>& m_jobs;
+    // Each job's slot.
+    std::vector<unsigned> m_slots;
+
+    // Only used when tracing: when each job's current stage's process
+    // started, and how many slots have named tracks.
+    TraceLog* m_trace;
+    std::vector<u64> m_stageStarts;
+    unsigned m_nNamedSlots;
+};
+
+// Compiles a worker's shard through the metal and metallib stages of a
+// StagePipeline (or only the metal stage, for shared libraries), sending each
+// permutation's result as soon as it's ready.
+class ShardPipelineJobs : public StagePipelineJobs {
+public:
+    ShardPipelineJobs(const ShaderCompileContext& context, const char* tempDir,
+                      const ShardRequest& request,
+                      const std::vector<Permutation>& permutations,
+                      const std::vector<u32>& jobs,
+                      const ShardResultFunc& sendResult)
+        : m_context(context)
+        , m_tempDir(tempDir)
+        , m_nStages(GetCompileStageCount(request.sharedLibraries))
+        , m_request(request)
+        , m_permutations(permutations)
+        , m_jobs(jobs)
+        , m_sendResult(sendResult)
+        , m_slots(jobs.size())
+        , m_connected(true)
+    {}
+
+    // Once the coordinator has gone, the rest of the shard is skipped.
+    virtual bool BeginJob(size_t job, unsigned slot)
+    {
+        m_slots[job] = slot;
+        return m_connected;
+    }
+
+    virtual void GetCommand(size_t job, unsigned stage, unsigned slot,
+                            std::vector<std::string>* args)
+    {
+        std::string airFile = GetSlotAirPath(m_tempDir, slot);
+
+        switch (stage) {
+            case STAGE_METAL:
+                GetMetalCommand(m_context, airFile.c_str(),
+                                m_permutations[m_jobs[job]].macros, args);
+                break;
+            case STAGE_METALLIB:
+                GetMetalLibCommand(std::vector<std::string>(1, airFile), args);
+                break;
+        }
+    }
+
+    virtual bool EndStage(size_t job, unsigned stage, ProcessExit* processExit)
+    {
+        ShardResult result;
+        result.id = m_request.permutations[m_jobs[job]].id;
+        std::vector<u8> air;
+        std::string airFile = GetSlotAirPath(m_tempDir, m_slots[job]);
+        if (processExit->status != 0) {
+            result.status = SHARD_RESULT_FAILED;
+            result.output.swap(processExit->stderrStr);
+        } else if (stage + 1 != m_nStages) {
+            return true;
+        } else if (stage == STAGE_METALLIB) {
+            result.status = SHARD_RESULT_SUCCEEDED;
+            result.output.swap(processExit->stdoutStr);
+        } else if (FileTryReadAllBytes(airFile.c_str(), &air)) {
+            result.status = SHARD_RESULT_SUCCEEDED;
+            result.output.assign(air.begin(), air.end());
+        } else {
+            result.status = SHARD_RESULT_FAILED;
+            result.output = airFile + ": could not read\n";
+        }
+
+        if (m_connected)
+            m_connected = m_sendResult(result);
+        return result.status == SHARD_RESULT_SUCCEEDED;
+    }
+
+    virtual void EndJob(size_t) {}
+
+private:
+    ShardPipelineJobs(const ShardPipelineJobs&);
+    ShardPipelineJobs& operator=(const ShardPipelineJobs&);
+
+    const ShaderCompileContext& m_context;
+    const char* m_tempDir;
+    unsigned m_nStages;
+    const ShardRequest& m_request;
+    const std::vector<Permutation>& m_permutations;
+    const std::vector<u32>& m_jobs;
+    const ShardResultFunc& m_sendResult;
+    // Each job's slot.
+    std::vector<unsigned> m_slots;
+    bool m_connected;
+};
+
+static void PrintStageStats(const std::vector<StageStats>& stats)
+{
+    printf("%-10s %10s %11s %12s\n",
+           "Stage", "Processes", "Max queued", "Mean queued");
+    for (size_t stage = 0; stage < stats.size(); ++stage) {
+        printf("%-10s %10zu %11zu %12.1f\n", COMPILE_STAGE_NAMES[stage],
+               stats[stage].nRun, stats[stage].maxQueued,
+               stats[stage].meanQueued);
+    }
+}
+
+// Builds the shaders, and writes the trace (if there is one) however the
+// build ends.
+static bool Compile(CompileSession* session,
+                    const std::vector<ShaderPaths>& shaders,
+                    const CompileOptions& options, std::string* errorOutput)
+{
+    ASSERT(errorOutput);
+
+    std::unique_ptr<TraceLog> trace;
+    if (options.tracePath) {
+        trace.reset(new TraceLog);
+        trace->SetTrackName(MAIN_TRACK, "main");
+        trace->SetTrackName(FINISH_TRACK, "finish");
+    }
+
+    std::vector<std::unique_ptr<ShaderBuild> > builds;
+    bool success = BuildShaders(session, shaders, options, trace.get(),
+                                builds, errorOutput);
+
+    // Each shader's build gets a row of its own, from preparing it to
+    // writing its output, or to here if it stopped short of that.
+    if (trace) {
+        u64 now = trace->Now();
+        for (size_t i = 0; i < builds.size(); ++i) {
+            ShaderBuild& build = *builds[i];
+            if (build.remaining != 0)
+                build.traceEnd = now;
+            TraceArgs args;
+            args.Add("input", build.inputPath);
+            args.Add("output", build.outputPath);
+            args.Add("permutations", build.permutations.size());
+            args.Add("compiled", build.pending.size());
+            args.Add("outputBytes", build.outputSize);
+            trace->AddAsyncSpan("shader", i, build.traceStart, build.traceEnd,
+                                args);
+        }
+        if (!trace->Write(options.tracePath)) {
+            errorOutput->append(std::string(options.tracePath) +
+                                ": could not write\n");
+            success = false;
+        }
+    }
+
+    return success;
+}
+
+// Builds every shader through one pipeline. Permutations from all the
+// shaders share it, so the toolchain stays busy until the last shader is
+// done rather than waiting on each shader in turn. Each build is added to
+// 'builds' as it's started.
+static bool BuildShaders(CompileSession* session,
+                         const std::vector<ShaderPaths>& shaders,
+                         const CompileOptions& options, TraceLog* trace,
+                         std::vector<std::unique_ptr<ShaderBuild> >& builds,
+                         std::string* errorOutput)
 {
+    ASSERT(session);
     ASSERT(errorOutput);
 
-    std::string tempDir = TempDirMake();
-    std::string shaderPath = JoinPaths(tempDir.c_str(), TEMP_SHADER_FILE);
+    std::vector<std::string>& tempDirs = session->tempDirs.paths;
+    if (tempDirs.empty())
+        tempDirs.push_back(TempDirMake());
+
+    std::unique_ptr<PermutationCache> cache;
+    if (options.cacheDir)
+        cache.reset(new PermutationCache(options.cacheDir,
+                                         options.cacheSizeMB * 1024 * 1024));
+
+    std::string moduleCachePath = JoinPaths(
+        options.cacheDir ? options.cacheDir : tempDirs[0].c_str(),
+        MODULE_CACHE_DIR);
+
+    std::unique_ptr<RemotePermutationCache> remoteCache;
+    if (options.remoteCache)
+        remoteCache.reset(new RemotePermutationCache(options.remoteCache));
+
+    std::unique_ptr<ShaderPackWriter> pack;
+    if (options.packPath)
+        pack.reset(new ShaderPackWriter);
+
+    builds.reserve(shaders.size());
+    for (const ShaderPaths& paths : shaders) {
+        builds.push_back(std::unique_ptr<ShaderBuild>(new ShaderBuild));
+        ShaderBuild* build = builds.back().get();
+        build->inputPath = paths.inputPath;
+        build->outputPath = paths.outputPath;
+        build->context.inputPath = build->inputPath.c_str();
+        build->context.includeDirs = &options.includeDirs;
+        build->context.cache = cache.get();
+        build->context.memoryCache = session->memoryCache;
+        build->context.moduleCachePath = moduleCachePath.c_str();
+        build->context.trace = trace;
+        build->context.pack = pack.get();
+        build->context.remoteCache = remoteCache.get();
+        build->context.tempDir = tempDirs[0].c_str();
+        build->traceStart = trace ? trace->Now() : 0;
+        build->traceEnd = build->traceStart;
+        build->outputSize = 0;
+        // Until it's prepared, a build has nothing left to finish.
+        build->remaining = 0;
+        if (!PrepareShaderBuild(session, options, build, errorOutput)) {
+            build->traceEnd = trace ? trace->Now() : 0;
+            return false;
+        }
+    }
+    if (options.useProfile &&
+        !CheckProfileMasks(options, builds, errorOutput))
+        return false;
 
-    FileDeletionAssurance deletionAssurance(shaderPath);
+    ShaderBuildFinisher finisher(options);
 
-    FILEWrapper fileWrapper(fopen(shaderPath.c_str(), "wb"));
-    BinaryWriter writer(fileWrapper);
+    // Start on the shaders with the most work first, so that the end of the
+    // build isn't left waiting on one large shader.
+    std::vector<u32> order;
+    for (u32 i = 0; i < builds.size(); ++i) {
+        if (builds[i]->pending.empty())
+            finisher.Add(builds[i].get());
+        else
+            order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](u32 a, u32 b) -> bool {
+        return builds[a]->pending.size() > builds[b]->pending.size();
+    });
 
-    IfdefMap ifdefs;
-    FindOptionIfDefs(inputPath, &ifdefs);
+    std::vector<PermutationJob> jobs;
+    for (u32 i : order) {
+        for (u32 k : builds[i]->pending) {
+            PermutationJob job = { i, k };
+            jobs.push_back(job);
+        }
+    }
 
-    const u32 nPermutations = 1 << (u32)ifdefs.size();
+    // This machine compiles shards alongside the workers, and afterwards
+    // whatever none of them could compile.
+    if (!options.workers.empty() || options.loopbackWorkers > 0) {
+        TraceScope scope(trace, "RunDistributed");
+        scope.Arg("jobs", jobs.size());
+        RunDistributed(options, &finisher, builds, &jobs);
+        scope.Arg("leftovers", jobs.size());
+    }
 
-    writer.WriteRawData("RDHS", 4);
-    writer.Write32(SHADER_FORMAT_VERSION);
-    writer.WriteRawData("LTEM", 4);
-    writer.Write32(nPermutations);
+    const unsigned nStages = GetCompileStageCount(options.linkBatch != 0);
+    PermutationPipelineJobs pipelineJobs(&finisher, tempDirs[0].c_str(),
+                                         nStages, builds, jobs, trace);
+    std::vector<StageStats> stats;
+    {
+        TraceScope scope(trace, "StagePipelineRun");
+        scope.Arg("jobs", jobs.size());
+        StagePipelineRun(jobs.size(), nStages, options.numJobs,
+                         &pipelineJobs, &stats);
+    }
+    {
+        TraceScope scope(trace, "ShaderBuildFinisher::Finish");
+        finisher.Finish();
+    }
+    if (options.printStats)
+        PrintStageStats(stats);
 
-    std::vector<u32> numbers;
-    numbers.reserve(nPermutations);
-    for (u32 i = 0; i < nPermutations; ++i) {
-        numbers.push_back(i);
+    if (cache) {
+        TraceScope scope(trace, "PermutationCache::Trim");
+        cache->Trim();
+    }
+
+    // After a failure, builds can be left unfinished. They are skipped, and
+    // only report an error if one of their own permutations failed.
+    bool success = true;
+    errorOutput->clear();
+    for (const std::unique_ptr<ShaderBuild>& build : builds) {
+        if (build->remaining != 0)
+            FindFirstFailure(*build, &build->errorOutput);
+        errorOutput->append(build->errorOutput);
+        if (build->remaining != 0 || !build->errorOutput.empty())
+            success = false;
+    }
+
+    if (success && pack)
+        success = WriteShaderPack(options, *pack, builds, trace,
+                                  errorOutput);
+    return success;
+}
+
+// Compiles the jobs on the workers, in shards of consecutive jobs of one
+// shader, and leaves in 'jobs' those that have to be compiled here instead.
+// Permutations already in a cache aren't sent.
+//
+// Unless there are loopback workers already, one runs in this process with
+// all the -j processes, so that this machine takes shards while the others
+// compile rather than idling until they're done.
+static void RunDistributed(const CompileOptions& options,
+                           ShaderBuildFinisher* finisher,
+                           std::vector<std::unique_ptr<ShaderBuild> >& builds,
+                           std::vector<PermutationJob>* jobs)
+{
+    ASSERT(finisher);
+    ASSERT(jobs);
+
+    std::vector<PermutationJob> sent;
+    for (const PermutationJob& job : *jobs) {
+        ShaderBuild* build = builds[job.build].get();
+        u32 k = job.k;
+        if (!LookupCompiledPermutation(build->context, build->permutations[k],
+                                       &build->shaderBytes[k])) {
+            sent.push_back(job);
+            continue;
+        }
+        build->status[k] = PERMUTATION_SUCCEEDED;
+        if (--build->remaining == 0)
+            finisher->Add(build);
+    }
+
+    std::vector<ShardRequest> shaders(builds.size());
+    std::string workingDir = DirGetCurrent();
+    for (size_t i = 0; i < builds.size(); ++i) {
+        shaders[i].workingDir = workingDir;
+        shaders[i].projectRoot = options.projectRoot;
+        shaders[i].inputPath = builds[i]->inputPath;
+        shaders[i].includeDirs = options.includeDirs;
+        shaders[i].sharedLibraries = options.linkBatch != 0;
+    }
+
+    std::vector<u32> shaderIndices;
+    std::vector<ShardPermutation> permutations(sent.size());
+    for (u32 i = 0; i < sent.size(); ++i) {
+        const Permutation& permutation =
+            builds[sent[i].build]->permutations[sent[i].k];
+        shaderIndices.push_back(sent[i].build);
+        permutations[i].id = i;
+        permutations[i].permuteMask = permutation.permuteMask;
+        permutations[i].macros = permutation.macros;
+        permutations[i].inputDigest = permutation.inputDigest;
     }
 
-    std::sort(numbers.begin(), numbers.end(), [](u32 a, u32 b) -> bool {
-        return NumberOfSetBits(a) > NumberOfSetBits(b);
+    // Loopback workers share the -j processes between them. Each has a
+    // session of its own, like a separate machine would.
+    std::vector<std::string> workers = options.workers;
+    std::vector<std::unique_ptr<CompileSession> > sessions;
+    std::vector<ShardCompileFunc> funcs;
+    unsigned nLoopbackWorkers = std::max(1u, options.loopbackWorkers);
+    unsigned numJobs = std::max(1u, options.numJobs / nLoopbackWorkers);
+    for (unsigned i = 0; i < nLoopbackWorkers; ++i) {
+        sessions.push_back(std::unique_ptr<CompileSession>(new CompileSession));
+        CompileSession* session = sessions.back().get();
+        funcs.push_back([session, numJobs](const ShardRequest& request,
+                                           const ShardResultFunc& sendResult) {
+            CompileShard(session, numJobs, request, sendResult);
+        });
+    }
+    LoopbackShardWorkers loopbackWorkers(funcs, &workers);
+
+    std::vector<u32> leftovers = ShardCoordinatorRun(
+        workers, shaders, shaderIndices, permutations,
+        [&](u32 i, ShardResult& result) {
+        ShaderBuild* build = builds[sent[i].build].get();
+        u32 k = sent[i].k;
+        if (result.status == SHARD_RESULT_FAILED) {
+            build->errors[k].swap(result.output);
+            build->status[k] = PERMUTATION_FAILED;
+        } else {
+            build->shaderBytes[k].assign(result.output.begin(),
+                                         result.output.end());
+            build->status[k] = PERMUTATION_SUCCEEDED;
+            StoreCompiledPermutation(build->context, build->permutations[k],
+                                     build->shaderBytes[k]);
+            build->compiled.push_back(k);
+        }
+        if (--build->remaining == 0)
+            finisher->Add(build);
     });
 
-    std::vector<std::string> macros;
-    std::vector<u8> shaderBytes;
+    jobs->clear();
+    for (u32 i : leftovers)
+        jobs->push_back(sent[i]);
+}
+
+// Compiles a shard on a worker. The permutations whose inputs don't hash to
+// the coordinator's digests, because the worker's files or toolchain differ,
+// are sent back as unavailable for the coordinator to compile itself.
+static void CompileShard(CompileSession* session, unsigned numJobs,
+                         const ShardRequest& request,
+                         const ShardResultFunc& sendResult)
+{
+    ASSERT(session);
+
+    const size_t nPermutations = request.permutations.size();
+    std::vector<Permutation> permutations(nPermutations);
+    bool found = DirGetCurrent() == request.workingDir ||
+                 DirSetCurrent(request.workingDir.c_str());
+    if (found) {
+        ShaderSource* source = LoadShaderSource(
+            session, request.inputPath.c_str(), request.includeDirs);
+        for (size_t i = 0; i < nPermutations; ++i) {
+            permutations[i].permuteMask = request.permutations[i].permuteMask;
+            permutations[i].macros = request.permutations[i].macros;
+        }
+        HashPermutationInputs(request.projectRoot, request.inputPath.c_str(),
+                              request.includeDirs, request.sharedLibraries,
+                              source, &permutations);
+    }
+
+    std::vector<u32> jobs;
+    for (u32 i = 0; i < nPermutations; ++i) {
+        if (found && permutations[i].inputDigest ==
+                     request.permutations[i].inputDigest) {
+            jobs.push_back(i);
+            continue;
+        }
+        ShardResult result;
+        result.id = request.permutations[i].id;
+        result.status = SHARD_RESULT_UNAVAILABLE;
+        if (!sendResult(result))
+            return;
+    }
+
+    std::vector<std::string>& tempDirs = session->tempDirs.paths;
+    if (tempDirs.empty())
+        tempDirs.push_back(TempDirMake());
+    std::string moduleCachePath = JoinPaths(tempDirs[0].c_str(),
+                                            MODULE_CACHE_DIR);
+
+    ShaderCompileContext context = ShaderCompileContext();
+    context.inputPath = request.inputPath.c_str();
+    context.includeDirs = &request.includeDirs;
+    context.moduleCachePath = moduleCachePath.c_str();
+
+    ShardPipelineJobs pipelineJobs(context, tempDirs[0].c_str(), request,
+                                   permutations, jobs, sendResult);
+    std::vector<StageStats> stats;
+    StagePipelineRun(jobs.size(), GetCompileStageCount(request.sharedLibraries),
+                     numJobs, &pipelineJobs, &stats);
+}
+
+// Works out a shader's permutations and which of them need compiling.
+// Returns false if the shader has too many permutations to build.
+static bool PrepareShaderBuild(CompileSession* session,
+                               const CompileOptions& options,
+                               ShaderBuild* build, std::string* errorOutput)
+{
+    ASSERT(build);
+    ASSERT(errorOutput);
+
+    const char* inputPath = build->inputPath.c_str();
+
+    TraceScope scope(build->context.trace, "PrepareShaderBuild");
+    scope.Arg("input", build->inputPath);
+
+    ShaderSource* source;
+    {
+        TraceScope loadScope(build->context.trace, "LoadShaderSource");
+        source = LoadShaderSource(session, inputPath, options.includeDirs);
+        loadScope.Arg("files", source->files.size());
+    }
+    const IfdefMap& ifdefs = source->ifdefs;
+
+    for (const SourceFile& file : source->files) {
+        if (file.exists)
+            build->dependencies.push_back(file.path);
+    }
+
+    // The first file is the shader itself.
+    if (!source->files[0].exists) {
+        *errorOutput = build->inputPath + ": file not found\n";
+        return false;
+    }
+    if (!source->error.empty()) {
+        *errorOutput = source->error;
+        return false;
+    }
+
+    // Option indices go up to 99, but permuteMasks only have 64 bits.
+    std::vector<IfdefMap::const_iterator> shaderOptions;
+    for (auto iter = ifdefs.begin(); iter != ifdefs.end(); ++iter) {
+        if (iter->first >= 64) {
+            *errorOutput = build->inputPath + ": option " + iter->second +
+                           " is out of range (the last is F_63)\n";
+            return false;
+        }
+        shaderOptions.push_back(iter);
+    }
+
+    u64 optionBits = 0;
+    for (IfdefMap::const_iterator option : shaderOptions)
+        optionBits |= u64(1) << option->first;
+    build->optionBits = optionBits;
+    build->constraints = source->constraints;
+
+    // Work out the macros for every permutation up front, those with the most
+    // options first. Combinations that the constraints rule out are skipped,
+    // and with a usage profile, only the profile's masks are visited and the
+    // rest deferred. Neither kind is enumerated: the output leaves both out,
+    // and its readers tell them apart with the constraints.
+    std::vector<Permutation>& permutations = build->permutations;
+    MaskEnumerator enumerator(optionBits, source->constraints);
+    std::vector<u64> profileMasks;
+    if (options.useProfile)
+        GetProfileMasks(options, optionBits, source->constraints,
+                        &profileMasks);
+    size_t nextProfileMask = 0;
+    u64 permuteMask;
+    for (;;) {
+        if (options.useProfile) {
+            if (nextProfileMask == profileMasks.size())
+                break;
+            permuteMask = profileMasks[nextProfileMask++];
+        } else if (!enumerator.Next(&permuteMask)) {
+            break;
+        }
+
+        if (permutations.size() == MAX_PERMUTATIONS) {
+            *errorOutput = build->inputPath + ": more than " +
+                           std::to_string(MAX_PERMUTATIONS) +
+                           " permutations\n";
+            return false;
+        }
+
+        permutations.push_back(Permutation());
+        Permutation& permutation = permutations.back();
+        permutation.permuteMask = permuteMask;
+        for (IfdefMap::const_iterator option : shaderOptions) {
+            if (permuteMask & (u64(1) << option->first))
+                permutation.macros.push_back(option->second);
+        }
+    }
+    const u32 nPermutations = (u32)permutations.size();
+
+    {
+        TraceScope hashScope(build->context.trace, "HashPermutationInputs");
+        hashScope.Arg("permutations", permutations.size());
+        HashPermutationInputs(options.projectRoot, inputPath,
+                              options.includeDirs, options.linkBatch != 0,
+                              source, &permutations);
+    }
+
+    // In a shared library, each permutation's entry points are renamed, so
+    // that they don't clash with the other permutations'. The new names
+    // follow from the digests, which don't depend on them.
+    if (options.linkBatch) {
+        for (Permutation& permutation : permutations) {
+            char suffix[32];
+            snprintf(suffix, sizeof suffix, SHADER_FUNCTION_SUFFIX_FORMAT,
+                     (unsigned long long)GetFunctionId(
+                         permutation.inputDigest));
+            for (const std::string& name : source->entryPoints)
+                permutation.macros.push_back(name + "=" + name + suffix);
+        }
+    }
+
+    build->shaderBytes.resize(nPermutations);
+    build->errors.resize(nPermutations);
+    build->status.assign(nPermutations, PERMUTATION_NOT_RUN);
+
+    if (options.incremental) {
+        std::string digestsPath = build->outputPath + DIGESTS_FILE_SUFFIX;
+        TraceScope reuseScope(build->context.trace, "ReusePreviousBuild");
+        ReusePreviousBuild(build->outputPath.c_str(), digestsPath.c_str(),
+                           permutations, &build->shaderBytes, &build->status);
+    }
+
+    // Only compile one representative of each set of permutations with the
+    // same inputs; the others get a copy of its result afterwards.
+    std::map<Sha256Digest, u32> digestRepresentatives;
+    build->representatives.resize(nPermutations);
     for (u32 k = 0; k < nPermutations; ++k) {
-        macros.clear();
-
-        u32 i = numbers[k];
-        u64 permuteMask = 0;
-
-        auto mapIter = ifdefs.begin();
-        for (u32 j = 0; j < ifdefs.size(); ++j, ++mapIter) {
-            if (i & (1 << j)) {
-                u32 bitIndex = mapIter->first;
-                const std::string& ifdef = mapIter->second;
-                macros.push_back(ifdef);
-                permuteMask |= u64(1) << bitIndex;
-            }
+        build->representatives[k] = k;
+        if (build->status[k] != PERMUTATION_NOT_RUN)
+            continue;
+
+        auto inserted = digestRepresentatives.insert(
+            std::make_pair(permutations[k].inputDigest, k));
+        if (inserted.second)
+            build->pending.push_back(k);
+        else
+            build->representatives[k] = inserted.first->second;
+    }
+
+    if (build->context.remoteCache && !build->pending.empty()) {
+        TraceScope remoteScope(build->context.trace, "FetchRemotePermutations");
+        remoteScope.Arg("pending", build->pending.size());
+        FetchRemotePermutations(build);
+    }
+
+    build->remaining = build->pending.size();
+    scope.Arg("permutations", permutations.size());
+    scope.Arg("pending", build->pending.size());
+    return true;
+}
+
+// Called on the finisher's thread once all of a shader's pending permutations
+// have run. Writes the output file if they all succeeded, and sets
+// build->errorOutput otherwise.
+static bool FinishShaderBuild(const CompileOptions& options,
+                              ShaderBuild* build)
+{
+    ASSERT(build);
+
+    TraceLog* trace = build->context.trace;
+    TraceScope scope(trace, FINISH_TRACK, "FinishShaderBuild");
+    scope.Arg("output", build->outputPath);
+
+    std::vector<std::vector<u8> >& shaderBytes = build->shaderBytes;
+    std::vector<PermutationStatus>& status = build->status;
+    const u32 nPermutations = (u32)build->permutations.size();
+
+    for (u32 k = 0; k < nPermutations; ++k) {
+        u32 representative = build->representatives[k];
+        if (representative != k &&
+            status[representative] == PERMUTATION_SUCCEEDED) {
+            shaderBytes[k] = shaderBytes[representative];
+            status[k] = PERMUTATION_SUCCEEDED;
         }
+    }
+
+    if (build->context.remoteCache && !build->compiled.empty()) {
+        TraceScope remoteScope(trace, FINISH_TRACK, "StoreRemotePermutations");
+        remoteScope.Arg("compiled", build->compiled.size());
+        StoreRemotePermutations(*build);
+    }
+
+    if (FindFirstFailure(*build, &build->errorOutput)) {
+        build->traceEnd = trace ? trace->Now() : 0;
+        return false;
+    }
 
-        bool result = InternalCompileShader(inputPath, tempDir.c_str(),
-                                            macros, &shaderBytes, errorOutput);
-        if (!result)
+    // Without shared libraries, each blob is one of the permutations'
+    // metallibs.
+    std::vector<std::vector<u8> > libraries;
+    std::vector<const std::vector<u8>*> blobs;
+    std::vector<u32> blobIndices;
+    std::vector<u64> functionIds;
+    if (options.linkBatch) {
+        TraceScope linkScope(trace, FINISH_TRACK, "LinkSharedLibraries");
+        if (!LinkSharedLibraries(*build, options.linkBatch, &libraries,
+                                 &blobIndices, &functionIds,
+                                 &build->errorOutput)) {
+            build->traceEnd = trace ? trace->Now() : 0;
             return false;
+        }
+        linkScope.Arg("libraries", libraries.size());
+        for (const std::vector<u8>& library : libraries)
+            blobs.push_back(&library);
+    } else {
+        FindDistinctBlobs(shaderBytes, &blobs, &blobIndices);
+    }
 
-        long permuteHeaderPos = writer.AlignAndTell();
-        writer.Write64(permuteMask);
-        writer.Write32((u32)shaderBytes.size()); // VS data length
-        writer.Write32(0); // PS data length
-        long pos_ofsNextPermutation = writer.WriteTemp32();
-        writer.Write32(0); // padding (for alignment purposes)
-        writer.WriteRawData(&shaderBytes[0], shaderBytes.size());
-        writer.OverwriteTemp32(pos_ofsNextPermutation,
-                               (u32)(writer.AlignAndTell() - permuteHeaderPos));
+    BinaryWriter writer;
+    {
+        TraceScope writeScope(trace, FINISH_TRACK, "WriteShaderFile");
+        bool written = WriteShaderFile(
+            writer, build->permutations, build->optionBits,
+            build->constraints, blobs, blobIndices,
+            options.linkBatch ? &functionIds : NULL, options.compress,
+            options.delta);
+        writeScope.Arg("bytes", writer.GetSize());
+        if (!written) {
+            build->errorOutput = build->outputPath + ": 4 GB or more, "
+                                 "which is too large for a shader file\n";
+            build->traceEnd = trace ? trace->Now() : 0;
+            return false;
+        }
+    }
+    build->outputSize = writer.GetSize();
+
+    // A pack is written once every shader is in it.
+    if (build->context.pack) {
+        TraceScope packScope(trace, FINISH_TRACK,
+                             "ShaderPackWriter::AddShader");
+        build->context.pack->AddShader(build->outputPath, writer.GetData(),
+                                       writer.GetSize());
+        std::vector<std::vector<u8> >().swap(shaderBytes);
+        build->traceEnd = trace ? trace->Now() : 0;
+        return true;
+    }
 
+    // Remove the old digests first: if we die before writing the new ones,
+    // the next incremental build must not trust the new output.
+    const char* outputPath = build->outputPath.c_str();
+    std::string digestsPath = build->outputPath + DIGESTS_FILE_SUFFIX;
+    if (options.incremental)
+        FileTryDelete(digestsPath.c_str());
+
+    {
+        TraceScope fileScope(trace, FINISH_TRACK, "FileWriteAllBytesAtomic");
+        fileScope.Arg("bytes", writer.GetSize());
+        if (!FileTryWriteAllBytesAtomic(outputPath, writer.GetData(),
+                                        writer.GetSize())) {
+            build->errorOutput = build->outputPath + ": could not write\n";
+            build->traceEnd = trace ? trace->Now() : 0;
+            return false;
+        }
     }
 
-    FileMove(shaderPath.c_str(), outputPath);
-    deletionAssurance.Stop();
-    errorOutput->clear();
+    if (options.incremental) {
+        PermutationDigestMap digests;
+        for (const Permutation& permutation : build->permutations)
+            digests[permutation.permuteMask] = permutation.inputDigest;
+        if (!PermutationDigestsWrite(digestsPath.c_str(), digests)) {
+            build->errorOutput = digestsPath + ": could not write\n";
+            build->traceEnd = trace ? trace->Now() : 0;
+            return false;
+        }
+    }
 
+    if (options.writeDepfile &&
+        !WriteDepfile(build->outputPath, build->dependencies,
+                      &build->errorOutput)) {
+        build->traceEnd = trace ? trace->Now() : 0;
+        return false;
+    }
+
+    // The output is written, so there's no need to hold on to it.
+    std::vector<std::vector<u8> >().swap(shaderBytes);
+
+    build->traceEnd = trace ? trace->Now() : 0;
     return true;
 }
 
-int main(int argc, const char** argv)
+// Writes the pack, and with -MD, the files that any of its shaders depend
+// on. Returns false if they can't be written.
+static bool WriteShaderPack(
+    const CompileOptions& options, const ShaderPackWriter& pack,
+    const std::vector<std::unique_ptr<ShaderBuild> >& builds, TraceLog* trace,
+    std::string* errorOutput)
 {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: MTLShaderCompiler input_path output_path\n");
-        return 1;
+    ASSERT(errorOutput);
+
+    TraceScope scope(trace, "WriteShaderPack");
+
+    BinaryWriter writer;
+    if (!pack.Write(writer)) {
+        *errorOutput = std::string(options.packPath) +
+                       ": 4 GB or more, which is too large for a pack\n";
+        return false;
     }
-    const char* inputPath = argv[1];
-    const char* outputPath = argv[2];
-    std::string errorOutput;
-    bool success = Compile(inputPath, outputPath, &errorOutput);
-    if (!success) {
-        fprintf(stderr, "%s", errorOutput.c_str());
-        return 1;
+    scope.Arg("bytes", writer.GetSize());
+    if (!FileTryWriteAllBytesAtomic(options.packPath, writer.GetData(),
+                                    writer.GetSize())) {
+        *errorOutput = std::string(options.packPath) + ": could not write\n";
+        return false;
     }
-    return 0;
+
+    if (!options.writeDepfile)
+        return true;
+
+    std::set<std::string> dependencies;
+    for (const std::unique_ptr<ShaderBuild>& build : builds) {
+        dependencies.insert(build->dependencies.begin(),
+                            build->dependencies.end());
+    }
+    return WriteDepfile(options.packPath, std::vector<std::string>(
+        dependencies.begin(), dependencies.end()), errorOutput);
 }
 
-// Searches for statements matching the regex '#ifdef\\s+F_\\d\\d\\S*'.
-static void FindOptionIfDefs(const char* path, IfdefMap* map)
+// Finds the failed permutation with the lowest index. Here, a build's jobs
+// are started in ascending order and no new ones are started after a
+// failure, so that's the failure a serial build would have reported. Workers
+// send results as they finish, and the build stops at the first to arrive,
+// so a distributed build can report a later failure than a serial one.
+static bool FindFirstFailure(const ShaderBuild& build, std::string* errorOutput)
+{
+    ASSERT(errorOutput);
+
+    for (size_t k = 0; k < build.status.size(); ++k) {
+        if (build.status[k] == PERMUTATION_FAILED) {
+            *errorOutput = build.errors[k];
+            return true;
+        }
+    }
+    return false;
+}
+
+// Writes 'output: dependencies...' in the format of the compiler's -MD, which
+// both Make and Ninja read. Returns false if it can't be written.
+static bool WriteDepfile(const std::string& outputPath,
+                         const std::vector<std::string>& dependencies,
+                         std::string* errorOutput)
+{
+    ASSERT(errorOutput);
+
+    std::string text;
+    auto appendEscaped = [&text](const std::string& path) {
+        for (char c : path) {
+            if (c == ' ' || c == '#')
+                text += '\\';
+            else if (c == '$')
+                text += '$';
+            text += c;
+        }
+    };
+
+    appendEscaped(outputPath);
+    text += ':';
+    for (const std::string& dependency : dependencies) {
+        text += " \\\n  ";
+        appendEscaped(dependency);
+    }
+    text += '\n';
+
+    std::string path = outputPath + DEPFILE_SUFFIX;
+    if (!FileTryWriteAllBytesAtomic(path.c_str(), text.data(), text.size())) {
+        *errorOutput = path + ": could not write\n";
+        return false;
+    }
+    return true;
+}
+
+// Reads a manifest of shaders to build: one 'input_path output_path' pair per
+// line. Blank lines and lines starting with '#' are ignored.
+static bool ReadManifest(const char* path, std::vector<ShaderPaths>* shaders,
+                         std::string* errorOutput)
 {
     ASSERT(path);
-    ASSERT(map);
+    ASSERT(shaders);
+    ASSERT(errorOutput);
 
     std::ifstream infile(path);
+    if (!infile) {
+        *errorOutput = std::string("Could not open manifest ") + path + "\n";
+        return false;
+    }
 
     std::string line;
-    while (std::getline(infile, line)) {
-        std::string::size_type pos = line.find("#ifdef ");
-        if (pos == std::string::npos)
+    for (int lineNumber = 1; std::getline(infile, line); ++lineNumber) {
+        std::istringstream stream(line);
+        ShaderPaths paths;
+        if (!(stream >> paths.inputPath) || paths.inputPath[0] == '#')
             continue;
 
-        pos += 6; // StrLen("#ifdef") == 6
-        for ( ; pos < line.length() && isspace(line[pos]); ++pos)
-             ;
+        std::string extra;
+        if (!(stream >> paths.outputPath) || stream >> extra) {
+            std::ostringstream message;
+            message << path << ":" << lineNumber
+                    << ": expected 'input_path output_path'\n";
+            *errorOutput = message.str();
+            return false;
+        }
+        shaders->push_back(paths);
+    }
+
+    return true;
+}
+
+// Reads a usage profile: the permuteMasks that the runtime used, one per
+// line in hex. Blank lines and lines starting with '#' are ignored.
+static bool ReadProfile(const char* path, std::map<u64, int>* masks,
+                        std::string* errorOutput)
+{
+    ASSERT(path);
+    ASSERT(masks);
+    ASSERT(errorOutput);
 
-        if (pos + 4 > line.length()) continue; // StrLen("F_##") == 4
-        if (line[pos++] != 'F') continue;
-        if (line[pos++] != '_') continue;
-        if (!isdigit(line[pos])) continue;
-        int digit1 = line[pos++] - '0';
-        if (!isdigit(line[pos])) continue;
-        int digit2 = line[pos++] - '0';
+    std::ifstream infile(path);
+    if (!infile) {
+        *errorOutput = std::string("Could not open profile ") + path + "\n";
+        return false;
+    }
 
-        std::string::size_type endPos = pos;
-        for (; endPos < line.length() && !isspace(line[endPos]); ++endPos)
-            ;
-        std::string::size_type startPos = pos - 4; // StrLen("F_##") == 4
-        std::string ifdef = line.substr(pos - 4, endPos - startPos);
+    std::string line;
+    for (int lineNumber = 1; std::getline(infile, line); ++lineNumber) {
+        std::istringstream stream(line);
+        std::string word;
+        if (!(stream >> word) || word[0] == '#')
+            continue;
 
-        int index = digit1 * 10 + digit2;
-        (*map)[index] = ifdef;
+        char* end = NULL;
+        errno = 0;
+        u64 mask = strtoull(word.c_str(), &end, 16);
+        std::string extra;
+        if (!isxdigit((unsigned char)word[0]) || *end != '\0' ||
+            stream >> extra) {
+            std::ostringstream message;
+            message << path << ":" << lineNumber
+                    << ": expected a permuteMask in hex\n";
+            *errorOutput = message.str();
+            return false;
+        }
+        if (errno == ERANGE) {
+            std::ostringstream message;
+            message << path << ":" << lineNumber << ": " << word
+                    << " is out of range (permuteMasks have 64 bits)\n";
+            *errorOutput = message.str();
+            return false;
+        }
+        masks->insert(std::make_pair(mask, lineNumber));
     }
+
+    return true;
 }
 
-static u32 NumberOfSetBits(u32 i)
+// Fails if a mask in the profile sets an option that none of the shaders
+// have, which means the profile is stale or was made for other shaders.
+static bool CheckProfileMasks(
+    const CompileOptions& options,
+    const std::vector<std::unique_ptr<ShaderBuild> >& builds,
+    std::string* errorOutput)
 {
-    i = i - ((i >> 1) & 0x55555555);
-    i = (i & 0x33333333) + ((i >> 2) & 0x33333333);
-    return (((i + (i >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+    ASSERT(errorOutput);
+
+    u64 optionBits = 0;
+    for (const std::unique_ptr<ShaderBuild>& build : builds)
+        optionBits |= build->optionBits;
+
+    for (const auto& pair : options.profileMasks) {
+        if ((pair.first & ~optionBits) != 0) {
+            std::ostringstream message;
+            message << options.profilePath << ":" << pair.second
+                    << ": permuteMask " << std::hex << pair.first
+                    << " has options that no shader being built has\n";
+            *errorOutput = message.str();
+            return false;
+        }
+    }
+    return true;
+}
+
+// The permutations that the profile asks for and the constraints allow, in
+// the order that MaskEnumerator would produce them. optionBits has a bit set
+// for each of the shader's options. One profile can cover many shaders, and
+// masks for other shaders' options simply match nothing.
+static void GetProfileMasks(const CompileOptions& options, u64 optionBits,
+                            const PermutationConstraints& constraints,
+                            std::vector<u64>* masks)
+{
+    ASSERT(masks);
+
+    std::set<u64> wanted;
+    for (const auto& pair : options.profileMasks) {
+        u64 mask = pair.first;
+        if ((mask & ~optionBits) != 0)
+            continue;
+        wanted.insert(mask);
+        for (u32 bit = 0; options.profileNeighbours && bit < 64; ++bit) {
+            u64 flip = u64(1) << bit;
+            if (optionBits & flip)
+                wanted.insert(mask ^ flip);
+        }
+    }
+
+    masks->clear();
+    for (u64 mask : wanted) {
+        if (constraints.Allows(mask))
+            masks->push_back(mask);
+    }
+    std::stable_sort(masks->begin(), masks->end(), [](u64 a, u64 b) -> bool {
+        return __builtin_popcountll(a) > __builtin_popcountll(b);
+    });
+}
+
+static std::string GetUsage()
+{
+    std::ostringstream usage;
+    usage << "Usage: MTLShaderCompiler [options] input_path output_path\n"
+             "       MTLShaderCompiler [options] --manifest manifest_path\n"
+             "       MTLShaderCompiler --connect socket_path [options] ...\n"
+             "       MTLShaderCompiler --server socket_path\n"
+             "       MTLShaderCompiler --cache-server host:port cache_dir\n"
+             "                         [--allow-remote]\n"
+             "       MTLShaderCompiler --worker [host:]port [--allow-remote]\n"
+             "                         [-j jobs]\n"
+             "Options:\n"
+             "  -j jobs             Run this many toolchain processes at once\n"
+             "  -I dir              Search dir for included files\n"
+             "  -MD                 Write the files that each output depends on\n"
+             "                      to output_path.d, for Make or Ninja\n"
+             "  --cache-dir dir     Reuse compiled permutations cached in dir\n"
+             "  --cache-size mb     Cache size limit in MB (default "
+          << DEFAULT_CACHE_SIZE_MB << ")\n"
+             "  --project-root dir  Take paths relative to dir when identifying\n"
+             "                      permutations, so that checkouts elsewhere\n"
+             "                      share cached ones (default: the working\n"
+             "                      directory)\n"
+             "  --compress          Compress each permutation separately, so\n"
+             "                      that any one can be loaded on its own\n"
+             "  --delta             Store permutations as deltas against ones\n"
+             "                      that differ by a single option\n"
+             "  --link-batch n      Link n permutations into each metallib, each\n"
+             "                      with its vertex, fragment and kernel\n"
+             "                      functions renamed (see Util/ShaderFormat.h)\n"
+             "  --incremental       Only recompile the permutations that changed\n"
+             "                      since the previous build of output_path\n"
+             "  --manifest path     Build every 'input_path output_path' pair\n"
+             "                      listed in the file at path, one per line\n"
+             "  --pack path         Write every shader into one pack at path,\n"
+             "                      named by its output_path, instead of\n"
+             "                      separate files\n"
+             "  --remote-cache host:port\n"
+             "                      Share compiled permutations through the\n"
+             "                      cache server at host:port\n"
+             "  --profile path      Only build the permutations listed in the\n"
+             "                      file at path, one permuteMask per line in\n"
+             "                      hex, and mark the rest as deferred\n"
+             "  --profile-neighbours\n"
+             "                      Also build the permutations one option away\n"
+             "                      from those in the profile\n"
+             "  --stats             Print how busy each toolchain stage was\n"
+             "  --workers list      Compile permutations on the workers at the\n"
+             "                      comma-separated host:ports in list, and\n"
+             "                      here at the same time\n"
+             "  --loopback-workers n\n"
+             "                      Compile permutations on n workers run in\n"
+             "                      this process, which share the -j jobs\n"
+             "  --trace path        Write a Chrome trace of the build to path,\n"
+             "                      for chrome://tracing or Perfetto\n"
+             "  --server path       Serve builds from a socket at path, keeping\n"
+             "                      parsed sources and results in memory\n"
+             "  --connect path      Have the server at path do the build (or do\n"
+             "                      it here if there's no server)\n"
+             "  --worker [host:]port\n"
+             "                      Compile permutations for the builds that\n"
+             "                      connect to port with --workers. Listens on\n"
+             "                      "
+          << WORKER_DEFAULT_HOST << " unless host is given\n"
+             "  --allow-remote      Let --worker or --cache-server listen on a\n"
+             "                      host that isn't a loopback address. Neither\n"
+             "                      checks who connects: anyone who can reach a\n"
+             "                      worker's port can compile any file it can\n"
+             "                      read, and see it quoted in the compiler's\n"
+             "                      errors, and anyone who can reach a cache\n"
+             "                      server's can replace the permutations its\n"
+             "                      clients build with their own\n";
+    return usage.str();
+}
+
+// Runs the build described by a command line (without the program name).
+static bool RunCommandLine(CompileSession* session, int argc,
+                           const char** argv, std::string* errorOutput)
+{
+    ASSERT(errorOutput);
+
+    CompileOptions options;
+    const char* manifestPath = NULL;
+    const char* profilePath = NULL;
+    const char* projectRoot = ".";
+
+    int argIndex = 0;
+    for (; argIndex < argc && argv[argIndex][0] == '-'; ++argIndex) {
+        const char* arg = argv[argIndex];
+        if (arg[1] == 'I') {
+            const char* value = arg[2] ? arg + 2 : NULL;
+            if (!value && argIndex + 1 < argc)
+                value = argv[++argIndex];
+            if (!value) {
+                *errorOutput = GetUsage();
+                return false;
+            }
+            options.includeDirs.push_back(value);
+        } else if (StrCmp(arg, "-MD") == 0) {
+            options.writeDepfile = true;
+        } else if (arg[1] == 'j') {
+            const char* value = arg[2] ? arg + 2 : NULL;
+            if (!value && argIndex + 1 < argc)
+                value = argv[++argIndex];
+            int numJobs = value ? atoi(value) : 0;
+            if (numJobs <= 0) {
+                *errorOutput = GetUsage();
+                return false;
+            }
+            options.numJobs = (unsigned)numJobs;
+        } else if (StrCmp(arg, "--incremental") == 0) {
+            options.incremental = true;
+        } else if (StrCmp(arg, "--compress") == 0) {
+            options.compress = true;
+        } else if (StrCmp(arg, "--delta") == 0) {
+            options.delta = true;
+        } else if (StrCmp(arg, "--link-batch") == 0 && argIndex + 1 < argc) {
+            int linkBatch = atoi(argv[++argIndex]);
+            if (linkBatch <= 0) {
+                *errorOutput = GetUsage();
+                return false;
+            }
+            options.linkBatch = (unsigned)linkBatch;
+        } else if (StrCmp(arg, "--stats") == 0) {
+            options.printStats = true;
+        } else if (StrCmp(arg, "--trace") == 0 && argIndex + 1 < argc) {
+            options.tracePath = argv[++argIndex];
+        } else if (StrCmp(arg, "--remote-cache") == 0 &&
+                   argIndex + 1 < argc) {
+            options.remoteCache = argv[++argIndex];
+        } else if (StrCmp(arg, "--workers") == 0 && argIndex + 1 < argc) {
+            std::istringstream list(argv[++argIndex]);
+            std::string worker;
+            while (std::getline(list, worker, ',')) {
+                if (!worker.empty())
+                    options.workers.push_back(worker);
+            }
+            if (options.workers.empty()) {
+                *errorOutput = GetUsage();
+                return false;
+            }
+        } else if (StrCmp(arg, "--loopback-workers") == 0 &&
+                   argIndex + 1 < argc) {
+            int loopbackWorkers = atoi(argv[++argIndex]);
+            if (loopbackWorkers <= 0) {
+                *errorOutput = GetUsage();
+                return false;
+            }
+            options.loopbackWorkers = (unsigned)loopbackWorkers;
+        } else if (StrCmp(arg, "--pack") == 0 && argIndex + 1 < argc) {
+            options.packPath = argv[++argIndex];
+        } else if (StrCmp(arg, "--manifest") == 0 && argIndex + 1 < argc) {
+            manifestPath = argv[++argIndex];
+        } else if (StrCmp(arg, "--profile") == 0 && argIndex + 1 < argc) {
+            profilePath = argv[++argIndex];
+        } else if (StrCmp(arg, "--profile-neighbours") == 0) {
+            options.profileNeighbours = true;
+        } else if (StrCmp(arg, "--cache-dir") == 0 && argIndex + 1 < argc) {
+            options.cacheDir = argv[++argIndex];
+        } else if (StrCmp(arg, "--project-root") == 0 &&
+                   argIndex + 1 < argc) {
+            projectRoot = argv[++argIndex];
+        } else if (StrCmp(arg, "--cache-size") == 0 && argIndex + 1 < argc) {
+            long long cacheSizeMB = atoll(argv[++argIndex]);
+            if (cacheSizeMB <= 0) {
+                *errorOutput = GetUsage();
+                return false;
+            }
+            options.cacheSizeMB = (u64)cacheSizeMB;
+        } else {
+            *errorOutput = GetUsage();
+            return false;
+        }
+    }
+
+    // Incremental builds reuse the previous output files, which a pack
+    // replaces. Shared libraries are linked from AIR, which the output
+    // doesn't keep.
+    if ((options.profileNeighbours && !profilePath) ||
+        (options.packPath && options.incremental) ||
+        (options.linkBatch && options.incremental)) {
+        *errorOutput = GetUsage();
+        return false;
+    }
+    options.projectRoot = GetAbsolutePath(projectRoot);
+    if (profilePath) {
+        if (!ReadProfile(profilePath, &options.profileMasks, errorOutput))
+            return false;
+        options.useProfile = true;
+        options.profilePath = profilePath;
+    }
+
+    std::vector<ShaderPaths> shaders;
+    if (manifestPath) {
+        if (argIndex != argc) {
+            *errorOutput = GetUsage();
+            return false;
+        }
+        if (!ReadManifest(manifestPath, &shaders, errorOutput))
+            return false;
+    } else {
+        if (argc - argIndex < 2) {
+            *errorOutput = GetUsage();
+            return false;
+        }
+        ShaderPaths paths;
+        paths.inputPath = argv[argIndex];
+        paths.outputPath = argv[argIndex + 1];
+        shaders.push_back(paths);
+    }
+
+    return Compile(session, shaders, options, errorOutput);
+}
+
+static int RunServer(const char* socketPath)
+{
+    PermutationMemoryCache memoryCache(SERVER_MEMORY_CACHE_SIZE_MB * 1024 * 1024);
+    CompileSession session;
+    session.memoryCache = &memoryCache;
+
+    CompileServerRun(socketPath,
+        [&](const CompileRequest& request, CompileResponse* response) {
+        // Requests are served one at a time, so each can have the working
+        // directory to itself.
+        if (!DirSetCurrent(request.workingDir.c_str())) {
+            response->success = false;
+            response->errorOutput = "Could not change to directory " +
+                                    request.workingDir + "\n";
+            return;
+        }
+
+        std::vector<const char*> args;
+        for (const std::string& arg : request.args)
+            args.push_back(arg.c_str());
+        response->success = RunCommandLine(&session, (int)args.size(),
+                                           args.data(),
+                                           &response->errorOutput);
+    });
+
+    // The server only stops if it can't start.
+    fprintf(stderr, "Could not listen on %s\n", socketPath);
+    return 1;
+}
+
+static int RunCacheServer(const char* address, const char* cacheDir,
+                          bool allowRemote)
+{
+    if (!TcpAddressIsLoopback(address)) {
+        if (!allowRemote) {
+            fprintf(stderr, "%s isn't a loopback address. The cache server "
+                    "doesn't check who\nconnects, so listening there takes "
+                    "--allow-remote.\n", address);
+            return 1;
+        }
+        fprintf(stderr, "Warning: any machine that can reach %s can change "
+                "the shaders that\nthis cache's clients build.\n", address);
+    }
+
+    PermutationCache cache(cacheDir, REMOTE_CACHE_SERVER_SIZE_MB * 1024 * 1024);
+    RemoteCacheServerRun(address, &cache);
+
+    // The server only stops if it can't start.
+    fprintf(stderr, "Could not listen on %s\n", address);
+    return 1;
+}
+
+static int RunWorker(const char* hostPort, bool allowRemote, unsigned numJobs)
+{
+    std::string address(hostPort);
+    if (address.find(':') == std::string::npos)
+        address = std::string(WORKER_DEFAULT_HOST) + ":" + address;
+
+    if (!TcpAddressIsLoopback(address.c_str())) {
+        if (!allowRemote) {
+            fprintf(stderr, "%s isn't a loopback address. Workers don't check "
+                    "who connects, so\nlistening there takes "
+                    "--allow-remote.\n", address.c_str());
+            return 1;
+        }
+        fprintf(stderr, "Warning: any machine that can reach %s can compile "
+                "files through\nthis worker.\n", address.c_str());
+    }
+
+    CompileSession session;
+    ShardWorkerRun(address.c_str(),
+        [&](const ShardRequest& request, const ShardResultFunc& sendResult) {
+        CompileShard(&session, numJobs, request, sendResult);
+    });
+
+    // The worker only stops if it can't start.
+    fprintf(stderr, "Could not listen on %s\n", address.c_str());
+    return 1;
+}
+
+static int RunClient(const char* socketPath, int argc, const char** argv)
+{
+    CompileRequest request;
+    request.workingDir = DirGetCurrent();
+    request.args.assign(argv, argv + argc);
+
+    CompileResponse response;
+    if (!CompileServerSend(socketPath, request, &response)) {
+        CompileSession session;
+        response.success = RunCommandLine(&session, argc, argv,
+                                          &response.errorOutput);
+    }
+
+    if (!response.success) {
+        fprintf(stderr, "%s", response.errorOutput.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, const char** argv)
+{
+    if (argc > 1 && StrCmp(argv[1], "--server") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "%s", GetUsage().c_str());
+            return 1;
+        }
+        return RunServer(argv[2]);
+    }
+
+    if (argc > 1 && StrCmp(argv[1], "--cache-server") == 0) {
+        bool allowRemote = argc == 5 &&
+                           StrCmp(argv[4], "--allow-remote") == 0;
+        if (argc != 4 && !allowRemote) {
+            fprintf(stderr, "%s", GetUsage().c_str());
+            return 1;
+        }
+        return RunCacheServer(argv[2], argv[3], allowRemote);
+    }
+
+    if (argc > 2 && StrCmp(argv[1], "--worker") == 0) {
+        // -j is given as for a build, as "-j jobs" or "-jjobs".
+        int numJobs = 1;
+        bool allowRemote = false;
+        for (int argIndex = 3; argIndex < argc && numJobs > 0; ++argIndex) {
+            const char* arg = argv[argIndex];
+            if (StrCmp(arg, "--allow-remote") == 0)
+                allowRemote = true;
+            else if (StrCmp(arg, "-j") == 0 && argIndex + 1 < argc)
+                numJobs = atoi(argv[++argIndex]);
+            else if (arg[0] == '-' && arg[1] == 'j')
+                numJobs = atoi(arg + 2);
+            else
+                numJobs = 0;
+        }
+        if (numJobs <= 0) {
+            fprintf(stderr, "%s", GetUsage().c_str());
+            return 1;
+        }
+        return RunWorker(argv[2], allowRemote, (unsigned)numJobs);
+    }
+
+    if (argc > 2 && StrCmp(argv[1], "--connect") == 0)
+        return RunClient(argv[2], argc - 3, argv + 3);
+
+    CompileSession session;
+    std::string errorOutput;
+    bool success = RunCommandLine(&session, argc - 1, argv + 1, &errorOutput);
+    if (!success) {
+        fprintf(stderr, "%s", errorOutput.c_str());
+        return 1;
+    }
+    return 0;
 }
 
 static std::string JoinPaths(const char* first, const char* second)
@@ -208,109 +1931,688 @@ static std::string JoinPaths(const char* first, const char* second)
     return result;
 }
 
-static bool RunMetal(const char* inputPath,
-                     const char* outputPath,
-                     const char* diagFilePath,
-                     const std::vector<std::string>& macros,
-                     std::string* output)
-{
-    ASSERT(output);
-
-    std::vector<const char*> args;
-    args.push_back(TOOL_METAL);
-    args.push_back("-emit-llvm");
-    args.push_back("-c");
-    args.push_back("-ffast-math");
-    args.push_back("-mmacosx-version-min=10.9");
-    args.push_back("-std=osx-metal1.1");
-    args.push_back("-isysroot");
-    args.push_back(SYSROOT);
-    args.push_back("-serialize-diagnostics");
-    args.push_back(diagFilePath);
-    args.push_back("-o");
-    args.push_back(outputPath);
-    for (const std::string& macro : macros) {
-        args.push_back("-D");
-        args.push_back(macro.c_str());
+// Makes a path absolute (from the working directory) and removes "." and
+// ".." components, without resolving symlinks, so that every way of
+// spelling a path gives the same result.
+static std::string GetAbsolutePath(const char* path)
+{
+    std::string full(path);
+    if (full.empty() || full[0] != '/')
+        full = DirGetCurrent() + "/" + full;
+
+    std::vector<std::string> components;
+    std::istringstream stream(full);
+    std::string component;
+    while (std::getline(stream, component, '/')) {
+        if (component.empty() || component == ".")
+            continue;
+        if (component == "..") {
+            if (!components.empty())
+                components.pop_back();
+        } else {
+            components.push_back(component);
+        }
     }
-    args.push_back(inputPath);
-    args.push_back(NULL);
 
-    Process process(TOOL_METAL, args);
-    if (process.result != PROCESS_SUCCESS)
-        FATAL("Could not run 'metal' command-line tool");
+    std::string result;
+    for (const std::string& component : components)
+        result += "/" + component;
+    return result.empty() ? "/" : result;
+}
+
+// The path relative to the project root if it's inside it, otherwise the
+// absolute path.
+static std::string GetProjectPath(const std::string& projectRoot,
+                                  const char* path)
+{
+    std::string absolutePath = GetAbsolutePath(path);
+    if (absolutePath == projectRoot)
+        return ".";
+    std::string prefix = projectRoot == "/" ? projectRoot : projectRoot + "/";
+    if (absolutePath.compare(0, prefix.size(), prefix) == 0)
+        return absolutePath.substr(prefix.size());
+    return absolutePath;
+}
+
+// What a tool prints for --version, which names the compiler release even
+// where the binary is only a driver for another. Running it takes a process,
+// so the answer is kept until the binary's size or time changes.
+static std::string GetToolVersion(const char* tool)
+{
+    struct ToolVersion {
+        FileInfo info;
+        std::string text;
+    };
+    static std::mutex mutex;
+    static std::map<std::string, ToolVersion> versions;
+
+    FileInfo info = FileInfo();
+    FileGetInfo(tool, &info);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ToolVersion& version = versions[tool];
+    if (version.text.empty() || version.info.size != info.size ||
+        version.info.modifiedTime != info.modifiedTime) {
+        std::vector<const char*> args;
+        args.push_back(tool);
+        args.push_back("--version");
+        args.push_back(NULL);
+        Process process(tool, args);
+
+        // Leave out where Xcode is installed, which doesn't change the
+        // output.
+        version.info = info;
+        version.text.clear();
+        std::istringstream lines(process.stdoutStr);
+        std::string line;
+        while (std::getline(lines, line)) {
+            if (line.compare(0, 13, "InstalledDir:") != 0)
+                version.text += line + "\n";
+        }
+    }
+    return version.text;
+}
+
+// The options passed to 'metal' for every permutation, apart from file paths
+// and macros.
+static void AppendMetalOptions(std::vector<const char*>* args)
+{
+    args->push_back("-emit-llvm");
+    args->push_back("-c");
+    args->push_back("-ffast-math");
+    args->push_back("-fmodules");
+    args->push_back("-mmacosx-version-min=10.9");
+    args->push_back("-std=osx-metal1.1");
+    args->push_back("-isysroot");
+    args->push_back(SYSROOT);
+}
+
+// Hashes what every permutation's output depends on: the toolchain, the
+// compiler options, the input path and whether the output is AIR for a
+// shared library or a metallib. Paths are taken relative to the project
+// root, so that the same build from another checkout, or another working
+// directory, hashes the same.
+static void HashCompileInputs(const std::string& projectRoot,
+                              const char* inputPath,
+                              const std::vector<std::string>& includeDirs,
+                              bool sharedLibraries, Sha256* hash)
+{
+    ASSERT(hash);
+
+    hash->Update64(CACHE_KEY_VERSION);
+    hash->Update64(sharedLibraries ? 1 : 0);
+
+    // Identify the toolchain by its version, so that an Xcode update
+    // invalidates the cache but two installs of the same Xcode share it.
+    const char* const tools[] = { TOOL_METAL, TOOL_METALLIB };
+    for (const char* tool : tools)
+        hash->UpdateStr(GetToolVersion(tool).c_str());
+
+    std::vector<const char*> options;
+    AppendMetalOptions(&options);
+    hash->Update64(options.size());
+    for (const char* option : options)
+        hash->UpdateStr(option);
+
+    hash->Update64(includeDirs.size());
+    for (const std::string& dir : includeDirs)
+        hash->UpdateStr(GetProjectPath(projectRoot, dir.c_str()).c_str());
+
+    hash->UpdateStr(GetProjectPath(projectRoot, inputPath).c_str());
+}
+
+// Returns false if any of the files that the source was read from might
+// have changed since.
+static bool IsShaderSourceCurrent(const ShaderSource& source)
+{
+    for (const SourceFile& file : source.files) {
+        FileInfo info;
+        bool exists = FileGetInfo(file.path.c_str(), &info);
+        if (exists != file.exists)
+            return false;
+        if (!exists)
+            continue;
+
+        // Modification times are in seconds, so a file modified in the same
+        // second as it was read could have changed again without its time
+        // changing.
+        if (info.size != file.info.size ||
+            info.modifiedTime != file.info.modifiedTime ||
+            info.modifiedTime >= source.readTime)
+            return false;
+    }
+    return true;
+}
+
+// Finds the option macros in a shader and parses its source, or reuses the
+// session's copy if the files haven't changed since it was made.
+static ShaderSource* LoadShaderSource(
+    CompileSession* session, const char* inputPath,
+    const std::vector<std::string>& includeDirs)
+{
+    ASSERT(session);
+
+    std::string absoluteInputPath = GetAbsolutePath(inputPath);
+    std::vector<std::string> absoluteIncludeDirs;
+    std::string key = absoluteInputPath;
+    for (const std::string& dir : includeDirs) {
+        absoluteIncludeDirs.push_back(GetAbsolutePath(dir.c_str()));
+        key += "\n" + absoluteIncludeDirs.back();
+    }
+    std::unique_ptr<ShaderSource>& source = session->sources[key];
+    if (source && IsShaderSourceCurrent(*source))
+        return source.get();
+
+    source.reset(new ShaderSource);
+    source->readTime = (i64)time(NULL);
+
+    // Both passes read the same mapping of the shader, and the constraints
+    // come from the directives the preprocessor found. A shader that can't
+    // be read is empty; its build reports it.
+    const char* path = absoluteInputPath.c_str();
+    MappedFile file;
+    file.Open(path);
+    FindOptionIfDefsInText(file.Data(), file.Size(), &source->ifdefs);
+    source->preprocessor.Parse(path, file.Data(), file.Size(), source->ifdefs,
+                               absoluteIncludeDirs);
+    FindPermutationConstraints(source->preprocessor.GetPermutationPragmas(),
+                               source->ifdefs, &source->constraints,
+                               &source->error);
+    source->preprocessor.FindEntryPoints(&source->entryPoints);
+
+    for (const std::string& path : source->preprocessor.GetFiles()) {
+        SourceFile file;
+        file.path = path;
+        file.info = FileInfo();
+        file.exists = FileGetInfo(path.c_str(), &file.info);
+        source->files.push_back(file);
+    }
+
+    return source.get();
+}
 
-    *output = process.stderrStr;
+// Computes each permutation's inputDigest from its effective source, so that
+// editing an option block only changes the digests of the permutations with
+// that option set, and permutations that see the same source share a digest.
+static void HashPermutationInputs(const std::string& projectRoot,
+                                  const char* inputPath,
+                                  const std::vector<std::string>& includeDirs,
+                                  bool sharedLibraries, ShaderSource* source,
+                                  std::vector<Permutation>* permutations)
+{
+    ASSERT(source);
+    ASSERT(permutations);
+
+    Sha256 prefix;
+    HashCompileInputs(projectRoot, inputPath, includeDirs, sharedLibraries,
+                      &prefix);
+
+    Sha256Digest compileInputsKey;
+    prefix.Final(&compileInputsKey);
+    if (compileInputsKey != source->compileInputsKey) {
+        source->compileInputsKey = compileInputsKey;
+        source->digests.clear();
+    }
 
-    return process.status == 0;
+    for (Permutation& permutation : *permutations) {
+        auto inserted = source->digests.insert(
+            std::make_pair(permutation.permuteMask, Sha256Digest()));
+        if (inserted.second) {
+            Sha256 hash(prefix);
+            source->preprocessor.HashPermutation(permutation.permuteMask,
+                                                 &hash);
+            hash.Final(&inserted.first->second);
+        }
+        permutation.inputDigest = inserted.first->second;
+    }
 }
 
-static bool RunMetalAr(const char* inputPath, const char* outputPath,
-                       std::string* output)
+// What the permutation's entry points are renamed with in a shared library:
+// the start of its digest. Permutations that compile to the same functions
+// get the same names, and any two that don't are all but certain to differ.
+static u64 GetFunctionId(const Sha256Digest& inputDigest)
 {
-    std::vector<const char*> args;
-    args.push_back(TOOL_METAL_AR);
-    args.push_back("r");
-    args.push_back(outputPath);
-    args.push_back(inputPath);
-    args.push_back(NULL);
+    u64 functionId = 0;
+    for (int i = 0; i < 8; ++i)
+        functionId |= (u64)inputDigest.bytes[i] << (8 * i);
+    return functionId;
+}
 
-    Process process(TOOL_METAL_AR, args);
-    if (process.result != PROCESS_SUCCESS)
-        FATAL("Could not run 'metal-ar' command-line tool");
+// Copies the permutations whose inputs haven't changed from the previous
+// build's output, and marks them as done.
+static void ReusePreviousBuild(const char* outputPath, const char* digestsPath,
+                               const std::vector<Permutation>& permutations,
+                               std::vector<std::vector<u8> >* shaderBytes,
+                               std::vector<PermutationStatus>* status)
+{
+    ASSERT(shaderBytes);
+    ASSERT(status);
+
+    PermutationDigestMap previousDigests;
+    if (!PermutationDigestsRead(digestsPath, &previousDigests))
+        return;
+
+    // A shared library holds other permutations' functions too, under
+    // names of their own, so it can't stand in for a permutation's metallib.
+    MappedShaderFile previousOutput;
+    if (!previousOutput.Open(outputPath) ||
+        previousOutput.GetReader().HasSharedLibraries())
+        return;
+    const ShaderFileReader& reader = previousOutput.GetReader();
+
+    for (size_t k = 0; k < permutations.size(); ++k) {
+        const Permutation& permutation = permutations[k];
+
+        auto digest = previousDigests.find(permutation.permuteMask);
+        if (digest == previousDigests.end() ||
+            digest->second != permutation.inputDigest)
+            continue;
 
-    *output = process.stderrStr;
+        ShaderPermutation previous;
+        if (!reader.FindPermutation(permutation.permuteMask, &previous))
+            continue;
 
-    return process.status == 0;
+        if (!reader.GetPermutationBytes(previous, &(*shaderBytes)[k]))
+            continue;
+        (*status)[k] = PERMUTATION_SUCCEEDED;
+    }
 }
 
-static bool RunMetalLib(const char* inputPath, const char* outputPath,
-                        std::string* output)
+static void GetMetalCommand(const ShaderCompileContext& context,
+                            const char* outputPath,
+                            const std::vector<std::string>& macros,
+                            std::vector<std::string>* args)
 {
-    std::vector<const char*> args;
-    args.push_back(TOOL_METALLIB);
-    args.push_back("-o");
-    args.push_back(outputPath);
-    args.push_back(inputPath);
-    args.push_back(NULL);
+    ASSERT(args);
 
-    Process process(TOOL_METALLIB, args);
-    if (process.result != PROCESS_SUCCESS)
-        FATAL("Could not run 'metallib' command-line tool");
+    std::vector<const char*> options;
+    AppendMetalOptions(&options);
 
-    *output = process.stderrStr;
+    args->push_back(TOOL_METAL);
+    args->insert(args->end(), options.begin(), options.end());
+    for (const std::string& dir : *context.includeDirs) {
+        args->push_back("-I");
+        args->push_back(dir);
+    }
+    // The modules in the cache are keyed by compiler version and options,
+    // so where the cache is doesn't affect the output.
+    args->push_back(std::string("-fmodules-cache-path=") +
+                    context.moduleCachePath);
+    args->push_back("-o");
+    args->push_back(outputPath);
+    for (const std::string& macro : macros) {
+        args->push_back("-D");
+        args->push_back(macro);
+    }
+    args->push_back(context.inputPath);
+}
+
+// metallib links AIR files directly; they don't need to be put in a
+// metal-ar archive first. The library is written to stdout, so it never
+// touches the disk.
+static void GetMetalLibCommand(const std::vector<std::string>& inputPaths,
+                               std::vector<std::string>* args)
+{
+    ASSERT(args);
 
-    return process.status == 0;
+    args->push_back(TOOL_METALLIB);
+    args->push_back("-o");
+    args->push_back("-");
+    args->insert(args->end(), inputPaths.begin(), inputPaths.end());
 }
 
-static bool InternalCompileShader(const char* inputPath, const char* tempDir,
-                                  const std::vector<std::string>& macros,
-                                  std::vector<u8>* outputBytes,
-                                  std::string* errorOutput)
+static std::string GetSlotAirPath(const char* tempDir, unsigned slot)
+{
+    char slotName[16];
+    snprintf(slotName, sizeof slotName, "%u", slot);
+    return JoinPaths(tempDir, slotName) + AIR_FILE_SUFFIX;
+}
+
+// Permutations for shared libraries stop at AIR, and are linked in batches
+// once all of a shader's are compiled.
+static unsigned GetCompileStageCount(bool sharedLibraries)
+{
+    return sharedLibraries ? STAGE_METALLIB : NUM_COMPILE_STAGES;
+}
+
+static bool LookupCompiledPermutation(const ShaderCompileContext& context,
+                                      const Permutation& permutation,
+                                      std::vector<u8>* outputBytes)
 {
     ASSERT(outputBytes);
+
+    if (context.memoryCache &&
+        context.memoryCache->Lookup(permutation.inputDigest, outputBytes))
+        return true;
+
+    if (context.cache &&
+        context.cache->Lookup(permutation.inputDigest, outputBytes)) {
+        if (context.memoryCache)
+            context.memoryCache->Store(permutation.inputDigest, *outputBytes);
+        return true;
+    }
+
+    return false;
+}
+
+static void StoreCompiledPermutation(const ShaderCompileContext& context,
+                                     const Permutation& permutation,
+                                     const std::vector<u8>& bytes)
+{
+    if (context.cache)
+        context.cache->Store(permutation.inputDigest, bytes);
+    if (context.memoryCache)
+        context.memoryCache->Store(permutation.inputDigest, bytes);
+}
+
+// Looks up the permutations that need compiling in the local caches, and
+// then all of the rest in the remote cache at once. Those found no longer
+// need compiling.
+static void FetchRemotePermutations(ShaderBuild* build)
+{
+    ASSERT(build);
+
+    const ShaderCompileContext& context = build->context;
+    std::vector<u32> missing;
+    std::vector<Sha256Digest> keys;
+    for (u32 k : build->pending) {
+        const Permutation& permutation = build->permutations[k];
+        if (LookupCompiledPermutation(context, permutation,
+                                      &build->shaderBytes[k])) {
+            build->status[k] = PERMUTATION_SUCCEEDED;
+        } else {
+            missing.push_back(k);
+            keys.push_back(permutation.inputDigest);
+        }
+    }
+
+    std::vector<std::vector<u8> > bytes;
+    std::vector<bool> found;
+    context.remoteCache->LookupBatch(keys, &bytes, &found);
+
+    std::vector<u32> pending;
+    for (size_t i = 0; i < missing.size(); ++i) {
+        u32 k = missing[i];
+        if (!found[i]) {
+            pending.push_back(k);
+            continue;
+        }
+        build->shaderBytes[k].swap(bytes[i]);
+        build->status[k] = PERMUTATION_SUCCEEDED;
+        StoreCompiledPermutation(context, build->permutations[k],
+                                 build->shaderBytes[k]);
+    }
+    build->pending.swap(pending);
+}
+
+// Stores the permutations that the build compiled in the remote cache, all at
+// once.
+static void StoreRemotePermutations(const ShaderBuild& build)
+{
+    std::vector<Sha256Digest> keys;
+    std::vector<const std::vector<u8>*> bytes;
+    for (u32 k : build.compiled) {
+        keys.push_back(build.permutations[k].inputDigest);
+        bytes.push_back(&build.shaderBytes[k]);
+    }
+    build.context.remoteCache->StoreBatch(keys, bytes);
+}
+
+// Links the permutations' AIR into shared libraries, batchSize distinct
+// permutations to each, in the order of their records. Permutations with
+// equal digests have the same AIR and function names, so only the first is
+// linked and the rest refer to its library. The finisher links one library
+// at a time, on its own thread, so its AIR files only need names that are
+// unique within a batch. Returns false if a library fails to link.
+static bool LinkSharedLibraries(const ShaderBuild& build, unsigned batchSize,
+                                std::vector<std::vector<u8> >* libraries,
+                                std::vector<u32>* libraryIndices,
+                                std::vector<u64>* functionIds,
+                                std::string* errorOutput)
+{
+    ASSERT(batchSize > 0);
+    ASSERT(libraries);
+    ASSERT(libraryIndices);
+    ASSERT(functionIds);
     ASSERT(errorOutput);
 
-    std::string airFile = JoinPaths(tempDir, AIR_FILE);
-    std::string diagFile = JoinPaths(tempDir, DIAG_FILE);
-    std::string metalArFile = JoinPaths(tempDir, METAL_AR_FILE);
-    std::string metalLibFile = JoinPaths(tempDir, METAL_LIBRARY_FILE);
+    const std::vector<Permutation>& permutations = build.permutations;
+    const u32 nPermutations = (u32)permutations.size();
 
-    if (!RunMetal(inputPath, airFile.c_str(), diagFile.c_str(), macros, errorOutput))
-        return false;
-    FileDelete(diagFile.c_str());
+    std::vector<u32> distinct;
+    std::map<Sha256Digest, u32> distinctByDigest;
+    libraryIndices->resize(nPermutations);
+    functionIds->resize(nPermutations);
+    for (u32 k = 0; k < nPermutations; ++k) {
+        auto inserted = distinctByDigest.insert(
+            std::make_pair(permutations[k].inputDigest, (u32)distinct.size()));
+        if (inserted.second)
+            distinct.push_back(k);
+        (*libraryIndices)[k] = inserted.first->second / batchSize;
+        (*functionIds)[k] = GetFunctionId(permutations[k].inputDigest);
+    }
 
-    if (!RunMetalAr(airFile.c_str(), metalArFile.c_str(), errorOutput))
-        return false;
-    FileDelete(airFile.c_str());
+    libraries->resize((distinct.size() + batchSize - 1) / batchSize);
+    for (size_t library = 0; library < libraries->size(); ++library) {
+        size_t begin = library * batchSize;
+        size_t end = std::min(distinct.size(), begin + batchSize);
+        std::vector<std::string> airPaths;
+        for (size_t i = begin; i < end; ++i) {
+            char name[32];
+            snprintf(name, sizeof name, "link%zu", i - begin);
+            airPaths.push_back(JoinPaths(build.context.tempDir, name) +
+                               AIR_FILE_SUFFIX);
+            const std::vector<u8>& air = build.shaderBytes[distinct[i]];
+            if (!FileTryWriteAllBytesAtomic(airPaths.back().c_str(),
+                                            air.data(), air.size())) {
+                *errorOutput = airPaths.back() + ": could not write\n";
+                return false;
+            }
+        }
 
-    if (!RunMetalLib(metalArFile.c_str(), metalLibFile.c_str(), errorOutput))
-        return false;
-    FileDelete(metalArFile.c_str());
+        std::vector<std::string> command;
+        GetMetalLibCommand(airPaths, &command);
+        std::vector<const char*> args;
+        for (const std::string& arg : command)
+            args.push_back(arg.c_str());
+        args.push_back(NULL);
+        Process process(TOOL_METALLIB, args);
+        if (process.result != PROCESS_SUCCESS)
+            FATAL("Could not run '%s'", TOOL_METALLIB);
+        if (process.status != 0) {
+            *errorOutput = process.stderrStr.empty()
+                               ? build.outputPath + ": could not link\n"
+                               : process.stderrStr;
+            return false;
+        }
+        (*libraries)[library].assign(process.stdoutStr.begin(),
+                                     process.stdoutStr.end());
+    }
+    return true;
+}
 
-    FileReadAllBytes(metalLibFile.c_str(), outputBytes);
+// Finds the distinct metallibs among the permutations', so that permutations
+// that compiled to identical bytes share a single blob. blobIndices[k] is the
+// blob of permutation k.
+static void FindDistinctBlobs(const std::vector<std::vector<u8> >& shaderBytes,
+                              std::vector<const std::vector<u8>*>* blobs,
+                              std::vector<u32>* blobIndices)
+{
+    ASSERT(blobs);
+    ASSERT(blobIndices);
+
+    std::map<Sha256Digest, u32> blobsByHash;
+    blobIndices->resize(shaderBytes.size());
+    for (size_t k = 0; k < shaderBytes.size(); ++k) {
+        Sha256 hash;
+        hash.Update(shaderBytes[k].data(), shaderBytes[k].size());
+        Sha256Digest digest;
+        hash.Final(&digest);
+
+        auto inserted = blobsByHash.insert(
+            std::make_pair(digest, (u32)blobs->size()));
+        if (inserted.second)
+            blobs->push_back(&shaderBytes[k]);
+        (*blobIndices)[k] = inserted.first->second;
+    }
+}
+
+// Writes the .shd file (see Util/ShaderFormat.h). Permutation k's record
+// refers to blobs[blobIndices[k]]. With functionIds, the blobs are shared
+// libraries, and each record has the functionId of its permutation. With
+// 'delta', a blob may instead be stored as a delta against an earlier record
+// whose mask differs by one bit; since records with more bits come first,
+// most have several such records to choose from. Returns false if the file
+// is too large for its 32-bit offsets.
+static bool WriteShaderFile(BinaryWriter& writer,
+                            const std::vector<Permutation>& permutations,
+                            u64 optionBits,
+                            const PermutationConstraints& constraints,
+                            const std::vector<const std::vector<u8>*>& blobs,
+                            const std::vector<u32>& blobIndices,
+                            const std::vector<u64>* functionIds,
+                            bool compress, bool delta)
+{
+    ASSERT(permutations.size() == blobIndices.size());
+    ASSERT(!functionIds || functionIds->size() == permutations.size());
+
+    const size_t nPermutations = permutations.size();
+
+    // firstRecords[i] is the first permutation whose record refers to blob i.
+    std::vector<u32> firstRecords(blobs.size(), (u32)nPermutations);
+    for (u32 k = nPermutations; k-- > 0; )
+        firstRecords[blobIndices[k]] = k;
+
+    std::map<u64, u32> recordsByMask;
+    if (delta) {
+        for (u32 k = 0; k < nPermutations; ++k)
+            recordsByMask[permutations[k].permuteMask] = k;
+    }
+
+    // Encoded blobs are made up front, since the records need their sizes.
+    // Blobs stored plain are written straight from 'blobs'.
+    const u32 blobHeaderSize = delta ? 12 : compress ? 4 : 0;
+    std::vector<std::vector<u8> > encodedBlobs(
+        compress || delta ? blobs.size() : 0);
+    std::vector<u32> baseRecords(blobs.size(), SHADER_NO_BASE_RECORD);
+    std::vector<u32> deltaLengths(blobs.size(), 0);
+    // The number of bases between each blob and one stored whole.
+    std::vector<u32> blobDepths(blobs.size(), 0);
+    std::vector<u32> blobLengths(blobs.size());
+    for (size_t i = 0; i < blobs.size(); ++i) {
+        const u32 k = firstRecords[i];
+        const std::vector<u8>& bytes = *blobs[i];
+        if (compress)
+            LzCompress(bytes.data(), bytes.size(), &encodedBlobs[i]);
+        else if (delta)
+            encodedBlobs[i] = bytes;
+
+        for (u32 bit = 0; delta && bit < 64; ++bit) {
+            const u64 mask = permutations[k].permuteMask ^ ((u64)1 << bit);
+            auto sibling = recordsByMask.find(mask);
+            if (sibling == recordsByMask.end() || sibling->second >= k)
+                continue;
+            const u32 baseBlob = blobIndices[sibling->second];
+            if (blobDepths[baseBlob] == SHADER_MAX_DELTA_DEPTH)
+                continue;
+
+            const std::vector<u8>& baseBytes = *blobs[baseBlob];
+            std::vector<u8> ops;
+            DeltaEncode(baseBytes.data(), baseBytes.size(), bytes.data(),
+                        bytes.size(), &ops);
+            std::vector<u8> compressedOps;
+            if (compress)
+                LzCompress(ops.data(), ops.size(), &compressedOps);
+            std::vector<u8>& payload = compress ? compressedOps : ops;
+            if (payload.size() >= encodedBlobs[i].size())
+                continue;
+
+            baseRecords[i] = sibling->second;
+            deltaLengths[i] = (u32)ops.size();
+            blobDepths[i] = blobDepths[baseBlob] + 1;
+            encodedBlobs[i].swap(payload);
+        }
+
+        blobLengths[i] = blobHeaderSize + (u32)(compress || delta
+            ? encodedBlobs[i].size()
+            : bytes.size());
+    }
+
+    writer.WriteRawData(SHADER_FILE_MAGIC, 4);
+    writer.Write32(SHADER_FORMAT_VERSION);
+    writer.WriteRawData(SHADER_FILE_API_MAGIC, 4);
+    writer.Write32((u32)nPermutations);
+    writer.Write32((u32)blobs.size());
+    writer.Write32((compress ? SHADER_FILE_FLAG_COMPRESSED : 0) |
+                   (delta ? SHADER_FILE_FLAG_DELTA : 0) |
+                   (functionIds ? SHADER_FILE_FLAG_SHARED_LIBRARIES : 0));
+    writer.Write64(optionBits);
+    writer.Write32((u32)constraints.requirements.size());
+    writer.Write32((u32)constraints.limits.size());
+
+    // The index lists the records in order of permuteMask.
+    std::vector<u32> sorted(nPermutations);
+    for (u32 k = 0; k < nPermutations; ++k)
+        sorted[k] = k;
+    std::sort(sorted.begin(), sorted.end(), [&](u32 a, u32 b) -> bool {
+        return permutations[a].permuteMask < permutations[b].permuteMask;
+    });
 
-    FileDelete(metalLibFile.c_str());
+    std::vector<long> pos_recordOffsets(nPermutations);
+    for (u32 k : sorted) {
+        writer.Write64(permutations[k].permuteMask);
+        pos_recordOffsets[k] = writer.WriteTemp32();
+        writer.Write32(0); // padding (for alignment purposes)
+    }
+
+    // Permutations that are neither here nor ruled out by the constraints
+    // were deferred.
+    for (const PermutationConstraints::Requirement& requirement :
+         constraints.requirements) {
+        writer.Write64(requirement.option);
+        writer.Write64(requirement.required);
+    }
+    for (const PermutationConstraints::Limit& limit : constraints.limits) {
+        writer.Write64(limit.group);
+        writer.Write32(limit.limit);
+        writer.Write32(0); // padding (for alignment purposes)
+    }
+
+    std::vector<long> pos_blobOffsets(nPermutations);
+    for (u32 k = 0; k < nPermutations; ++k) {
+        writer.OverwriteTemp32(pos_recordOffsets[k], (u32)writer.AlignAndTell());
+        writer.Write64(permutations[k].permuteMask);
+        pos_blobOffsets[k] = writer.WriteTemp32();
+        writer.Write32(blobLengths[blobIndices[k]]);
+        if (functionIds)
+            writer.Write64((*functionIds)[k]);
+    }
+
+    std::vector<u32> blobOffsets(blobs.size());
+    for (size_t i = 0; i < blobs.size(); ++i) {
+        const std::vector<u8>& bytes = *blobs[i];
+        blobOffsets[i] = (u32)writer.AlignAndTell();
+        if (blobHeaderSize >= 4)
+            writer.Write32((u32)bytes.size());
+        if (blobHeaderSize >= 12) {
+            writer.Write32(baseRecords[i]);
+            writer.Write32(deltaLengths[i]);
+        }
+        if (compress || delta) {
+            writer.WriteRawData(encodedBlobs[i].data(),
+                                encodedBlobs[i].size());
+        } else {
+            writer.WriteRawData(bytes.data(), bytes.size());
+        }
+    }
+
+    // Every offset is less than the size, so if the size fits in 32 bits,
+    // so do they. If it doesn't, some have been truncated already, but the
+    // file is thrown away.
+    if ((u64)writer.GetSize() > SHADER_FILE_MAX_SIZE)
+        return false;
 
+    for (u32 k = 0; k < nPermutations; ++k)
+        writer.OverwriteTemp32(pos_blobOffsets[k], blobOffsets[blobIndices[k]]);
     return true;
 }
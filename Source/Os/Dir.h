@@ -0,0 +1,22 @@
+#ifndef OS_DIR_H
+#define OS_DIR_H
+
+#include <vector>
+#include <string>
+
+// Creates the directory and any missing parent directories. It isn't an error
+// for the directory to exist already.
+void DirCreate(const char* path);
+// The same, but returns false instead if a directory can't be created.
+bool DirTryCreate(const char* path);
+
+// Lists the names of the entries in a directory, excluding "." and "..".
+// Returns false if the directory can't be opened.
+bool DirList(const char* path, std::vector<std::string>* names);
+
+// The process's current working directory.
+std::string DirGetCurrent();
+// Returns false if the directory doesn't exist.
+bool DirSetCurrent(const char* path);
+
+#endif // OS_DIR_H
@@ -0,0 +1,65 @@
+#include "Dir.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <Core/Macros.h>
+#include <Core/Str.h>
+
+void DirCreate(const char* path)
+{
+    if (!DirTryCreate(path))
+        FATAL("Failed to create directory %s", path);
+}
+
+bool DirTryCreate(const char* path)
+{
+    std::string partial(path);
+    for (size_t i = 1; i <= partial.length(); ++i) {
+        if (i != partial.length() && partial[i] != '/')
+            continue;
+
+        char saved = partial[i];
+        partial[i] = 0;
+        if (mkdir(partial.c_str(), 0777) != 0 && errno != EEXIST)
+            return false;
+        partial[i] = saved;
+    }
+    return true;
+}
+
+bool DirList(const char* path, std::vector<std::string>* names)
+{
+    ASSERT(names);
+
+    names->clear();
+
+    DIR* dir = opendir(path);
+    if (!dir)
+        return false;
+
+    while (dirent* entry = readdir(dir)) {
+        if (StrCmp(entry->d_name, ".") == 0 || StrCmp(entry->d_name, "..") == 0)
+            continue;
+        names->push_back(entry->d_name);
+    }
+
+    closedir(dir);
+    return true;
+}
+
+std::string DirGetCurrent()
+{
+    char path[PATH_MAX];
+    if (!getcwd(path, sizeof path))
+        FATAL("Failed to get the current directory");
+    return path;
+}
+
+bool DirSetCurrent(const char* path)
+{
+    return chdir(path) == 0;
+}
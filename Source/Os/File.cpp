@@ -1,10 +1,17 @@
 #include "File.h"
 
 #include <stdio.h>
+#include <sys/stat.h>
 
 #include <Core/Macros.h>
 
 void FileReadAllBytes(const char* path, std::vector<u8>* output)
+{
+    if (!FileTryReadAllBytes(path, output))
+        FATAL("Failed to read file %s", path);
+}
+
+bool FileTryReadAllBytes(const char* path, std::vector<u8>* output)
 {
     ASSERT(output);
 
@@ -16,6 +23,11 @@ void FileReadAllBytes(const char* path, std::vector<u8>* output)
         if (!(file = fopen(path, "rb")))
             break;
 
+        // A directory opens too, and can claim to be any length.
+        struct stat info;
+        if (fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode))
+            break;
+
         if (fseek(file, 0, SEEK_END))
             break;
 
@@ -27,7 +39,8 @@ void FileReadAllBytes(const char* path, std::vector<u8>* output)
 
         output->resize((size_t)length);
 
-        if (fread(&(*output)[0], 1, (size_t)length, file) != (size_t)length)
+        if (length > 0 &&
+            fread(&(*output)[0], 1, (size_t)length, file) != (size_t)length)
             break;
 
         result = true;
@@ -36,16 +49,20 @@ void FileReadAllBytes(const char* path, std::vector<u8>* output)
 
     // Clean up
     if (file) fclose(file);
-    if (!result)
-        FATAL("Failed to read file %s", path);
+    return result;
 }
 
 void FileDelete(const char* path)
 {
-    if (remove(path) != 0)
+    if (!FileTryDelete(path))
         FATAL("Failed to delete file %s", path);
 }
 
+bool FileTryDelete(const char* path)
+{
+    return remove(path) == 0;
+}
+
 void FileMove(const char* currPath, const char* newPath)
 {
     if (rename(currPath, newPath) != 0)
@@ -1,11 +1,33 @@
 #ifndef OS_FILE_H
 #define OS_FILE_H
 
+#include <stddef.h>
 #include <vector>
 #include <Core/Types.h>
 
+struct FileInfo {
+    u64 size;
+    i64 modifiedTime; // seconds since the Unix epoch
+};
+
 void FileReadAllBytes(const char* path, std::vector<u8>* output);
+bool FileTryReadAllBytes(const char* path, std::vector<u8>* output);
 void FileDelete(const char* path);
+bool FileTryDelete(const char* path);
 void FileMove(const char* currPath, const char* newPath);
 
+// Returns false if the file doesn't exist.
+bool FileGetInfo(const char* path, FileInfo* info);
+// Sets the modification time to now. Does nothing if the file doesn't exist.
+void FileTouch(const char* path);
+// The same, but returns false instead if the time can't be set.
+bool FileTryTouch(const char* path);
+// Writes to a temporary file next to path and renames it into place, so
+// that other processes see either the old file or the complete new one.
+void FileWriteAllBytesAtomic(const char* path, const void* data, size_t len);
+// The same, but returns false instead if the file can't be written. The old
+// file, if any, is left as it was.
+bool FileTryWriteAllBytesAtomic(const char* path, const void* data,
+                                size_t len);
+
 #endif // OS_FILE_H
@@ -0,0 +1,23 @@
+#ifndef OS_FILELOCK_H
+#define OS_FILELOCK_H
+
+// An advisory lock shared between processes, held on a lock file. The lock
+// is released by the destructor, or by the OS if the process dies.
+class FileLock {
+public:
+    FileLock();
+    ~FileLock();
+
+    // Creates the lock file if necessary. Returns false without waiting if
+    // another process holds the lock, or if the lock file can't be opened.
+    bool TryLock(const char* path);
+    void Unlock();
+
+private:
+    FileLock(const FileLock&);
+    FileLock& operator=(const FileLock&);
+
+    int m_fd;
+};
+
+#endif // OS_FILELOCK_H
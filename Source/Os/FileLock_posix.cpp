@@ -0,0 +1,43 @@
+#include "FileLock.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+
+#include <Core/Macros.h>
+
+FileLock::FileLock()
+    : m_fd(-1)
+{}
+
+FileLock::~FileLock()
+{
+    Unlock();
+}
+
+bool FileLock::TryLock(const char* path)
+{
+    ASSERT(m_fd == -1);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd == -1)
+        return false;
+
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        return false;
+    }
+
+    m_fd = fd;
+    return true;
+}
+
+void FileLock::Unlock()
+{
+    if (m_fd == -1)
+        return;
+
+    flock(m_fd, LOCK_UN);
+    close(m_fd);
+    m_fd = -1;
+}
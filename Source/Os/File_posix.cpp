@@ -0,0 +1,91 @@
+#include "File.h"
+
+#include <atomic>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <Core/Macros.h>
+
+bool FileGetInfo(const char* path, FileInfo* info)
+{
+    ASSERT(info);
+
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return false;
+
+    info->size = (u64)st.st_size;
+    info->modifiedTime = (i64)st.st_mtime;
+    return true;
+}
+
+void FileTouch(const char* path)
+{
+    if (!FileTryTouch(path))
+        FATAL("Failed to set modification time of file %s", path);
+}
+
+bool FileTryTouch(const char* path)
+{
+    return utimes(path, NULL) == 0 || errno == ENOENT;
+}
+
+void FileWriteAllBytesAtomic(const char* path, const void* data, size_t len)
+{
+    if (!FileTryWriteAllBytesAtomic(path, data, len))
+        FATAL("Failed to write file %s", path);
+}
+
+bool FileTryWriteAllBytesAtomic(const char* path, const void* data,
+                                size_t len)
+{
+    // Creating the temp file with open rather than mkstemp lets the kernel
+    // apply the umask, so nothing here has to read (and so briefly change)
+    // the process-wide umask while other threads are creating files.
+    static std::atomic<u32> s_counter(0);
+
+    std::string tempPath;
+    int fd;
+    for (;;) {
+        char suffix[64];
+        snprintf(suffix, sizeof suffix, ".tmp.%ld.%u", (long)getpid(),
+                 (unsigned)s_counter.fetch_add(1));
+        tempPath = path;
+        tempPath.append(suffix);
+
+        fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                  0666);
+        if (fd != -1)
+            break;
+        if (errno != EEXIST && errno != EINTR)
+            return false;
+    }
+
+    bool result = true;
+    const u8* bytes = (const u8*)data;
+    while (len > 0) {
+        ssize_t written = write(fd, bytes, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            result = false;
+            break;
+        }
+        bytes += written;
+        len -= (size_t)written;
+    }
+
+    if (close(fd) != 0)
+        result = false;
+
+    if (result && rename(tempPath.c_str(), path) == 0)
+        return true;
+    unlink(tempPath.c_str());
+    return false;
+}
@@ -0,0 +1,58 @@
+#ifndef OS_LOCALSOCKET_H
+#define OS_LOCALSOCKET_H
+
+#include <stddef.h>
+
+// A stream connection to another process on the same machine, through a
+// socket file (a Unix domain socket).
+class LocalSocket {
+public:
+    LocalSocket();
+    ~LocalSocket();
+
+    // Returns false if nothing is listening at path.
+    bool Connect(const char* path);
+    void Close();
+
+    // Sends and receives fail after waiting this long. No timeout by
+    // default.
+    void SetTimeout(unsigned seconds);
+
+    // These return false if the connection was closed or broken, or timed
+    // out. A broken connection never raises SIGPIPE.
+    bool SendAll(const void* data, size_t len);
+    bool ReceiveAll(void* data, size_t len);
+
+private:
+    LocalSocket(const LocalSocket&);
+    LocalSocket& operator=(const LocalSocket&);
+
+    friend class LocalSocketListener;
+
+    int m_fd;
+};
+
+// Accepts LocalSocket connections made to a socket file.
+class LocalSocketListener {
+public:
+    LocalSocketListener();
+    // Also removes the socket file.
+    ~LocalSocketListener();
+
+    // Creates the socket file, replacing a stale one left behind by a process
+    // that died. Returns false if the path is too long, or if another process
+    // is already listening there.
+    bool Listen(const char* path);
+
+    // Waits for the next connection.
+    void Accept(LocalSocket* socket);
+
+private:
+    LocalSocketListener(const LocalSocketListener&);
+    LocalSocketListener& operator=(const LocalSocketListener&);
+
+    int m_fd;
+    char m_path[256];
+};
+
+#endif // OS_LOCALSOCKET_H
@@ -0,0 +1,132 @@
+#include "LocalSocket.h"
+#include "Socket_posix.h"
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <Core/Macros.h>
+#include <Core/Str.h>
+
+static bool MakeAddress(const char* path, sockaddr_un* address)
+{
+    if (StrLen(path) >= sizeof address->sun_path)
+        return false;
+
+    *address = sockaddr_un();
+    address->sun_family = AF_UNIX;
+    StrCopy(address->sun_path, sizeof address->sun_path, path);
+    return true;
+}
+
+static int MakeSocket()
+{
+    int fd = SocketCreate(AF_UNIX, 0);
+    if (fd == -1)
+        FATAL("socket");
+    return fd;
+}
+
+LocalSocket::LocalSocket()
+    : m_fd(-1)
+{}
+
+LocalSocket::~LocalSocket()
+{
+    Close();
+}
+
+bool LocalSocket::Connect(const char* path)
+{
+    ASSERT(m_fd == -1);
+
+    sockaddr_un address;
+    if (!MakeAddress(path, &address))
+        return false;
+
+    int fd = MakeSocket();
+    if (connect(fd, (const sockaddr*)&address, sizeof address) != 0) {
+        close(fd);
+        return false;
+    }
+
+    m_fd = fd;
+    return true;
+}
+
+void LocalSocket::Close()
+{
+    if (m_fd == -1)
+        return;
+
+    close(m_fd);
+    m_fd = -1;
+}
+
+void LocalSocket::SetTimeout(unsigned seconds)
+{
+    ASSERT(m_fd != -1);
+
+    SocketSetTimeout(m_fd, seconds);
+}
+
+bool LocalSocket::SendAll(const void* data, size_t len)
+{
+    return SocketSendAll(m_fd, data, len);
+}
+
+bool LocalSocket::ReceiveAll(void* data, size_t len)
+{
+    return SocketReceiveAll(m_fd, data, len);
+}
+
+LocalSocketListener::LocalSocketListener()
+    : m_fd(-1)
+{
+    m_path[0] = 0;
+}
+
+LocalSocketListener::~LocalSocketListener()
+{
+    if (m_fd == -1)
+        return;
+
+    close(m_fd);
+    unlink(m_path);
+}
+
+bool LocalSocketListener::Listen(const char* path)
+{
+    ASSERT(m_fd == -1);
+
+    sockaddr_un address;
+    if (!MakeAddress(path, &address) || StrLen(path) >= sizeof m_path)
+        return false;
+
+    // If the socket file is there but nothing answers, its server died.
+    LocalSocket existing;
+    if (existing.Connect(path))
+        return false;
+    unlink(path);
+
+    int fd = MakeSocket();
+    if (bind(fd, (const sockaddr*)&address, sizeof address) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return false;
+    }
+
+    m_fd = fd;
+    StrCopy(m_path, sizeof m_path, path);
+    return true;
+}
+
+void LocalSocketListener::Accept(LocalSocket* socket)
+{
+    ASSERT(socket);
+    ASSERT(m_fd != -1);
+
+    socket->Close();
+
+    socket->m_fd = SocketAccept(m_fd);
+}
@@ -0,0 +1,28 @@
+#ifndef OS_MAPPEDFILE_H
+#define OS_MAPPEDFILE_H
+
+#include <stddef.h>
+#include <Core/Types.h>
+
+// A whole file mapped read-only into memory.
+class MappedFile {
+public:
+    MappedFile();
+    ~MappedFile();
+
+    // Returns false if the file can't be opened or mapped.
+    bool Open(const char* path);
+    void Close();
+
+    const u8* Data() const { return m_data; }
+    size_t Size() const { return m_size; }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const u8* m_data;
+    size_t m_size;
+};
+
+#endif // OS_MAPPEDFILE_H
@@ -1,6 +1,7 @@
 #ifndef OS_PROCESS_H
 #define OS_PROCESS_H
 
+#include <stddef.h>
 #include <vector>
 #include <string>
 
@@ -9,13 +10,59 @@ enum ProcessCreationResult {
     PROCESS_NOT_FOUND
 };
 
+// Runs a child process and waits for it to exit.
 struct Process {
     Process(const char* path, const std::vector<const char*>& args);
 
     ProcessCreationResult result;
     int status;
+    // Everything the process wrote, which may be binary.
     std::string stdoutStr;
     std::string stderrStr;
 };
 
+struct ProcessExit {
+    // The tag that the process was started with.
+    size_t tag;
+    int status;
+    std::string stdoutStr;
+    std::string stderrStr;
+};
+
+// Runs any number of child processes at once from a single thread, without a
+// thread per child. One poll() loop captures the output of all of them, and
+// each is reaped by its own pid. A group must only be used from one thread
+// at a time, but separate groups can run on separate threads.
+class ProcessGroup {
+public:
+    ProcessGroup();
+    // Waits for any children that are still running, discarding their output.
+    ~ProcessGroup();
+
+    // Starts a child without waiting for it. The tag identifies the child
+    // when it exits. args must end with a null pointer.
+    ProcessCreationResult Start(const char* path,
+                                const std::vector<const char*>& args,
+                                size_t tag);
+
+    // The number of children started and not yet returned by Wait().
+    size_t GetRunningCount() const { return m_children.size(); }
+
+    // Waits for one of the children to exit. Returns false straight away if
+    // there are none.
+    bool Wait(ProcessExit* processExit);
+
+private:
+    ProcessGroup(const ProcessGroup&);
+    ProcessGroup& operator=(const ProcessGroup&);
+
+    struct Child;
+
+    void ReadOutput();
+    void Reap(size_t index, ProcessExit* processExit);
+
+    std::vector<Child*> m_children;
+    std::vector<char> m_buffer;
+};
+
 #endif // OS_PROCESS_H
@@ -2,59 +2,50 @@
 
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <string.h>
 #include <spawn.h>
 #include <poll.h>
+#include <sys/wait.h>
 
 #include <Core/Macros.h>
 
-static void ReadPipes(int stdoutReadPipe, int stderrReadPipe,
-                      std::string& stdoutStr, std::string& stderrStr)
+const size_t OUTPUT_BUFFER_SIZE_BYTES = 64 * 1024;
+
+struct ProcessGroup::Child {
+    pid_t pid;
+    size_t tag;
+    // The read ends of the stdout and stderr pipes, or -1 once at EOF.
+    int fds[2];
+    std::string output[2];
+};
+
+// Makes a pipe whose ends children don't inherit, so that a child spawned
+// from another thread can't hold them open and keep us from seeing EOF.
+static void MakePipe(int fds[2])
 {
-    const unsigned OUTPUT_BUFFER_SIZE_BYTES = 1024;
-
-    std::vector<char> buffer;
-    buffer.resize(OUTPUT_BUFFER_SIZE_BYTES);
-
-    pollfd fds[] = { {stdoutReadPipe, POLLIN}, {stderrReadPipe, POLLIN} };
-    const int NFDS = sizeof fds / sizeof fds[0];
-
-    for (int rval; (rval = poll(fds, NFDS, (int)buffer.size())) > 0; ) {
-        bool eof = false;
-        if (fds[0].revents & POLLIN) {
-            ssize_t bytesRead = read(stdoutReadPipe, &buffer[0],
-                                     buffer.size() - 1);
-            if (bytesRead < 0)
-                FATAL("read");
-            if (bytesRead > 0) {
-                buffer[bytesRead] = 0;
-                stdoutStr.reserve((size_t)bytesRead);
-                stdoutStr.append(&buffer[0]);
-            } else {
-                eof = true;
-            }
-        }
-        if (fds[1].revents & POLLIN) {
-            ssize_t bytesRead = read(stderrReadPipe, &buffer[0],
-                                     buffer.size() - 1);
-            if (bytesRead < 0)
-                FATAL("read");
-            if (bytesRead > 0) {
-                buffer[bytesRead] = 0;
-                stderrStr.reserve((size_t)bytesRead);
-                stderrStr.append(&buffer[0]);
-                eof = false;
-            }
-        }
-        if (eof)
-            break;
+#ifdef POSIX_SPAWN_CLOEXEC_DEFAULT
+    // There's no pipe2() here, and another thread can spawn a child before
+    // fcntl() marks the pipe, but Spawn() closes everything it doesn't hand
+    // a child anyway.
+    if (pipe(fds))
+        FATAL("pipe");
+    for (int i = 0; i < 2; ++i) {
+        if (fcntl(fds[i], F_SETFD, FD_CLOEXEC) == -1)
+            FATAL("fcntl");
     }
+#else
+    if (pipe2(fds, O_CLOEXEC))
+        FATAL("pipe2");
+#endif
 }
 
-Process::Process(const char* path, const std::vector<const char*>& args)
-    : result(PROCESS_SUCCESS)
-    , status(-1)
-    , stdoutStr()
-    , stderrStr()
+// Starts the child with its stdout and stderr connected to new pipes, and
+// returns the read ends of the pipes.
+static ProcessCreationResult Spawn(const char* path,
+                                   const std::vector<const char*>& args,
+                                   pid_t* pid, int* stdoutReadPipe,
+                                   int* stderrReadPipe)
 {
     if (args.back() != NULL)
         FATAL("Last member of args vector should be a null pointer");
@@ -62,11 +53,20 @@ Process::Process(const char* path, const std::vector<const char*>& args)
     int stdoutPipe[2];
     int stderrPipe[2];
     posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
 
-    if (pipe(stdoutPipe) || pipe(stderrPipe))
-        FATAL("pipe");
+    // The dup2 file actions below clear close-on-exec for our own child.
+    MakePipe(stdoutPipe);
+    MakePipe(stderrPipe);
 
     posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attributes);
+#ifdef POSIX_SPAWN_CLOEXEC_DEFAULT
+    // The child gets stdin and what the file actions give it, and nothing
+    // else, whatever other threads have open without close-on-exec.
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_CLOEXEC_DEFAULT);
+    posix_spawn_file_actions_addinherit_np(&actions, 0);
+#endif
     posix_spawn_file_actions_addclose(&actions, stdoutPipe[0]);
     posix_spawn_file_actions_addclose(&actions, stderrPipe[0]);
     posix_spawn_file_actions_adddup2(&actions, stdoutPipe[1], 1);
@@ -75,29 +75,166 @@ Process::Process(const char* path, const std::vector<const char*>& args)
     posix_spawn_file_actions_addclose(&actions, stdoutPipe[1]);
     posix_spawn_file_actions_addclose(&actions, stderrPipe[1]);
 
-    pid_t pid;
-    int spawnResult = posix_spawn(&pid, path, &actions, NULL,
+    int spawnResult = posix_spawn(pid, path, &actions, &attributes,
                                   (char* const*)&args[0], NULL);
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+
+    close(stdoutPipe[1]);
+    close(stderrPipe[1]);
+
     if (spawnResult != 0) {
-        if (spawnResult == ENOENT || spawnResult == ESRCH) {
-            result = PROCESS_NOT_FOUND;
-        } else {
-            FATAL("Couldn't posix_spawn: %s", strerror(errno));
+        close(stdoutPipe[0]);
+        close(stderrPipe[0]);
+        if (spawnResult == ENOENT || spawnResult == ESRCH)
+            return PROCESS_NOT_FOUND;
+        FATAL("Couldn't posix_spawn: %s", strerror(spawnResult));
+    }
+
+    *stdoutReadPipe = stdoutPipe[0];
+    *stderrReadPipe = stderrPipe[0];
+    return PROCESS_SUCCESS;
+}
+
+static int WaitForPid(pid_t pid)
+{
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR)
+            FATAL("waitpid");
+    }
+    return status;
+}
+
+Process::Process(const char* path, const std::vector<const char*>& args)
+    : result(PROCESS_SUCCESS)
+    , status(-1)
+    , stdoutStr()
+    , stderrStr()
+{
+    ProcessGroup group;
+    result = group.Start(path, args, 0);
+    if (result != PROCESS_SUCCESS)
+        return;
+
+    ProcessExit processExit;
+    group.Wait(&processExit);
+    status = processExit.status;
+    stdoutStr.swap(processExit.stdoutStr);
+    stderrStr.swap(processExit.stderrStr);
+}
+
+ProcessGroup::ProcessGroup()
+    : m_children()
+    , m_buffer()
+{}
+
+ProcessGroup::~ProcessGroup()
+{
+    for (Child* child : m_children) {
+        for (int fd : child->fds) {
+            if (fd >= 0)
+                close(fd);
         }
+        WaitForPid(child->pid);
+        delete child;
     }
+}
 
-    close(stdoutPipe[1]);
-    close(stderrPipe[1]);
+ProcessCreationResult ProcessGroup::Start(const char* path,
+                                          const std::vector<const char*>& args,
+                                          size_t tag)
+{
+    Child* child = new Child;
+    child->tag = tag;
+    ProcessCreationResult result = Spawn(path, args, &child->pid,
+                                         &child->fds[0], &child->fds[1]);
+    if (result != PROCESS_SUCCESS) {
+        delete child;
+        return result;
+    }
 
-    stdoutStr.clear();
-    stderrStr.clear();
+    m_children.push_back(child);
+    return PROCESS_SUCCESS;
+}
 
-    if (spawnResult == 0) {
-        ReadPipes(stdoutPipe[0], stderrPipe[0], stdoutStr, stderrStr);
+bool ProcessGroup::Wait(ProcessExit* processExit)
+{
+    ASSERT(processExit);
+
+    if (m_children.empty())
+        return false;
+
+    // A child is done once it has closed both of its pipes, which normally
+    // means that it has exited (or is about to).
+    for (;;) {
+        for (size_t i = 0; i < m_children.size(); ++i) {
+            const Child* child = m_children[i];
+            if (child->fds[0] < 0 && child->fds[1] < 0) {
+                Reap(i, processExit);
+                return true;
+            }
+        }
+        ReadOutput();
+    }
+}
 
-        if (wait(&status) == -1)
-            FATAL("wait");
+// Waits for output from any of the children, and reads what is available.
+void ProcessGroup::ReadOutput()
+{
+    std::vector<pollfd> fds;
+    std::vector<Child*> owners;
+    for (Child* child : m_children) {
+        for (int fd : child->fds) {
+            if (fd < 0)
+                continue;
+            pollfd pfd = { fd, POLLIN, 0 };
+            fds.push_back(pfd);
+            owners.push_back(child);
+        }
     }
 
-    posix_spawn_file_actions_destroy(&actions);
+    if (poll(fds.data(), (nfds_t)fds.size(), -1) < 0) {
+        if (errno == EINTR)
+            return;
+        FATAL("poll");
+    }
+
+    if (m_buffer.empty())
+        m_buffer.resize(OUTPUT_BUFFER_SIZE_BYTES);
+
+    for (size_t i = 0; i < fds.size(); ++i) {
+        // EOF shows up as POLLHUP on some systems and POLLIN on others.
+        if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+        Child* child = owners[i];
+        int pipeIndex = child->fds[0] == fds[i].fd ? 0 : 1;
+
+        ssize_t bytesRead = read(fds[i].fd, &m_buffer[0], m_buffer.size());
+        if (bytesRead < 0) {
+            if (errno == EINTR)
+                continue;
+            FATAL("read");
+        }
+        if (bytesRead > 0) {
+            child->output[pipeIndex].append(&m_buffer[0], (size_t)bytesRead);
+        } else {
+            close(fds[i].fd);
+            child->fds[pipeIndex] = -1;
+        }
+    }
+}
+
+void ProcessGroup::Reap(size_t index, ProcessExit* processExit)
+{
+    Child* child = m_children[index];
+    m_children.erase(m_children.begin() + index);
+
+    processExit->tag = child->tag;
+    processExit->status = WaitForPid(child->pid);
+    processExit->stdoutStr.swap(child->output[0]);
+    processExit->stderrStr.swap(child->output[1]);
+
+    delete child;
 }
@@ -0,0 +1,132 @@
+#include "Socket_posix.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <Core/Macros.h>
+
+#ifdef MSG_NOSIGNAL
+const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+const int SEND_FLAGS = 0;
+#endif
+
+// How long SocketAccept() waits before trying again when it's out of
+// resources.
+const useconds_t ACCEPT_RETRY_MICROSECONDS = 100 * 1000;
+
+static void SetNoSigPipe(int fd)
+{
+    // There's no MSG_NOSIGNAL on OS X; the socket option does the same job.
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof on);
+#else
+    (void)fd;
+#endif
+}
+
+int SocketCreate(int family, int protocol)
+{
+#ifdef SOCK_CLOEXEC
+    int fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, protocol);
+#else
+    // Without SOCK_CLOEXEC, another thread can spawn a child before fcntl()
+    // marks the socket, but children are spawned with
+    // POSIX_SPAWN_CLOEXEC_DEFAULT there, which keeps it out of them anyway.
+    int fd = socket(family, SOCK_STREAM, protocol);
+    if (fd != -1)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+    if (fd != -1)
+        SetNoSigPipe(fd);
+    return fd;
+}
+
+// accept() errors that go away once other connections are closed.
+static bool IsResourceShortage(int error)
+{
+    return error == EMFILE || error == ENFILE || error == ENOBUFS ||
+           error == ENOMEM;
+}
+
+int SocketAccept(int listenFd)
+{
+    int fd;
+    for (;;) {
+#ifdef SOCK_CLOEXEC
+        fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+#else
+        fd = accept(listenFd, NULL, NULL);
+#endif
+        if (fd != -1)
+            break;
+        if (IsResourceShortage(errno)) {
+            // Closing other connections will free some up.
+            usleep(ACCEPT_RETRY_MICROSECONDS);
+        } else if (errno != EINTR && errno != ECONNABORTED) {
+            FATAL("accept");
+        }
+    }
+
+#ifndef SOCK_CLOEXEC
+    // See SocketCreate().
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+    SetNoSigPipe(fd);
+    return fd;
+}
+
+void SocketSetTimeout(int fd, unsigned seconds)
+{
+    timeval timeout = timeval();
+    timeout.tv_sec = seconds;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+}
+
+bool SocketSendAll(int fd, const void* data, size_t len)
+{
+    const char* p = (const char*)data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, SEND_FLAGS);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+bool SocketReceiveAll(int fd, void* data, size_t len)
+{
+    char* p = (char*)data;
+    while (len > 0) {
+        size_t received;
+        if (!SocketReceiveSome(fd, p, len, &received))
+            return false;
+        p += received;
+        len -= received;
+    }
+    return true;
+}
+
+bool SocketReceiveSome(int fd, void* data, size_t len, size_t* received)
+{
+    ASSERT(received);
+
+    ssize_t n;
+    do {
+        n = recv(fd, data, len, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return false;
+
+    *received = (size_t)n;
+    return true;
+}
@@ -0,0 +1,26 @@
+#ifndef OS_SOCKET_POSIX_H
+#define OS_SOCKET_POSIX_H
+
+#include <stddef.h>
+
+// The plumbing shared by LocalSocket and TcpSocket on POSIX systems. These
+// work on raw descriptors, so they don't care what kind of socket it is.
+
+// Makes a stream socket that isn't inherited by child processes and never
+// raises SIGPIPE. Returns -1 on failure.
+int SocketCreate(int family, int protocol);
+// Waits for the next connection on a listening socket, and sets it up the
+// same way. If the process is out of file descriptors, keeps waiting until
+// there's one free.
+int SocketAccept(int listenFd);
+
+// Sends and receives fail after waiting this long. No timeout by default.
+void SocketSetTimeout(int fd, unsigned seconds);
+
+// These return false if the connection was closed or broken, or timed out.
+bool SocketSendAll(int fd, const void* data, size_t len);
+bool SocketReceiveAll(int fd, void* data, size_t len);
+// Receives at least one byte, and at most len.
+bool SocketReceiveSome(int fd, void* data, size_t len, size_t* received);
+
+#endif // OS_SOCKET_POSIX_H
@@ -0,0 +1,68 @@
+#ifndef OS_TCPSOCKET_H
+#define OS_TCPSOCKET_H
+
+#include <stddef.h>
+#include <string>
+
+// A TCP stream connection. Addresses are "host:port", where the host is a
+// name or a numeric address (IPv6 ones in brackets, as in "[::1]:8080").
+class TcpSocket {
+public:
+    TcpSocket();
+    ~TcpSocket();
+
+    // Returns false if the address is malformed or can't be connected to.
+    bool Connect(const char* address);
+    void Close();
+    // Makes sends and receives on other threads fail, without closing the
+    // socket under them.
+    void Shutdown();
+
+    // Sends and receives fail after waiting this long. No timeout by
+    // default.
+    void SetTimeout(unsigned seconds);
+
+    // These return false if the connection was closed or broken, or timed
+    // out. A broken connection never raises SIGPIPE.
+    bool SendAll(const void* data, size_t len);
+    bool ReceiveAll(void* data, size_t len);
+    // Receives at least one byte, and at most len.
+    bool ReceiveSome(void* data, size_t len, size_t* received);
+
+private:
+    TcpSocket(const TcpSocket&);
+    TcpSocket& operator=(const TcpSocket&);
+
+    friend class TcpSocketListener;
+
+    int m_fd;
+};
+
+// Whether every address that 'address' resolves to is a loopback address,
+// which only this machine can connect to. False if it's malformed.
+bool TcpAddressIsLoopback(const char* address);
+
+// Accepts TcpSocket connections.
+class TcpSocketListener {
+public:
+    TcpSocketListener();
+    ~TcpSocketListener();
+
+    // Returns false if the address is malformed or already in use.
+    bool Listen(const char* address);
+    // The address being listened on, with the port filled in if Listen()
+    // was given port 0.
+    std::string GetAddress() const;
+
+    // Waits for the next connection. If the process is out of file
+    // descriptors, keeps waiting until there's one free.
+    void Accept(TcpSocket* socket);
+
+private:
+    TcpSocketListener(const TcpSocketListener&);
+    TcpSocketListener& operator=(const TcpSocketListener&);
+
+    int m_fd;
+};
+
+#endif // OS_TCPSOCKET_H
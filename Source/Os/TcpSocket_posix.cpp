@@ -0,0 +1,214 @@
+#include "TcpSocket.h"
+#include "Socket_posix.h"
+
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <Core/Macros.h>
+
+// Splits "host:port" (or "[host]:port") for getaddrinfo.
+static bool SplitAddress(const char* address, std::string* host,
+                         std::string* port)
+{
+    std::string str(address);
+    size_t colon = str.rfind(':');
+    if (colon == std::string::npos || colon + 1 == str.size())
+        return false;
+
+    *host = str.substr(0, colon);
+    *port = str.substr(colon + 1);
+    if (host->size() >= 2 && (*host)[0] == '[' &&
+        (*host)[host->size() - 1] == ']')
+        *host = host->substr(1, host->size() - 2);
+    return !host->empty();
+}
+
+static addrinfo* ResolveAddress(const char* address, bool passive)
+{
+    std::string host;
+    std::string port;
+    if (!SplitAddress(address, &host, &port))
+        return NULL;
+
+    addrinfo hints = addrinfo();
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (passive)
+        hints.ai_flags = AI_PASSIVE;
+
+    addrinfo* addresses;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+        return NULL;
+    return addresses;
+}
+
+bool TcpAddressIsLoopback(const char* address)
+{
+    addrinfo* addresses = ResolveAddress(address, false);
+    if (!addresses)
+        return false;
+
+    bool loopback = true;
+    for (addrinfo* ai = addresses; ai; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET) {
+            const sockaddr_in* in = (const sockaddr_in*)ai->ai_addr;
+            loopback = loopback && (ntohl(in->sin_addr.s_addr) >> 24) == 127;
+        } else if (ai->ai_family == AF_INET6) {
+            const sockaddr_in6* in6 = (const sockaddr_in6*)ai->ai_addr;
+            loopback = loopback && IN6_IS_ADDR_LOOPBACK(&in6->sin6_addr);
+        } else {
+            loopback = false;
+        }
+    }
+
+    freeaddrinfo(addresses);
+    return loopback;
+}
+
+TcpSocket::TcpSocket()
+    : m_fd(-1)
+{}
+
+TcpSocket::~TcpSocket()
+{
+    Close();
+}
+
+bool TcpSocket::Connect(const char* address)
+{
+    ASSERT(m_fd == -1);
+
+    addrinfo* addresses = ResolveAddress(address, false);
+    if (!addresses)
+        return false;
+
+    for (addrinfo* ai = addresses; ai; ai = ai->ai_next) {
+        int fd = SocketCreate(ai->ai_family, ai->ai_protocol);
+        if (fd == -1)
+            continue;
+
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            // Requests are small and sent back to back; don't hold them.
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+            m_fd = fd;
+            break;
+        }
+        close(fd);
+    }
+
+    freeaddrinfo(addresses);
+    return m_fd != -1;
+}
+
+void TcpSocket::Close()
+{
+    if (m_fd == -1)
+        return;
+
+    close(m_fd);
+    m_fd = -1;
+}
+
+void TcpSocket::Shutdown()
+{
+    if (m_fd != -1)
+        shutdown(m_fd, SHUT_RDWR);
+}
+
+void TcpSocket::SetTimeout(unsigned seconds)
+{
+    ASSERT(m_fd != -1);
+
+    SocketSetTimeout(m_fd, seconds);
+}
+
+bool TcpSocket::SendAll(const void* data, size_t len)
+{
+    return SocketSendAll(m_fd, data, len);
+}
+
+bool TcpSocket::ReceiveAll(void* data, size_t len)
+{
+    return SocketReceiveAll(m_fd, data, len);
+}
+
+bool TcpSocket::ReceiveSome(void* data, size_t len, size_t* received)
+{
+    return SocketReceiveSome(m_fd, data, len, received);
+}
+
+TcpSocketListener::TcpSocketListener()
+    : m_fd(-1)
+{}
+
+TcpSocketListener::~TcpSocketListener()
+{
+    if (m_fd != -1)
+        close(m_fd);
+}
+
+bool TcpSocketListener::Listen(const char* address)
+{
+    ASSERT(m_fd == -1);
+
+    addrinfo* addresses = ResolveAddress(address, true);
+    if (!addresses)
+        return false;
+
+    for (addrinfo* ai = addresses; ai; ai = ai->ai_next) {
+        int fd = SocketCreate(ai->ai_family, ai->ai_protocol);
+        if (fd == -1)
+            continue;
+
+        // Let a restarted server listen again straight away.
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(fd, SOMAXCONN) == 0) {
+            m_fd = fd;
+            break;
+        }
+        close(fd);
+    }
+
+    freeaddrinfo(addresses);
+    return m_fd != -1;
+}
+
+std::string TcpSocketListener::GetAddress() const
+{
+    ASSERT(m_fd != -1);
+
+    sockaddr_storage address;
+    socklen_t addressLen = sizeof address;
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    if (getsockname(m_fd, (sockaddr*)&address, &addressLen) != 0 ||
+        getnameinfo((const sockaddr*)&address, addressLen, host, sizeof host,
+                    port, sizeof port, NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+        FATAL("getsockname");
+
+    if (address.ss_family == AF_INET6)
+        return std::string("[") + host + "]:" + port;
+    return std::string(host) + ":" + port;
+}
+
+void TcpSocketListener::Accept(TcpSocket* socket)
+{
+    ASSERT(socket);
+    ASSERT(m_fd != -1);
+
+    socket->Close();
+
+    int fd = SocketAccept(m_fd);
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+
+    socket->m_fd = fd;
+}
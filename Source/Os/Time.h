@@ -0,0 +1,10 @@
+#ifndef OS_TIME_H
+#define OS_TIME_H
+
+#include <Core/Types.h>
+
+// A monotonic clock in microseconds, for timing. The starting point is
+// arbitrary.
+u64 TimeGetMicroseconds();
+
+#endif // OS_TIME_H
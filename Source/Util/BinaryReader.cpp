@@ -0,0 +1,79 @@
+#include "BinaryReader.h"
+#include <string.h>
+#include <Core/Endian.h>
+
+// default alignment in bytes (must match BinaryWriter)
+const u32 ALIGNMENT = 4;
+
+BinaryReader::BinaryReader(const void* data, size_t size)
+    : m_data((const u8*)data)
+    , m_size(size)
+    , m_pos(0)
+    , m_failed(false)
+{}
+
+u8 BinaryReader::Read8()
+{
+    const u8* p = Consume(1, 1);
+    return p ? *p : 0;
+}
+
+u16 BinaryReader::Read16()
+{
+    const u8* p = Consume(2, 2);
+    if (!p)
+        return 0;
+    u16 n;
+    memcpy(&n, p, 2);
+    return EndianSwapLE16(n);
+}
+
+u32 BinaryReader::Read32()
+{
+    const u8* p = Consume(4, 4);
+    if (!p)
+        return 0;
+    u32 n;
+    memcpy(&n, p, 4);
+    return EndianSwapLE32(n);
+}
+
+u64 BinaryReader::Read64()
+{
+    const u8* p = Consume(8, 8);
+    if (!p)
+        return 0;
+    u64 n;
+    memcpy(&n, p, 8);
+    return EndianSwapLE64(n);
+}
+
+const void* BinaryReader::ReadRawData(size_t len)
+{
+    return Consume(len, ALIGNMENT);
+}
+
+void BinaryReader::Seek(size_t pos)
+{
+    if (pos > m_size) {
+        m_failed = true;
+        pos = m_size;
+    }
+    m_pos = pos;
+}
+
+const u8* BinaryReader::Consume(size_t len, u32 alignment)
+{
+    size_t pos = m_pos;
+    size_t remainder = pos % alignment;
+    if (remainder != 0)
+        pos += alignment - remainder;
+
+    if (m_failed || pos > m_size || len > m_size - pos) {
+        m_failed = true;
+        return NULL;
+    }
+
+    m_pos = pos + len;
+    return m_data + pos;
+}
@@ -0,0 +1,42 @@
+#ifndef UTIL_BINARYREADER_H
+#define UTIL_BINARYREADER_H
+
+#include <stddef.h>
+#include <Core/Types.h>
+
+// Reads data laid out by BinaryWriter from a buffer in memory, skipping the
+// same alignment padding that BinaryWriter inserts.
+//
+// Reading past the end of the buffer doesn't crash: it sets the error flag,
+// and the read returns zero (or NULL for raw data).
+class BinaryReader {
+public:
+    BinaryReader(const void* data, size_t size);
+
+    u8 Read8();
+    u16 Read16();
+    u32 Read32();
+    u64 Read64();
+    // Returns a pointer into the buffer rather than copying.
+    const void* ReadRawData(size_t len);
+
+    void Seek(size_t pos);
+    size_t Tell() const { return m_pos; }
+    size_t Size() const { return m_size; }
+    const u8* Data() const { return m_data; }
+
+    bool Failed() const { return m_failed; }
+
+private:
+    BinaryReader(const BinaryReader&);
+    BinaryReader& operator=(const BinaryReader&);
+
+    const u8* Consume(size_t len, u32 alignment);
+
+    const u8* m_data;
+    size_t m_size;
+    size_t m_pos;
+    bool m_failed;
+};
+
+#endif // UTIL_BINARYREADER_H
@@ -1,83 +1,99 @@
 #include "BinaryWriter.h"
+#include <string.h>
 #include <Core/Endian.h>
+#include <Core/Macros.h>
 #include <Core/Str.h>
 
 // default alignment in bytes
 const u32 ALIGNMENT = 4;
 
+// Largest alignment of any value.
+const u32 MAX_ALIGNMENT = 8;
+
+BinaryWriter::BinaryWriter()
+    : m_file(NULL)
+    , m_buffer()
+    , m_pos(0)
+{}
+
 BinaryWriter::BinaryWriter(FILE* fp)
     : m_file(fp)
+    , m_buffer()
+    , m_pos(ftell(fp))
 {}
 
 void BinaryWriter::Write8(u8 n)
 {
-    fwrite(&n, 1, 1, m_file);
+    Put(&n, 1);
 }
 
 void BinaryWriter::Write16(u16 n)
 {
     CheckAlign(2);
     n = EndianSwapLE16(n);
-    fwrite(&n, 2, 1, m_file);
+    Put(&n, 2);
 }
 
 void BinaryWriter::Write32(u32 n)
 {
     CheckAlign(4);
     n = EndianSwapLE32(n);
-    fwrite(&n, 4, 1, m_file);
+    Put(&n, 4);
 }
 
 void BinaryWriter::WriteF32(f32 n)
 {
     CheckAlign(4);
     n = EndianSwapLEFloat32(n);
-    fwrite(&n, 4, 1, m_file);
+    Put(&n, 4);
 }
 
 void BinaryWriter::Write64(u64 n)
 {
     CheckAlign(8);
     n = EndianSwapLE64(n);
-    fwrite(&n, 8, 1, m_file);
+    Put(&n, 8);
 }
 
 void BinaryWriter::WriteRawData(const void* data, size_t len)
 {
     CheckAlign(ALIGNMENT);
-    fwrite(data, 1, len, m_file);
+    Put(data, len);
 }
 
 long BinaryWriter::WriteTemp32()
 {
     CheckAlign(4);
-    long pos = ftell(m_file);
+    long pos = m_pos;
     u32 temp = 0xFFFFFFFFU;
-    fwrite(&temp, 4, 1, m_file);
+    Put(&temp, 4);
     return pos;
 }
 
 void BinaryWriter::WriteStr(const char* str)
 {
+    static const u8 zeros[ALIGNMENT] = {};
+
     size_t length = StrLen(str);
-    fwrite(str, 1, length, m_file);
-    fputc(0, m_file); // null terminator
-    long pos = ftell(m_file);
-    long remainder = pos % ALIGNMENT;
-    if (remainder != 0) {
-        u32 padding = ALIGNMENT - (u32)remainder;
-        for (u32 i = 0; i < padding; ++i) {
-            fputc(0, m_file);
-        }
-    }
+    Put(str, length + 1); // including the null terminator
+    long remainder = m_pos % ALIGNMENT;
+    if (remainder != 0)
+        Put(zeros, ALIGNMENT - (u32)remainder);
 }
 
 void BinaryWriter::OverwriteTemp32(long pos, u32 n)
 {
-    long prevFilePointer = ftell(m_file);
+    ASSERT(pos % 4 == 0 && pos + 4 <= m_pos);
+
+    n = EndianSwapLE32(n);
+    if (!m_file) {
+        memcpy(&m_buffer[pos], &n, 4);
+        return;
+    }
+
     fseek(m_file, pos, SEEK_SET);
-    Write32(n);
-    fseek(m_file, prevFilePointer, SEEK_SET);
+    fwrite(&n, 4, 1, m_file);
+    fseek(m_file, m_pos, SEEK_SET);
 }
 
 u32 BinaryWriter::RelativeOffset(long pos)
@@ -89,17 +105,27 @@ u32 BinaryWriter::RelativeOffset(long pos)
 long BinaryWriter::AlignAndTell()
 {
     CheckAlign(ALIGNMENT);
-    return ftell(m_file);
+    return m_pos;
 }
 
-void BinaryWriter::CheckAlign(u32 alignment)
+void BinaryWriter::Put(const void* data, size_t len)
 {
-    long pos = ftell(m_file);
-    long remainder = pos % alignment;
-    if (remainder != 0) {
-        u32 padding = alignment - (u32)remainder;
-        for (u32 i = 0; i < padding; ++i) {
-            fputc(0xAA, m_file);
-        }
+    if (m_file) {
+        fwrite(data, 1, len, m_file);
+    } else {
+        const u8* bytes = (const u8*)data;
+        m_buffer.insert(m_buffer.end(), bytes, bytes + len);
     }
+    m_pos += (long)len;
+}
+
+void BinaryWriter::CheckAlign(u32 alignment)
+{
+    static const u8 padding[MAX_ALIGNMENT] = {
+        0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA
+    };
+
+    long remainder = m_pos % alignment;
+    if (remainder != 0)
+        Put(padding, alignment - (u32)remainder);
 }
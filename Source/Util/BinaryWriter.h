@@ -2,10 +2,16 @@
 #define UTIL_BINARYWRITER_H
 
 #include <stdio.h>
+#include <vector>
 #include <Core/Types.h>
 
+// Writes little-endian values, each aligned to its size. A writer either
+// writes straight to a FILE, or builds the data in memory to be written out
+// in one go. The in-memory writer never makes system calls, so prefer it for
+// large files with lots of small values and temp slots.
 class BinaryWriter {
 public:
+    BinaryWriter();
     explicit BinaryWriter(FILE* fp);
 
     void Write8(u8 n);
@@ -22,13 +28,22 @@ public:
     u32 RelativeOffset(long pos);
 
     long AlignAndTell();
+
+    // What an in-memory writer has written.
+    const u8* GetData() const { return m_buffer.data(); }
+    size_t GetSize() const { return m_buffer.size(); }
+
 private:
     BinaryWriter(const BinaryWriter&);
     BinaryWriter& operator=(const BinaryWriter&);
 
+    void Put(const void* data, size_t len);
     void CheckAlign(u32 alignment);
 
+    // NULL for an in-memory writer.
     FILE* m_file;
+    std::vector<u8> m_buffer;
+    long m_pos;
 };
 
 #endif // UTIL_BINARYWRITER_H
@@ -0,0 +1,154 @@
+#include "Delta.h"
+
+#include <string.h>
+#include <Core/Macros.h>
+
+// Each operation is
+//
+//   varint insertLength  u8 inserted[insertLength]
+//   varint copyLength    varint copyOffset (only if copyLength != 0)
+//
+// where the varints are unsigned LEB128 and copyOffset is from the start of
+// the base. The delta ends after the last operation.
+
+// Shorter matches cost about as much to describe as to insert.
+const size_t DELTA_MIN_MATCH = 8;
+const u32 DELTA_MIN_HASH_BITS = 10;
+const u32 DELTA_MAX_HASH_BITS = 20;
+
+static u64 Load64(const u8* p)
+{
+    u64 n;
+    memcpy(&n, p, 8);
+    return n;
+}
+
+static u32 Hash(u64 sequence, u32 hashBits)
+{
+    return (u32)((sequence * 0x9E3779B97F4A7C15ull) >> (64 - hashBits));
+}
+
+static void PutVarint(std::vector<u8>* output, size_t n)
+{
+    for (; n >= 0x80; n >>= 7)
+        output->push_back((u8)(n | 0x80));
+    output->push_back((u8)n);
+}
+
+static bool GetVarint(const u8** p, const u8* end, size_t* n)
+{
+    *n = 0;
+    for (u32 shift = 0; shift < 35; shift += 7) {
+        if (*p == end)
+            return false;
+        u8 byte = *(*p)++;
+        *n |= (size_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+static void PutOperation(std::vector<u8>* delta, const u8* inserted,
+                         size_t insertLength, size_t copyOffset,
+                         size_t copyLength)
+{
+    PutVarint(delta, insertLength);
+    delta->insert(delta->end(), inserted, inserted + insertLength);
+    PutVarint(delta, copyLength);
+    if (copyLength != 0)
+        PutVarint(delta, copyOffset);
+}
+
+void DeltaEncode(const u8* base, size_t baseSize, const u8* target,
+                 size_t targetSize, std::vector<u8>* delta)
+{
+    ASSERT(base || baseSize == 0);
+    ASSERT(target || targetSize == 0);
+    ASSERT(delta);
+
+    delta->clear();
+
+    // Index every position of the base by the bytes that start there.
+    u32 hashBits = DELTA_MIN_HASH_BITS;
+    while (hashBits < DELTA_MAX_HASH_BITS && ((size_t)1 << hashBits) < baseSize)
+        ++hashBits;
+    const u32 NONE = 0xffffffff;
+    std::vector<u32> table((size_t)1 << hashBits, NONE);
+    for (size_t pos = 0; pos + DELTA_MIN_MATCH <= baseSize; ++pos)
+        table[Hash(Load64(base + pos), hashBits)] = (u32)pos;
+
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + DELTA_MIN_MATCH <= targetSize) {
+        size_t candidate = table[Hash(Load64(target + pos), hashBits)];
+        if (candidate == NONE ||
+            memcmp(base + candidate, target + pos, DELTA_MIN_MATCH) != 0) {
+            ++pos;
+            continue;
+        }
+
+        // Grow the match backwards over bytes that would be inserted, and
+        // then forwards.
+        while (pos > anchor && candidate > 0 &&
+               base[candidate - 1] == target[pos - 1]) {
+            --pos;
+            --candidate;
+        }
+        size_t length = DELTA_MIN_MATCH;
+        while (pos + length < targetSize && candidate + length < baseSize &&
+               base[candidate + length] == target[pos + length])
+            ++length;
+
+        PutOperation(delta, target + anchor, pos - anchor, candidate, length);
+        pos += length;
+        anchor = pos;
+    }
+
+    if (anchor < targetSize)
+        PutOperation(delta, target + anchor, targetSize - anchor, 0, 0);
+}
+
+// Inserted bytes are in the delta itself, and each copy takes at least three
+// bytes (the insert length, copy length and offset) and copies at most the
+// whole base.
+size_t DeltaMaxDecodedSize(size_t baseSize, size_t deltaSize)
+{
+    return deltaSize + deltaSize / 3 * baseSize;
+}
+
+bool DeltaDecode(const u8* base, size_t baseSize, const u8* delta,
+                 size_t deltaSize, u8* output, size_t outputSize)
+{
+    ASSERT(base || baseSize == 0);
+    ASSERT(delta || deltaSize == 0);
+    ASSERT(output || outputSize == 0);
+
+    const u8* p = delta;
+    const u8* end = delta + deltaSize;
+    size_t outPos = 0;
+    while (p < end) {
+        size_t insertLength;
+        if (!GetVarint(&p, end, &insertLength) ||
+            (size_t)(end - p) < insertLength ||
+            outputSize - outPos < insertLength)
+            return false;
+        memcpy(output + outPos, p, insertLength);
+        p += insertLength;
+        outPos += insertLength;
+
+        size_t copyLength;
+        if (!GetVarint(&p, end, &copyLength))
+            return false;
+        if (copyLength == 0)
+            continue;
+        size_t copyOffset;
+        if (!GetVarint(&p, end, &copyOffset) || copyOffset > baseSize ||
+            baseSize - copyOffset < copyLength ||
+            outputSize - outPos < copyLength)
+            return false;
+        memcpy(output + outPos, base + copyOffset, copyLength);
+        outPos += copyLength;
+    }
+    return outPos == outputSize;
+}
@@ -0,0 +1,27 @@
+#ifndef UTIL_DELTA_H
+#define UTIL_DELTA_H
+
+#include <stddef.h>
+#include <vector>
+#include <Core/Types.h>
+
+// Binary deltas: a target described as a run of operations against a base,
+// each inserting new bytes and then copying bytes from anywhere in the base.
+// Good for targets that are mostly the same as their base, like two builds
+// of a shader that differ by one option.
+
+// Replaces 'delta' with the operations that turn 'base' into 'target'.
+void DeltaEncode(const u8* base, size_t baseSize, const u8* target,
+                 size_t targetSize, std::vector<u8>* delta);
+
+// The most that a delta of 'deltaSize' bytes can rebuild from a base of
+// 'baseSize' bytes.
+size_t DeltaMaxDecodedSize(size_t baseSize, size_t deltaSize);
+
+// Rebuilds exactly 'outputSize' bytes from the base and a delta. Returns
+// false if the delta is corrupt or doesn't produce that size; it never reads
+// or writes out of bounds, whatever the input.
+bool DeltaDecode(const u8* base, size_t baseSize, const u8* delta,
+                 size_t deltaSize, u8* output, size_t outputSize);
+
+#endif // UTIL_DELTA_H
@@ -0,0 +1,235 @@
+#include "Lz.h"
+
+#include <string.h>
+#include <Core/Macros.h>
+
+const size_t LZ_MIN_MATCH = 4;
+const size_t LZ_MAX_OFFSET = 65535;
+// As in LZ4, the last match starts at least 12 bytes before the end of the
+// block and the last 5 bytes are always literals.
+const size_t LZ_MATCH_START_MARGIN = 12;
+const size_t LZ_LAST_LITERALS = 5;
+const u32 LZ_HASH_BITS = 14;
+// How quickly the compressor starts skipping through data that isn't
+// matching: it moves on by 1 + (bytes since the last match >> this).
+const u32 LZ_SKIP_SHIFT = 6;
+
+static u32 Load32(const u8* p)
+{
+    u32 n;
+    memcpy(&n, p, 4);
+    return n;
+}
+
+static u64 Load64(const u8* p)
+{
+    u64 n;
+    memcpy(&n, p, 8);
+    return n;
+}
+
+static u32 Hash(u32 sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Lengths of 15 or more spill over into extra bytes of 255 and a remainder.
+static u8* PutLength(u8* out, size_t length)
+{
+    for (; length >= 255; length -= 255)
+        *out++ = 255;
+    *out++ = (u8)length;
+    return out;
+}
+
+// Returns the end of the sequence, which 'out' must have room for.
+static u8* PutSequence(u8* out, const u8* literals, size_t literalLength,
+                       size_t offset, size_t matchLength)
+{
+    u8* token = out++;
+    *token = literalLength >= 15 ? 0xf0 : (u8)(literalLength << 4);
+    if (literalLength >= 15)
+        out = PutLength(out, literalLength - 15);
+    memcpy(out, literals, literalLength);
+    out += literalLength;
+
+    // The last sequence is just literals.
+    if (matchLength != 0) {
+        *out++ = (u8)offset;
+        *out++ = (u8)(offset >> 8);
+        size_t length = matchLength - LZ_MIN_MATCH;
+        *token |= length >= 15 ? 0x0f : (u8)length;
+        if (length >= 15)
+            out = PutLength(out, length - 15);
+    }
+    return out;
+}
+
+// The number of bytes that match at a and b, stopping at 'limit' bytes.
+static size_t MatchLength(const u8* a, const u8* b, size_t limit)
+{
+    size_t length = 0;
+    for (; limit - length >= 8; length += 8) {
+        u64 difference = Load64(a + length) ^ Load64(b + length);
+        if (difference != 0) {
+            // The first differing byte is the one loaded lowest (or highest,
+            // on a big-endian CPU).
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            return length + (size_t)__builtin_clzll(difference) / 8;
+#else
+            return length + (size_t)__builtin_ctzll(difference) / 8;
+#endif
+        }
+    }
+    for (; length < limit && a[length] == b[length]; ++length)
+        ;
+    return length;
+}
+
+size_t LzMaxCompressedSize(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+// Each byte of a length beyond the token's adds at most 255 bytes, and
+// nothing else expands further.
+size_t LzMaxDecompressedSize(size_t size)
+{
+    return size * 255;
+}
+
+void LzCompress(const u8* data, size_t size, std::vector<u8>* output)
+{
+    ASSERT(data || size == 0);
+    ASSERT(output);
+
+    output->resize(LzMaxCompressedSize(size));
+    u8* out = output->data();
+
+    size_t anchor = 0;
+    if (size > LZ_MATCH_START_MARGIN) {
+        // The most recent position of each hashed 4-byte sequence.
+        std::vector<u32> table((size_t)1 << LZ_HASH_BITS, 0);
+        const size_t matchStartLimit = size - LZ_MATCH_START_MARGIN;
+        const size_t matchEndLimit = size - LZ_LAST_LITERALS;
+
+        size_t pos = 0;
+        while (pos < matchStartLimit) {
+            u32 sequence = Load32(data + pos);
+            u32& entry = table[Hash(sequence)];
+            size_t candidate = entry;
+            entry = (u32)pos;
+
+            if (candidate >= pos || pos - candidate > LZ_MAX_OFFSET ||
+                Load32(data + candidate) != sequence) {
+                pos += 1 + ((pos - anchor) >> LZ_SKIP_SHIFT);
+                continue;
+            }
+
+            // Take in any matching bytes just before the sequence too.
+            while (pos > anchor && candidate > 0 &&
+                   data[pos - 1] == data[candidate - 1]) {
+                --pos;
+                --candidate;
+            }
+
+            size_t length = LZ_MIN_MATCH +
+                MatchLength(data + pos + LZ_MIN_MATCH,
+                            data + candidate + LZ_MIN_MATCH,
+                            matchEndLimit - pos - LZ_MIN_MATCH);
+
+            out = PutSequence(out, data + anchor, pos - anchor,
+                              pos - candidate, length);
+            pos += length;
+            anchor = pos;
+
+            // Positions inside the match aren't hashed, apart from this one,
+            // which often starts the next match.
+            if (pos - 2 < matchStartLimit)
+                table[Hash(Load32(data + pos - 2))] = (u32)(pos - 2);
+        }
+    }
+
+    out = PutSequence(out, data + anchor, size - anchor, 0, 0);
+    output->resize((size_t)(out - output->data()));
+}
+
+// Reads the extra bytes of a length whose 4 bits in the token were all set.
+static bool GetLength(const u8** p, const u8* end, size_t* length)
+{
+    u8 byte;
+    do {
+        if (*p == end)
+            return false;
+        byte = *(*p)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool LzDecompress(const u8* data, size_t size, u8* output, size_t outputSize)
+{
+    ASSERT(data || size == 0);
+    ASSERT(output || outputSize == 0);
+
+    const u8* p = data;
+    const u8* end = data + size;
+    size_t outPos = 0;
+
+    for (;;) {
+        if (p == end)
+            return false;
+        u8 token = *p++;
+
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !GetLength(&p, end, &literalLength))
+            return false;
+        if ((size_t)(end - p) < literalLength ||
+            outputSize - outPos < literalLength)
+            return false;
+        // Most runs are short, and copying a fixed 16 bytes (when there's
+        // room) is quicker than copying exactly the right number.
+        if (literalLength <= 16 && end - p >= 16 && outputSize - outPos >= 16)
+            memcpy(output + outPos, p, 16);
+        else
+            memcpy(output + outPos, p, literalLength);
+        p += literalLength;
+        outPos += literalLength;
+
+        if (p == end)
+            return outPos == outputSize;
+
+        if (end - p < 2)
+            return false;
+        size_t offset = p[0] | ((size_t)p[1] << 8);
+        p += 2;
+        if (offset == 0 || offset > outPos)
+            return false;
+
+        size_t matchLength = token & 0x0f;
+        if (matchLength == 15 && !GetLength(&p, end, &matchLength))
+            return false;
+        matchLength += LZ_MIN_MATCH;
+        if (outputSize - outPos < matchLength)
+            return false;
+
+        // A match can overlap the bytes it produces (offset 1 repeats a
+        // byte). Each copy is from bytes that are already there, and the
+        // repeated run doubles in length every time.
+        u8* out = output + outPos;
+        const u8* match = out - offset;
+        if (offset >= 16 && matchLength <= 16 && outputSize - outPos >= 16) {
+            memcpy(out, match, 16);
+            outPos += matchLength;
+            continue;
+        }
+        for (size_t copied = 0; copied < matchLength; ) {
+            size_t n = offset + copied;
+            if (n > matchLength - copied)
+                n = matchLength - copied;
+            memcpy(out + copied, match, n);
+            copied += n;
+        }
+        outPos += matchLength;
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef UTIL_LZ_H
+#define UTIL_LZ_H
+
+#include <stddef.h>
+#include <vector>
+#include <Core/Types.h>
+
+// A fast LZ77 codec that uses the LZ4 block format: a run of sequences, each
+// a token byte, literals, a 16-bit match offset and the match length. Each
+// call compresses one independent block; nothing is shared between blocks.
+
+// The most that LzCompress() can produce for 'size' input bytes.
+size_t LzMaxCompressedSize(size_t size);
+// The most that a block of 'size' bytes can decompress to.
+size_t LzMaxDecompressedSize(size_t size);
+
+// Replaces 'output' with the compressed block.
+void LzCompress(const u8* data, size_t size, std::vector<u8>* output);
+
+// Decompresses a block into exactly 'outputSize' bytes. Returns false if the
+// block is corrupt or doesn't decompress to that size; it never reads or
+// writes out of bounds, whatever the input.
+bool LzDecompress(const u8* data, size_t size, u8* output, size_t outputSize);
+
+#endif // UTIL_LZ_H
@@ -0,0 +1,190 @@
+#include "Sha256.h"
+#include <string.h>
+#include <Core/Endian.h>
+#include <Core/Str.h>
+
+static const u32 K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline u32 RotateRight(u32 x, u32 n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+bool Sha256Digest::operator==(const Sha256Digest& other) const
+{
+    return memcmp(bytes, other.bytes, SIZE) == 0;
+}
+
+bool Sha256Digest::operator<(const Sha256Digest& other) const
+{
+    return memcmp(bytes, other.bytes, SIZE) < 0;
+}
+
+std::string Sha256Digest::ToHex() const
+{
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+
+    std::string result;
+    result.resize(SIZE * 2);
+    for (int i = 0; i < SIZE; ++i) {
+        result[i * 2] = HEX_DIGITS[bytes[i] >> 4];
+        result[i * 2 + 1] = HEX_DIGITS[bytes[i] & 0xF];
+    }
+    return result;
+}
+
+bool Sha256Digest::FromHex(const std::string& hex)
+{
+    if (hex.size() != SIZE * 2)
+        return false;
+
+    for (int i = 0; i < SIZE * 2; ++i) {
+        char c = hex[i];
+        u8 digit;
+        if (c >= '0' && c <= '9')
+            digit = (u8)(c - '0');
+        else if (c >= 'a' && c <= 'f')
+            digit = (u8)(c - 'a' + 10);
+        else
+            return false;
+
+        if (i % 2 == 0)
+            bytes[i / 2] = (u8)(digit << 4);
+        else
+            bytes[i / 2] |= digit;
+    }
+    return true;
+}
+
+Sha256::Sha256()
+    : m_length(0)
+    , m_bufferLen(0)
+{
+    m_state[0] = 0x6a09e667;
+    m_state[1] = 0xbb67ae85;
+    m_state[2] = 0x3c6ef372;
+    m_state[3] = 0xa54ff53a;
+    m_state[4] = 0x510e527f;
+    m_state[5] = 0x9b05688c;
+    m_state[6] = 0x1f83d9ab;
+    m_state[7] = 0x5be0cd19;
+}
+
+void Sha256::Update(const void* data, size_t len)
+{
+    const u8* bytes = (const u8*)data;
+    m_length += len;
+
+    if (m_bufferLen > 0) {
+        size_t n = 64 - m_bufferLen;
+        if (n > len)
+            n = len;
+        memcpy(m_buffer + m_bufferLen, bytes, n);
+        m_bufferLen += (u32)n;
+        bytes += n;
+        len -= n;
+        if (m_bufferLen < 64)
+            return;
+        ProcessBlock(m_buffer);
+        m_bufferLen = 0;
+    }
+
+    for (; len >= 64; bytes += 64, len -= 64)
+        ProcessBlock(bytes);
+
+    if (len > 0) {
+        memcpy(m_buffer, bytes, len);
+        m_bufferLen = (u32)len;
+    }
+}
+
+void Sha256::UpdateStr(const char* str)
+{
+    Update(str, StrLen(str) + 1);
+}
+
+void Sha256::Update64(u64 n)
+{
+    n = EndianSwapLE64(n);
+    Update(&n, sizeof n);
+}
+
+void Sha256::Final(Sha256Digest* digest) const
+{
+    // Pad a copy, so that the hash can be finalised more than once or
+    // carried on with afterwards.
+    Sha256 copy(*this);
+
+    u64 bitLength = m_length * 8;
+    u8 padding[72] = { 0x80 };
+    size_t padLen = (copy.m_bufferLen < 56) ? 56 - copy.m_bufferLen
+                                            : 120 - copy.m_bufferLen;
+    for (int i = 0; i < 8; ++i)
+        padding[padLen + i] = (u8)(bitLength >> (56 - i * 8));
+    copy.Update(padding, padLen + 8);
+
+    for (int i = 0; i < 8; ++i) {
+        digest->bytes[i * 4] = (u8)(copy.m_state[i] >> 24);
+        digest->bytes[i * 4 + 1] = (u8)(copy.m_state[i] >> 16);
+        digest->bytes[i * 4 + 2] = (u8)(copy.m_state[i] >> 8);
+        digest->bytes[i * 4 + 3] = (u8)copy.m_state[i];
+    }
+}
+
+void Sha256::ProcessBlock(const u8* block)
+{
+    u32 w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = ((u32)block[i * 4] << 24) | ((u32)block[i * 4 + 1] << 16) |
+               ((u32)block[i * 4 + 2] << 8) | (u32)block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+        u32 s0 = RotateRight(w[i - 15], 7) ^ RotateRight(w[i - 15], 18) ^
+                 (w[i - 15] >> 3);
+        u32 s1 = RotateRight(w[i - 2], 17) ^ RotateRight(w[i - 2], 19) ^
+                 (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    u32 a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+    u32 e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+
+    for (int i = 0; i < 64; ++i) {
+        u32 s1 = RotateRight(e, 6) ^ RotateRight(e, 11) ^ RotateRight(e, 25);
+        u32 ch = (e & f) ^ (~e & g);
+        u32 t1 = h + s1 + ch + K[i] + w[i];
+        u32 s0 = RotateRight(a, 2) ^ RotateRight(a, 13) ^ RotateRight(a, 22);
+        u32 maj = (a & b) ^ (a & c) ^ (b & c);
+        u32 t2 = s0 + maj;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    m_state[0] += a;
+    m_state[1] += b;
+    m_state[2] += c;
+    m_state[3] += d;
+    m_state[4] += e;
+    m_state[5] += f;
+    m_state[6] += g;
+    m_state[7] += h;
+}
@@ -0,0 +1,46 @@
+#ifndef UTIL_SHA256_H
+#define UTIL_SHA256_H
+
+#include <stddef.h>
+#include <string>
+#include <Core/Types.h>
+
+struct Sha256Digest {
+    enum { SIZE = 32 };
+
+    bool operator==(const Sha256Digest& other) const;
+    bool operator!=(const Sha256Digest& other) const { return !(*this == other); }
+    bool operator<(const Sha256Digest& other) const;
+
+    // Lower-case hexadecimal, 64 characters.
+    std::string ToHex() const;
+    // Parses what ToHex() returns. Returns false if 'hex' isn't that.
+    bool FromHex(const std::string& hex);
+
+    u8 bytes[SIZE];
+};
+
+// Incremental SHA-256. The object can be copied to fork a hash that shares a
+// common prefix.
+class Sha256 {
+public:
+    Sha256();
+
+    void Update(const void* data, size_t len);
+    // Hashes the string including its null terminator, so that consecutive
+    // strings can't run into each other.
+    void UpdateStr(const char* str);
+    void Update64(u64 n);
+
+    void Final(Sha256Digest* digest) const;
+
+private:
+    void ProcessBlock(const u8* block);
+
+    u32 m_state[8];
+    u64 m_length;
+    u8 m_buffer[64];
+    u32 m_bufferLen;
+};
+
+#endif // UTIL_SHA256_H
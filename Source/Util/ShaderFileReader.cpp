@@ -0,0 +1,379 @@
+#include "ShaderFileReader.h"
+#include <stdio.h>
+#include <string.h>
+#include <Core/Endian.h>
+#include <Core/Macros.h>
+#include "BinaryReader.h"
+#include "Delta.h"
+#include "Lz.h"
+#include "ShaderFormat.h"
+
+ShaderFileReader::ShaderFileReader()
+    : m_data(NULL)
+    , m_size(0)
+    , m_version(0)
+    , m_nPermutations(0)
+    , m_optionBits(0)
+    , m_nRequirements(0)
+    , m_nLimits(0)
+    , m_flags(0)
+    , m_indexPos(0)
+    , m_constraintsPos(0)
+    , m_recordsPos(0)
+    , m_recordSize(0)
+    , m_legacyPermutations()
+{}
+
+static bool ReadMagic(BinaryReader& reader, const char* magic)
+{
+    const void* data = reader.ReadRawData(4);
+    return data && memcmp(data, magic, 4) == 0;
+}
+
+static u32 Load32(const u8* p)
+{
+    u32 n;
+    memcpy(&n, p, 4);
+    return EndianSwapLE32(n);
+}
+
+static u64 Load64(const u8* p)
+{
+    u64 n;
+    memcpy(&n, p, 8);
+    return EndianSwapLE64(n);
+}
+
+static bool ReadPermutationsV1(BinaryReader& reader, u32 nPermutations,
+                               std::vector<ShaderPermutation>* permutations)
+{
+    size_t recordPos = reader.Tell();
+    for (u32 i = 0; i < nPermutations; ++i) {
+        reader.Seek(recordPos);
+
+        ShaderPermutation permutation;
+        permutation.permuteMask = reader.Read64();
+        permutation.size = reader.Read32();
+        reader.Read32(); // PS data length
+        u32 ofsNextPermutation = reader.Read32();
+        reader.Read32(); // padding
+        permutation.data = (const u8*)reader.ReadRawData(permutation.size);
+        permutation.compressed = false;
+        permutation.baseRecord = SHADER_NO_BASE_RECORD;
+        permutation.deltaSize = 0;
+        permutation.uncompressedSize = permutation.size;
+        permutation.functionId = 0;
+        if (reader.Failed() || ofsNextPermutation == 0)
+            return false;
+
+        permutations->push_back(permutation);
+        recordPos += ofsNextPermutation;
+    }
+    return true;
+}
+
+bool ShaderFileReader::Open(const void* data, size_t size)
+{
+    m_data = NULL;
+    m_size = 0;
+    m_version = 0;
+    m_nPermutations = 0;
+    m_optionBits = 0;
+    m_nRequirements = 0;
+    m_nLimits = 0;
+    m_flags = 0;
+    m_legacyPermutations.clear();
+
+    BinaryReader reader(data, size);
+
+    if (!ReadMagic(reader, SHADER_FILE_MAGIC))
+        return false;
+    u32 version = reader.Read32();
+    if (!ReadMagic(reader, SHADER_FILE_API_MAGIC))
+        return false;
+    u32 nPermutations = reader.Read32();
+    if (reader.Failed())
+        return false;
+
+    m_data = (const u8*)data;
+    m_size = size;
+
+    if (version == SHADER_FORMAT_VERSION_V1) {
+        if (!ReadPermutationsV1(reader, nPermutations, &m_legacyPermutations))
+            return false;
+    } else if (version == SHADER_FORMAT_VERSION) {
+        reader.Read32(); // nBlobs
+        u32 flags = reader.Read32();
+        u64 optionBits = reader.Read64();
+        u32 nRequirements = reader.Read32();
+        u32 nLimits = reader.Read32();
+        if (reader.Failed() || (flags & ~SHADER_FILE_FLAGS) != 0)
+            return false;
+
+        u64 constraintsPos = SHADER_FILE_HEADER_SIZE +
+                             (u64)nPermutations * SHADER_FILE_INDEX_ENTRY_SIZE;
+        u64 recordsPos = constraintsPos +
+                         (u64)nRequirements * SHADER_FILE_REQUIREMENT_SIZE +
+                         (u64)nLimits * SHADER_FILE_LIMIT_SIZE;
+        u32 recordSize = ShaderFileRecordSize(flags);
+        u64 tableSize = (u64)nPermutations * recordSize;
+        if (recordsPos > size || tableSize > size - recordsPos)
+            return false;
+        m_optionBits = optionBits;
+        m_nRequirements = nRequirements;
+        m_nLimits = nLimits;
+        m_flags = flags;
+        m_indexPos = SHADER_FILE_HEADER_SIZE;
+        m_constraintsPos = (size_t)constraintsPos;
+        m_recordsPos = (size_t)recordsPos;
+        m_recordSize = recordSize;
+    } else {
+        return false;
+    }
+
+    m_version = version;
+    m_nPermutations = nPermutations;
+    return true;
+}
+
+bool ShaderFileReader::ReadRecord(size_t recordPos,
+                                  ShaderPermutation* permutation) const
+{
+    if (recordPos > m_size || m_size - recordPos < m_recordSize)
+        return false;
+
+    const u8* record = m_data + recordPos;
+    u32 blobOffset = Load32(record + 8);
+    u32 blobLength = Load32(record + 12);
+    if (blobOffset > m_size || blobLength > m_size - blobOffset)
+        return false;
+
+    permutation->permuteMask = Load64(record);
+    permutation->data = m_data + blobOffset;
+    permutation->size = blobLength;
+    permutation->compressed = (m_flags & SHADER_FILE_FLAG_COMPRESSED) != 0;
+    permutation->baseRecord = SHADER_NO_BASE_RECORD;
+    permutation->deltaSize = 0;
+    permutation->uncompressedSize = blobLength;
+    permutation->functionId = 0;
+    if (m_flags & SHADER_FILE_FLAG_SHARED_LIBRARIES)
+        permutation->functionId = Load64(record + 16);
+
+    // The blob starts with its lengths (and base) unless it's stored plain.
+    u32 blobHeaderSize = 0;
+    if (m_flags & SHADER_FILE_FLAG_DELTA)
+        blobHeaderSize = 12;
+    else if (m_flags & SHADER_FILE_FLAG_COMPRESSED)
+        blobHeaderSize = 4;
+    if (blobLength < blobHeaderSize)
+        return false;
+    if (blobHeaderSize >= 4)
+        permutation->uncompressedSize = Load32(permutation->data);
+    if (blobHeaderSize >= 12) {
+        permutation->baseRecord = Load32(permutation->data + 4);
+        permutation->deltaSize = Load32(permutation->data + 8);
+    }
+    permutation->data += blobHeaderSize;
+    permutation->size -= blobHeaderSize;
+    return true;
+}
+
+bool ShaderFileReader::GetPermutation(size_t index,
+                                      ShaderPermutation* permutation) const
+{
+    ASSERT(permutation);
+
+    if (index >= m_nPermutations)
+        return false;
+
+    if (m_version != SHADER_FORMAT_VERSION) {
+        *permutation = m_legacyPermutations[index];
+        return true;
+    }
+
+    return ReadRecord(m_recordsPos + index * m_recordSize, permutation);
+}
+
+std::string ShaderFileReader::GetFunctionName(
+    const char* name, const ShaderPermutation& permutation) const
+{
+    ASSERT(name);
+
+    if (!HasSharedLibraries())
+        return name;
+    char suffix[32];
+    snprintf(suffix, sizeof suffix, SHADER_FUNCTION_SUFFIX_FORMAT,
+             (unsigned long long)permutation.functionId);
+    return std::string(name) + suffix;
+}
+
+bool ShaderFileReader::FindPermutation(u64 permuteMask,
+                                       ShaderPermutation* permutation) const
+{
+    ASSERT(permutation);
+
+    if (m_version != SHADER_FORMAT_VERSION) {
+        for (const ShaderPermutation& legacy : m_legacyPermutations) {
+            if (legacy.permuteMask == permuteMask) {
+                *permutation = legacy;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const u8* entry = FindIndexEntry(permuteMask);
+    if (!entry)
+        return false;
+    return ReadRecord(Load32(entry + 8), permutation) &&
+           permutation->permuteMask == permuteMask;
+}
+
+bool ShaderFileReader::IsPermutationSkipped(u64 permuteMask) const
+{
+    return IsPermutationUnbuilt(permuteMask) &&
+           !IsAllowedByConstraints(permuteMask);
+}
+
+bool ShaderFileReader::IsPermutationDeferred(u64 permuteMask) const
+{
+    return IsPermutationUnbuilt(permuteMask) &&
+           IsAllowedByConstraints(permuteMask);
+}
+
+bool ShaderFileReader::IsPermutationUnbuilt(u64 permuteMask) const
+{
+    // Version 1 files have no constraints, and are always built in full.
+    if (m_version != SHADER_FORMAT_VERSION)
+        return false;
+    return (permuteMask & ~m_optionBits) == 0 && !FindIndexEntry(permuteMask);
+}
+
+const u8* ShaderFileReader::FindIndexEntry(u64 permuteMask) const
+{
+    // Binary search of the index.
+    size_t lo = 0;
+    size_t hi = m_nPermutations;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const u8* entry = m_data + m_indexPos + mid * SHADER_FILE_INDEX_ENTRY_SIZE;
+        u64 entryMask = Load64(entry);
+        if (entryMask < permuteMask) {
+            lo = mid + 1;
+        } else if (entryMask > permuteMask) {
+            hi = mid;
+        } else {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+bool ShaderFileReader::IsAllowedByConstraints(u64 permuteMask) const
+{
+    const u8* requirement = m_data + m_constraintsPos;
+    for (u32 i = 0; i < m_nRequirements; ++i) {
+        u64 option = Load64(requirement);
+        u64 required = Load64(requirement + 8);
+        if ((permuteMask & option) && (permuteMask & required) != required)
+            return false;
+        requirement += SHADER_FILE_REQUIREMENT_SIZE;
+    }
+
+    const u8* limit = requirement;
+    for (u32 i = 0; i < m_nLimits; ++i) {
+        u64 group = Load64(limit);
+        if ((u32)__builtin_popcountll(permuteMask & group) > Load32(limit + 8))
+            return false;
+        limit += SHADER_FILE_LIMIT_SIZE;
+    }
+    return true;
+}
+
+bool ShaderFileReader::GetPermutationBytes(const ShaderPermutation& permutation,
+                                           u8* output) const
+{
+    return IsSizePlausible(permutation, 0) &&
+           RebuildBytes(permutation, 0, output);
+}
+
+bool ShaderFileReader::GetPermutationBytes(const ShaderPermutation& permutation,
+                                           std::vector<u8>* output) const
+{
+    ASSERT(output);
+
+    if (!IsSizePlausible(permutation, 0))
+        return false;
+    output->resize(permutation.uncompressedSize);
+    return RebuildBytes(permutation, 0, output->data());
+}
+
+// Sizes come straight from the file, so they are checked against what the
+// stored bytes could possibly decode to before anything is allocated for
+// them. Checks the permutation's bases too.
+bool ShaderFileReader::IsSizePlausible(const ShaderPermutation& permutation,
+                                       u32 depth) const
+{
+    size_t maxDataSize = permutation.compressed
+                             ? LzMaxDecompressedSize(permutation.size)
+                             : permutation.size;
+    if (permutation.baseRecord == SHADER_NO_BASE_RECORD)
+        return permutation.uncompressedSize <= maxDataSize;
+
+    ShaderPermutation base;
+    return permutation.deltaSize <= maxDataSize &&
+           depth < SHADER_MAX_DELTA_DEPTH &&
+           GetPermutation(permutation.baseRecord, &base) &&
+           IsSizePlausible(base, depth + 1) &&
+           permutation.uncompressedSize <=
+               DeltaMaxDecodedSize(base.uncompressedSize,
+                                   permutation.deltaSize);
+}
+
+bool ShaderFileReader::RebuildBytes(const ShaderPermutation& permutation,
+                                    u32 depth, u8* output) const
+{
+    if (permutation.baseRecord == SHADER_NO_BASE_RECORD) {
+        if (permutation.compressed) {
+            return LzDecompress(permutation.data, permutation.size, output,
+                                permutation.uncompressedSize);
+        }
+        if (permutation.size != permutation.uncompressedSize)
+            return false;
+        memcpy(output, permutation.data, permutation.size);
+        return true;
+    }
+
+    // The chain of bases is bounded, which also rules out cycles in a
+    // corrupt file.
+    ShaderPermutation base;
+    if (depth == SHADER_MAX_DELTA_DEPTH ||
+        !GetPermutation(permutation.baseRecord, &base))
+        return false;
+    std::vector<u8> baseBytes(base.uncompressedSize);
+    if (!RebuildBytes(base, depth + 1, baseBytes.data()))
+        return false;
+
+    const u8* delta = permutation.data;
+    std::vector<u8> decompressedDelta;
+    if (permutation.compressed) {
+        decompressedDelta.resize(permutation.deltaSize);
+        if (!LzDecompress(permutation.data, permutation.size,
+                          decompressedDelta.data(), permutation.deltaSize))
+            return false;
+        delta = decompressedDelta.data();
+    } else if (permutation.size != permutation.deltaSize) {
+        return false;
+    }
+
+    return DeltaDecode(baseBytes.data(), baseBytes.size(), delta,
+                       permutation.deltaSize, output,
+                       permutation.uncompressedSize);
+}
+
+bool MappedShaderFile::Open(const char* path)
+{
+    if (!m_file.Open(path))
+        return false;
+    return m_reader.Open(m_file.Data(), m_file.Size());
+}
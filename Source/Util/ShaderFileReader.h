@@ -0,0 +1,130 @@
+#ifndef UTIL_SHADERFILEREADER_H
+#define UTIL_SHADERFILEREADER_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <Core/Types.h>
+#include <Os/MappedFile.h>
+#include "ShaderFormat.h"
+
+struct ShaderPermutation {
+    u64 permuteMask;
+    // The metallib as stored, which is compressed if 'compressed' is set, and
+    // a delta of deltaSize bytes if there's a base record.
+    const u8* data;
+    u32 size;
+    bool compressed;
+    u32 baseRecord;
+    u32 deltaSize;
+    // The size of the metallib itself.
+    u32 uncompressedSize;
+    // In a file with shared libraries, what the permutation's functions are
+    // renamed with (see ShaderFormat.h), and 0 otherwise.
+    u64 functionId;
+};
+
+// Reads a .shd file held in memory. Nothing is copied: permutation data
+// points into the buffer, which must outlive the reader. Only the header is
+// parsed up front; lookups read the index and records in place. In a
+// compressed or delta-encoded file, each permutation is decoded separately,
+// by GetPermutationBytes(), only when it's wanted.
+class ShaderFileReader {
+public:
+    ShaderFileReader();
+
+    // Returns false if the buffer isn't a .shd file of a version that this
+    // reader understands.
+    bool Open(const void* data, size_t size);
+
+    u32 GetVersion() const { return m_version; }
+    bool IsCompressed() const
+    {
+        return (m_flags & SHADER_FILE_FLAG_COMPRESSED) != 0;
+    }
+
+    // Whether several permutations share each metallib, with their
+    // functions renamed by GetFunctionName().
+    bool HasSharedLibraries() const
+    {
+        return (m_flags & SHADER_FILE_FLAG_SHARED_LIBRARIES) != 0;
+    }
+
+    // The name that the function 'name' in the shader's source has in the
+    // permutation's metallib.
+    std::string GetFunctionName(const char* name,
+                                const ShaderPermutation& permutation) const;
+
+    // Permutations are numbered in the order they appear in the file.
+    size_t GetPermutationCount() const { return m_nPermutations; }
+
+    // These return false if the file is corrupt, or if there is no such
+    // permutation.
+    bool GetPermutation(size_t index, ShaderPermutation* permutation) const;
+    bool FindPermutation(u64 permuteMask, ShaderPermutation* permutation) const;
+
+    // Writes the permutation's metallib to 'output', which must have room for
+    // uncompressedSize bytes, decompressing it and rebuilding it from its
+    // base records if need be. Returns false if the data is corrupt.
+    bool GetPermutationBytes(const ShaderPermutation& permutation,
+                             u8* output) const;
+    bool GetPermutationBytes(const ShaderPermutation& permutation,
+                             std::vector<u8>* output) const;
+
+    // Whether the permutation was left out of the file on purpose, because
+    // the shader's constraints rule that combination of options out.
+    bool IsPermutationSkipped(u64 permuteMask) const;
+    // Whether the permutation was left out because the build only compiled
+    // the permutations in a usage profile. It can be built when needed.
+    bool IsPermutationDeferred(u64 permuteMask) const;
+
+private:
+    ShaderFileReader(const ShaderFileReader&);
+    ShaderFileReader& operator=(const ShaderFileReader&);
+
+    bool ReadRecord(size_t recordPos, ShaderPermutation* permutation) const;
+    // 'depth' is the number of base records followed so far.
+    bool IsSizePlausible(const ShaderPermutation& permutation,
+                         u32 depth) const;
+    bool RebuildBytes(const ShaderPermutation& permutation, u32 depth,
+                      u8* output) const;
+    // Returns the index entry for the mask, or NULL if there isn't one.
+    const u8* FindIndexEntry(u64 permuteMask) const;
+    // Whether the mask is one of the shader's permutations but isn't in the
+    // file.
+    bool IsPermutationUnbuilt(u64 permuteMask) const;
+    bool IsAllowedByConstraints(u64 permuteMask) const;
+
+    const u8* m_data;
+    size_t m_size;
+    u32 m_version;
+    u32 m_nPermutations;
+    u64 m_optionBits;
+    u32 m_nRequirements;
+    u32 m_nLimits;
+    // SHADER_FILE_FLAG_* bits.
+    u32 m_flags;
+    size_t m_indexPos;
+    size_t m_constraintsPos;
+    size_t m_recordsPos;
+    u32 m_recordSize;
+
+    // Version 1 files have no index, so their records are parsed up front.
+    std::vector<ShaderPermutation> m_legacyPermutations;
+};
+
+// A .shd file mapped into memory, for loading permutations without reading
+// the whole file.
+class MappedShaderFile {
+public:
+    // Returns false if the file can't be mapped or isn't a valid .shd file.
+    bool Open(const char* path);
+
+    const ShaderFileReader& GetReader() const { return m_reader; }
+
+private:
+    MappedFile m_file;
+    ShaderFileReader m_reader;
+};
+
+#endif // UTIL_SHADERFILEREADER_H
@@ -0,0 +1,127 @@
+#ifndef UTIL_SHADERFORMAT_H
+#define UTIL_SHADERFORMAT_H
+
+#include <Core/Types.h>
+
+// Layout of a .shd file (all values little-endian, aligned as written by
+// BinaryWriter). Version 5:
+//
+//   "RDHS"  u32 version  "LTEM"  u32 nPermutations  u32 nBlobs  u32 flags
+//   u64 optionBits  u32 nRequirements  u32 nLimits
+//
+// followed by an index of nPermutations entries, sorted by permuteMask so
+// that a permutation can be found with a binary search:
+//
+//   u64 permuteMask
+//   u32 recordOffset (from the start of the file)
+//   u32 padding
+//
+// then the shader's '#pragma permutation' constraints: nRequirements of
+//
+//   u64 option       a permutation with this bit set...
+//   u64 required     ...must have all of these bits set too
+//
+// and nLimits of
+//
+//   u64 group        a permutation can have at most 'limit' of these bits set
+//   u32 limit
+//   u32 padding
+//
+// The shader's permutations are the combinations of the bits in optionBits.
+// One that isn't in the index wasn't built: if the constraints rule it out,
+// it was skipped, and otherwise it wasn't in the usage profile that the file
+// was built with, and can be built when needed.
+//
+// The constraints are followed by nPermutations records, in descending order
+// of the number of option bits set:
+//
+//   u64 permuteMask
+//   u32 blobOffset (from the start of the file)
+//   u32 blobLength
+//
+// followed by nBlobs blobs. Each blob is a compiled metallib, stored once no
+// matter how many records refer to it.
+//
+// With SHADER_FILE_FLAG_SHARED_LIBRARIES set, the permutations are linked
+// several to a metallib, and each record has another field:
+//
+//   u64 permuteMask
+//   u32 blobOffset (from the start of the file)
+//   u32 blobLength
+//   u64 functionId
+//
+// Every permutation defines the same entry points, so in a shared library
+// each permutation's are renamed: a function 'name' in the source is
+// name_XXXXXXXXXXXXXXXX in the library, where the Xs are functionId in
+// lowercase hex, 16 digits. Records with equal functionIds are the same
+// compiled permutation. Load a blob as a library once, however many records
+// refer to it, and look the functions up by their renamed names.
+//
+// With SHADER_FILE_FLAG_COMPRESSED set
+// in the header, each blob is instead
+//
+//   u32 uncompressedLength
+//   the metallib compressed as one LZ block (see Util/Lz.h)
+//
+// so that any permutation can be decompressed on its own.
+//
+// With SHADER_FILE_FLAG_DELTA set, every blob starts with
+//
+//   u32 uncompressedLength
+//   u32 baseRecord  (SHADER_NO_BASE_RECORD if none)
+//   u32 deltaLength (0 if there's no base record)
+//
+// and a blob with a base record holds a delta (see Util/Delta.h) of
+// deltaLength bytes that rebuilds the metallib from the base record's. Base
+// records come earlier in the file, and a permutation is at most
+// SHADER_MAX_DELTA_DEPTH bases away from one that is stored whole. If the
+// file is compressed too, the delta or metallib is an LZ block.
+//
+// Version 1 (still readable) has no blob table. Each record holds its own
+// copy of the data, and records are chained together:
+//
+//   u64 permuteMask
+//   u32 vsDataLength
+//   u32 psDataLength       (always 0)
+//   u32 ofsNextPermutation (from the start of this record, before padding)
+//   u32 padding
+//   u8  data[vsDataLength]
+
+const char SHADER_FILE_MAGIC[] = "RDHS";
+const char SHADER_FILE_API_MAGIC[] = "LTEM";
+
+const u32 SHADER_FORMAT_VERSION = 5;
+const u32 SHADER_FORMAT_VERSION_V1 = 1;
+
+const u32 SHADER_FILE_HEADER_SIZE = 40;
+const u32 SHADER_FILE_INDEX_ENTRY_SIZE = 16;
+const u32 SHADER_FILE_REQUIREMENT_SIZE = 16;
+const u32 SHADER_FILE_LIMIT_SIZE = 16;
+const u32 SHADER_FILE_RECORD_SIZE = 16;
+const u32 SHADER_FILE_SHARED_RECORD_SIZE = 24;
+
+const u32 SHADER_FILE_FLAG_COMPRESSED = 1;
+const u32 SHADER_FILE_FLAG_DELTA = 2;
+const u32 SHADER_FILE_FLAG_SHARED_LIBRARIES = 4;
+const u32 SHADER_FILE_FLAGS = SHADER_FILE_FLAG_COMPRESSED |
+                              SHADER_FILE_FLAG_DELTA |
+                              SHADER_FILE_FLAG_SHARED_LIBRARIES;
+
+// The size of each record in a file with these flags.
+inline u32 ShaderFileRecordSize(u32 flags)
+{
+    return (flags & SHADER_FILE_FLAG_SHARED_LIBRARIES)
+               ? SHADER_FILE_SHARED_RECORD_SIZE
+               : SHADER_FILE_RECORD_SIZE;
+}
+
+// Offsets are 32-bit, so no file can be bigger than this.
+const u64 SHADER_FILE_MAX_SIZE = 0xffffffff;
+
+// Appended to a function's name, with the functionId, in a shared library.
+const char SHADER_FUNCTION_SUFFIX_FORMAT[] = "_%016llx";
+
+const u32 SHADER_NO_BASE_RECORD = 0xffffffff;
+const u32 SHADER_MAX_DELTA_DEPTH = 8;
+
+#endif // UTIL_SHADERFORMAT_H
@@ -0,0 +1,48 @@
+#ifndef UTIL_SHADERPACKFORMAT_H
+#define UTIL_SHADERPACKFORMAT_H
+
+#include <Core/Types.h>
+
+// Layout of a .shp pack, which holds many shaders in one file so that they
+// can all be mapped at once (all values little-endian). Version 1:
+//
+//   "KPHS"  u32 version  u32 nShaders  u32 nBlobs
+//
+// followed by a directory of nShaders entries, sorted by name (compared
+// bytewise) so that a shader can be found with a binary search:
+//
+//   u32 nameOffset   (from the start of the pack)
+//   u32 nameLength   (not counting the terminating NUL)
+//   u32 shaderOffset (from the start of the pack)
+//   u32 shaderLength
+//
+// then the names, each NUL-terminated, then the shaders. Each shader is the
+// header, index, constraints and records of a version 5 .shd file (see
+// ShaderFormat.h), shaderLength bytes long and starting on a
+// SHADER_PACK_PAGE_SIZE boundary. Offsets within it are from its own start,
+// as in a .shd file, but its records' blobs are past its end: the shaders are
+// followed by nBlobs blobs that all of them share, each stored once no matter
+// how many shaders' records refer to it.
+//
+// Only the shaders are page-aligned. Finding a permutation searches a
+// shader's index and records in place, and a page of its own keeps that
+// from faulting in other shaders' tables. A blob is only read whole, once,
+// when its permutation is loaded, and nothing that reads it needs it
+// aligned; padding every blob (most are a few KB) out to a page would
+// multiply the size of the pack for no gain.
+//
+// Every offset is a u32, so a pack can't be 4 GB or more.
+
+const char SHADER_PACK_MAGIC[] = "KPHS";
+
+const u32 SHADER_PACK_VERSION = 1;
+
+const u32 SHADER_PACK_HEADER_SIZE = 16;
+const u32 SHADER_PACK_DIRECTORY_ENTRY_SIZE = 16;
+
+// The largest page size of the devices that packs are mapped on.
+const u32 SHADER_PACK_PAGE_SIZE = 16384;
+
+const u64 SHADER_PACK_MAX_SIZE = 0xffffffff;
+
+#endif // UTIL_SHADERPACKFORMAT_H
@@ -0,0 +1,116 @@
+#include "ShaderPackReader.h"
+#include <string.h>
+#include <Core/Endian.h>
+#include <Core/Macros.h>
+#include <Core/Str.h>
+#include "ShaderPackFormat.h"
+
+ShaderPackReader::ShaderPackReader()
+    : m_data(NULL)
+    , m_size(0)
+    , m_nShaders(0)
+{}
+
+static u32 Load32(const u8* p)
+{
+    u32 n;
+    memcpy(&n, p, 4);
+    return EndianSwapLE32(n);
+}
+
+bool ShaderPackReader::Open(const void* data, size_t size)
+{
+    m_data = NULL;
+    m_size = 0;
+    m_nShaders = 0;
+
+    const u8* bytes = (const u8*)data;
+    if (size < SHADER_PACK_HEADER_SIZE ||
+        memcmp(bytes, SHADER_PACK_MAGIC, 4) != 0 ||
+        Load32(bytes + 4) != SHADER_PACK_VERSION)
+        return false;
+
+    u32 nShaders = Load32(bytes + 8);
+    u64 directorySize = (u64)nShaders * SHADER_PACK_DIRECTORY_ENTRY_SIZE;
+    if (directorySize > size - SHADER_PACK_HEADER_SIZE)
+        return false;
+
+    m_data = bytes;
+    m_size = size;
+    m_nShaders = nShaders;
+    return true;
+}
+
+const char* ShaderPackReader::GetShaderName(size_t index) const
+{
+    if (index >= m_nShaders)
+        return NULL;
+
+    const u8* entry = m_data + SHADER_PACK_HEADER_SIZE +
+                      index * SHADER_PACK_DIRECTORY_ENTRY_SIZE;
+    u32 nameOffset = Load32(entry);
+    u32 nameLength = Load32(entry + 4);
+    if (nameOffset > m_size || nameLength >= m_size - nameOffset ||
+        m_data[nameOffset + nameLength] != '\0')
+        return NULL;
+    return (const char*)m_data + nameOffset;
+}
+
+bool ShaderPackReader::OpenShader(size_t index, ShaderFileReader* reader) const
+{
+    ASSERT(reader);
+
+    if (index >= m_nShaders)
+        return false;
+
+    // The reader gets the rest of the pack, since the shader's blobs follow
+    // all of the shaders.
+    const u8* entry = m_data + SHADER_PACK_HEADER_SIZE +
+                      index * SHADER_PACK_DIRECTORY_ENTRY_SIZE;
+    u32 shaderOffset = Load32(entry + 8);
+    if (shaderOffset > m_size)
+        return false;
+    return reader->Open(m_data + shaderOffset, m_size - shaderOffset);
+}
+
+bool ShaderPackReader::FindShader(const char* name,
+                                  ShaderFileReader* reader) const
+{
+    ASSERT(name);
+    ASSERT(reader);
+
+    // Binary search of the directory.
+    size_t nameLength = StrLen(name);
+    size_t lo = 0;
+    size_t hi = m_nShaders;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const char* entryName = GetShaderName(mid);
+        if (!entryName)
+            return false;
+
+        const u8* entry = m_data + SHADER_PACK_HEADER_SIZE +
+                          mid * SHADER_PACK_DIRECTORY_ENTRY_SIZE;
+        size_t entryLength = Load32(entry + 4);
+        int order = memcmp(entryName, name,
+                           entryLength < nameLength ? entryLength : nameLength);
+        if (order == 0 && entryLength != nameLength)
+            order = entryLength < nameLength ? -1 : 1;
+
+        if (order < 0) {
+            lo = mid + 1;
+        } else if (order > 0) {
+            hi = mid;
+        } else {
+            return OpenShader(mid, reader);
+        }
+    }
+    return false;
+}
+
+bool MappedShaderPack::Open(const char* path)
+{
+    if (!m_file.Open(path))
+        return false;
+    return m_reader.Open(m_file.Data(), m_file.Size());
+}
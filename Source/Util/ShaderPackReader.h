@@ -0,0 +1,55 @@
+#ifndef UTIL_SHADERPACKREADER_H
+#define UTIL_SHADERPACKREADER_H
+
+#include <stddef.h>
+#include <Core/Types.h>
+#include <Os/MappedFile.h>
+#include "ShaderFileReader.h"
+
+// Reads a .shp pack held in memory. Like ShaderFileReader, nothing is copied
+// and only the header is parsed up front: finding a shader is a binary search
+// of the directory in place.
+class ShaderPackReader {
+public:
+    ShaderPackReader();
+
+    // Returns false if the buffer isn't a pack of a version that this reader
+    // understands.
+    bool Open(const void* data, size_t size);
+
+    // Shaders are numbered in order of name.
+    size_t GetShaderCount() const { return m_nShaders; }
+
+    // Returns NULL if the pack is corrupt or there is no such shader.
+    const char* GetShaderName(size_t index) const;
+
+    // These open 'reader' on the shader, which shares the pack's buffer.
+    // They return false if the pack is corrupt, or if there is no such
+    // shader.
+    bool OpenShader(size_t index, ShaderFileReader* reader) const;
+    bool FindShader(const char* name, ShaderFileReader* reader) const;
+
+private:
+    ShaderPackReader(const ShaderPackReader&);
+    ShaderPackReader& operator=(const ShaderPackReader&);
+
+    const u8* m_data;
+    size_t m_size;
+    u32 m_nShaders;
+};
+
+// A pack mapped into memory as a whole, so that opening any of its shaders
+// needs no further system calls.
+class MappedShaderPack {
+public:
+    // Returns false if the file can't be mapped or isn't a valid pack.
+    bool Open(const char* path);
+
+    const ShaderPackReader& GetReader() const { return m_reader; }
+
+private:
+    MappedFile m_file;
+    ShaderPackReader m_reader;
+};
+
+#endif // UTIL_SHADERPACKREADER_H